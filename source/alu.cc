@@ -1,3 +1,5 @@
+#include <time.h>
+
 #include "includes/virtualmachine.h"
 #include "includes/alu.h"
 #include "includes/pipeline.h"
@@ -58,7 +60,7 @@ bool ALU::shift(reg_t &offset, reg_t val, reg_t shift, reg_t op)
         if (val & mask)
             return (true);
         return (false);
-    
+        
         case kShiftASR:
         offset = (val >> shift);
         // Sign extend by filling in vacant bits with original sign bit
@@ -75,7 +77,7 @@ bool ALU::shift(reg_t &offset, reg_t val, reg_t shift, reg_t op)
         if (val & mask)
             return (true);
         return (false);
-    
+        
         case kShiftLSR:
         // Same thing as LSL, but check the MSB of the discarded portion
         offset = (val >> shift);
@@ -118,9 +120,9 @@ void ALU::shiftOffset(reg_t &offset, reg_t &val)
     }
     
     if (ALU::shift(offset, val, shift, operation))
-        _vm->_psr = C_SET;
+        SET_C;
     else
-        _vm->_psr = C_CLEAR;
+        CLEAR_C;
 }
 
 void ALU::shiftOffset(reg_t &offset)
@@ -147,9 +149,21 @@ void ALU::shiftOffset(reg_t &offset)
     }
     
     if (ALU::shift(offset, value, shift, operation))
-        _vm->_psr = C_SET;
+        SET_C;
     else
-        _vm->_psr = C_CLEAR;
+        CLEAR_C;
+}
+
+// Signed overflow: the operands agreed on a sign (add) or disagreed on
+// it (subtract), and the result has the other one
+static inline bool addOverflows(reg_t a, reg_t b, reg_t r)
+{
+    return ((~(a ^ b) & (a ^ r)) >> 31);
+}
+
+static inline bool subOverflows(reg_t a, reg_t b, reg_t r)
+{
+    return (((a ^ b) & (a ^ r)) >> 31);
 }
 
 cycle_t ALU::dataProcessing(DPFlags &instruction)
@@ -157,6 +171,7 @@ cycle_t ALU::dataProcessing(DPFlags &instruction)
     bool arithmetic = true;
     bool commit = true;
     bool alu_carry = false;
+    bool alu_overflow = false;
     reg_t dest;
     reg_t source = _vm->selectRegister(instruction.rs);
     
@@ -167,6 +182,7 @@ cycle_t ALU::dataProcessing(DPFlags &instruction)
         dest = source + instruction.offset;
         // check if there would have been a carry out (a+b<a)
         if (dest < source) alu_carry = true;
+        alu_overflow = addOverflows(source, instruction.offset, dest);
         break;
         
         case kSUB:
@@ -174,13 +190,12 @@ cycle_t ALU::dataProcessing(DPFlags &instruction)
         dest = source - instruction.offset;
         // check if there would have been a carry out (a-b>a)
         if (dest > source) alu_carry = true;
+        alu_overflow = subOverflows(source, instruction.offset, dest);
         break;
         
         case kMUL:
-        if (!instruction.i) shiftOffset(instruction.offset);
-        dest = ((source) * instruction.offset); //store lowest 32 bits on Rd
-        // TODO: Make this use the pq registers
-        break;
+        // All the kinds of multiply write pq, so they're handled apart
+        return (multiply(instruction, source));
         
         case kMOD:
         if (!instruction.i) shiftOffset(instruction.offset);
@@ -237,6 +252,7 @@ cycle_t ALU::dataProcessing(DPFlags &instruction)
         dest = source - instruction.offset;
         // check if there would have been a carry out (a-b>a)
         if (dest > source) alu_carry = true;
+        alu_overflow = subOverflows(source, instruction.offset, dest);
         break;
         
         case kCMN:
@@ -245,6 +261,7 @@ cycle_t ALU::dataProcessing(DPFlags &instruction)
         dest = source + instruction.offset;
         // check if there would have been a carry out (a+b<a)
         if (dest < source) alu_carry = true;
+        alu_overflow = addOverflows(source, instruction.offset, dest);
         break;
         
         case kTST:
@@ -269,6 +286,8 @@ cycle_t ALU::dataProcessing(DPFlags &instruction)
         
         case kNOP:
         default:
+        // Make sure writeback doesn't see the last op's result
+        _result = false;
         return (_timing.op[kNOP]);
     }
     
@@ -283,7 +302,7 @@ cycle_t ALU::dataProcessing(DPFlags &instruction)
         {
             // the V flag in the CPSR will be set if an overflow occurs
             // into bit 31 of the result
-            if (dest & kMSBMask != source & kMSBMask)
+            if (alu_overflow)
                 SET_V;
             else
                 CLEAR_V;
@@ -299,7 +318,7 @@ cycle_t ALU::dataProcessing(DPFlags &instruction)
                 SET_Z;
             else
                 CLEAR_Z;
-                
+            
             // the C flag will be set to the carry out of bit 31 of the ALU
             // NOTE: the following detection may not work correctly on
             // 32bit machines
@@ -336,6 +355,66 @@ cycle_t ALU::dataProcessing(DPFlags &instruction)
     return (_timing.op[instruction.op]);
 }
 
+bool ALU::accumulates(char kind)
+{
+    return (kind >= kMULAccumulate && kind <= kMULAccumulateLongUnsigned);
+}
+
+cycle_t ALU::multiply(DPFlags &f, reg_t source)
+{
+    if (!f.i) shiftOffset(f.offset);
+    
+    char kind = f.rd;
+    bool is_unsigned = (kind == kMULUnsigned ||
+        kind == kMULAccumulateLongUnsigned);
+    
+    unsigned long long product;
+    if (is_unsigned)
+        product = (unsigned long long)source * f.offset;
+    else
+        product = (unsigned long long)((long long)(signed int)source *
+            (signed int)f.offset);
+    
+    cycle_t timing = _timing.op[kMUL];
+    if (accumulates(kind))
+    {
+        reg_t low = _vm->selectRegister(kPQ0Code);
+        reg_t high = _vm->selectRegister(kPQ1Code);
+        
+        if (kind == kMULAccumulate)
+        {
+            // Only the low word accumulates, the high one is left alone
+            product = ((unsigned long long)high << 32) |
+                (reg_t)(low + (reg_t)product);
+            timing = _timing.op[kMACTiming];
+        } else {
+            // Two's complement, so signed and unsigned add the same way
+            product += ((unsigned long long)high << 32) | low;
+            timing = _timing.op[kMACLTiming];
+        }
+    }
+    
+    // N and Z describe the whole 64 bit result, C and V are left alone
+    if (f.s)
+    {
+        if (product >> 63)
+            SET_N;
+        else
+            CLEAR_N;
+        
+        if (product == 0)
+            SET_Z;
+        else
+            CLEAR_Z;
+    }
+    
+    _result = true;
+    _output = (reg_t)product;
+    _aux_out = (reg_t)(product >> 32);
+    
+    return (timing);
+}
+
 cycle_t ALU::singleTransfer(STFlags &f)
 {
     // The base register is where the address comes from
@@ -399,3 +478,278 @@ cycle_t ALU::singleTransfer(STFlags &f)
     return (0);
 }
 
+
+// Operand two for one form, with everything about the encoding that decode
+// already knew taken out.  MOV shifts its source instead of rm, by a literal
+// or register laid out differently.
+template <int form, bool mov>
+static inline reg_t kernelOperand(VirtualMachine *vm, reg_t offset,
+    reg_t source)
+{
+    if (form == kFormImmediate) return (offset);
+    
+    bool by_register = (form == kFormLSLRegister ||
+        form == kFormRORRegister);
+    reg_t value, amount;
+    if (mov)
+    {
+        value = source;
+        amount = by_register ?
+            vm->selectRegister((offset & kMOVShiftRs) >> 3) :
+            (offset & kMOVLiteral) >> 3;
+    } else {
+        value = vm->selectRegister((offset & kShiftRmMask) >> 3);
+        amount = by_register ?
+            vm->selectRegister((offset & kShiftRsMask) >> 7) :
+            (offset & kShiftRsMask) >> 7;
+    }
+    
+    // Shifting zero is a special case where you dont touch the C bit
+    if (!amount) return (value);
+    
+    reg_t shifted;
+    bool lsl = (form == kFormLSLLiteral || form == kFormLSLRegister);
+    reg_t carry = ALU::shift(shifted, value, amount,
+        lsl ? kShiftLSL : kShiftROR);
+    vm->_psr = (vm->_psr & ~kPSRCBit) | (carry * kPSRCBit);
+    return (shifted);
+}
+
+template <int op, int form, int s>
+cycle_t ALU::kernel(ALU *alu, DPFlags &f)
+{
+    VirtualMachine *vm = alu->_vm;
+    reg_t source = vm->selectRegister(f.rs);
+    
+    // These two don't fit the pattern, and are rare enough not to care
+    if (op == kMUL) return (alu->multiply(f, source));
+    if (op == kNOP)
+    {
+        alu->_result = false;
+        return (alu->_timing.op[kNOP]);
+    }
+    
+    reg_t operand;
+    if (op == kMOV && form == kFormImmediate)
+        operand = (f.rs << 10) | f.offset;
+    else
+        operand = kernelOperand<form, op == kMOV>(vm, f.offset, source);
+    
+    reg_t dest, carry = 0, overflow = 0;
+    switch (op)
+    {
+        case kADD:
+        case kCMN:
+        dest = source + operand;
+        carry = (dest < source);
+        overflow = addOverflows(source, operand, dest);
+        break;
+        
+        case kSUB:
+        case kCMP:
+        dest = source - operand;
+        carry = (dest > source);
+        overflow = subOverflows(source, operand, dest);
+        break;
+        
+        case kMOD:
+        dest = source % operand;
+        break;
+        
+        case kDIV:
+        dest = source / operand;
+        break;
+        
+        case kAND:
+        case kTST:
+        dest = source & operand;
+        break;
+        
+        case kORR:
+        dest = source | operand;
+        break;
+        
+        case kXOR:
+        case kTEQ:
+        dest = source ^ operand;
+        break;
+        
+        case kNOT:
+        dest = ~source;
+        break;
+        
+        case kBIC:
+        dest = source & ~operand;
+        break;
+        
+        case kMOV:
+        default:
+        dest = operand;
+        break;
+    }
+    
+    // The same bits dataProcessing() sets, without testing for any of them.
+    // Logical ops leave C to the shifter and V alone.
+    if (s)
+    {
+        bool arithmetic = (op == kADD || op == kSUB || op == kMOD ||
+            op == kDIV || op == kCMP || op == kCMN);
+        reg_t mask = kPSRNBit | kPSRZBit;
+        reg_t bits = ((dest >> 31) * kPSRNBit) | ((dest == 0) * kPSRZBit);
+        if (arithmetic)
+        {
+            mask |= kPSRCBit | kPSRVBit;
+            bits |= (carry * kPSRCBit) | (overflow * kPSRVBit);
+        }
+        vm->_psr = (vm->_psr & ~mask) | bits;
+    }
+    
+    alu->_result = !(op == kCMP || op == kCMN || op == kTST || op == kTEQ);
+    alu->_output = dest;
+    return (alu->_timing.op[op]);
+}
+
+// Fills in the kernel for every (op, form, s) up to index, which is laid out
+// the way kernelFor() looks them up
+template <int index>
+struct ALUKernelTable
+{
+    static void fill(ALUKernel *table)
+    {
+        table[index] = &ALU::kernel<index / (kALUFormCount * 2),
+            (index / 2) % kALUFormCount, index % 2>;
+        ALUKernelTable<index - 1>::fill(table);
+    }
+};
+
+template <>
+struct ALUKernelTable<-1>
+{
+    static void fill(ALUKernel *)
+    {}
+};
+
+static ALUKernel ALUKernels[kALUKernelCount];
+
+// Built before main(), so every machine shares it and no thread builds it
+static struct ALUKernelInit
+{
+    ALUKernelInit()
+    {
+        ALUKernelTable<kALUKernelCount - 1>::fill(ALUKernels);
+    }
+} ALUKernelInitializer;
+
+ALUKernel ALU::kernelFor(const DPFlags &f)
+{
+    int form = kFormImmediate;
+    if (!f.i)
+    {
+        bool lsl = !(f.offset & kShiftOp);
+        if (f.offset & kShiftType)
+            form = lsl ? kFormLSLRegister : kFormRORRegister;
+        else
+            form = lsl ? kFormLSLLiteral : kFormRORLiteral;
+    }
+    
+    // Status bits are never set on the way to the pc
+    int s = (f.s && f.rd != kPCCode) ? 1 : 0;
+    
+    return (ALUKernels[(f.op * kALUFormCount + form) * 2 + s]);
+}
+
+cycle_t ALU::execute(DPFlags &f)
+{
+    return (f.kernel(this, f));
+}
+
+bool ALU::benchmark(reg_t ops)
+{
+    printf("Benchmarking %u ALU ops... ", ops);
+    
+    DPFlags *flags = (DPFlags *)malloc(sizeof(DPFlags) * ops);
+    if (!flags)
+    {
+        printf("could not allocate them.\n");
+        return (true);
+    }
+    
+    // Every op in every form, reading the general registers.  Divides only
+    // get nonzero literals, so that neither path traps.
+    srand(1);
+    for (reg_t n = 0; n < ops; n++)
+    {
+        DPFlags &f = flags[n];
+        f.op = rand() % kDPOpcodeCount;
+        f.i = rand() & 1;
+        f.s = rand() & 1;
+        f.rs = rand() % kR15Code;
+        f.rd = rand() % kR15Code;
+        f.offset = rand() & kDPOperandTwoMask;
+        if (f.op == kDIV || f.op == kMOD)
+        {
+            f.i = 1;
+            f.offset |= 1;
+        }
+        f.kernel = kernelFor(f);
+    }
+    
+    // They have to agree on everything before timing them means anything
+    reg_t psr = _vm->_psr, mismatches = 0;
+    for (reg_t n = 0; n < ops; n++)
+    {
+        DPFlags generic = flags[n];
+        _vm->_psr = psr;
+        cycle_t gt = dataProcessing(generic);
+        reg_t gout = _output, gaux = _aux_out, gpsr = _vm->_psr;
+        bool gresult = _result;
+        
+        _vm->_psr = psr;
+        cycle_t kt = execute(flags[n]);
+        if (gt != kt || gout != _output || gaux != _aux_out ||
+            gpsr != _vm->_psr || gresult != _result)
+        {
+            if (!mismatches)
+                printf("\n\t%s (form %#x, s %u) disagrees", DPOpMnumonics[
+                    flags[n].op], flags[n].offset, flags[n].s);
+            mismatches++;
+        }
+    }
+    
+    if (mismatches)
+    {
+        printf("\n\t%u of %u ops disagree.\n", mismatches, ops);
+        _vm->_psr = psr;
+        free(flags);
+        return (true);
+    }
+    
+    // dataProcessing() shifts the offset in place, so it gets a fresh copy
+    // of each op, and so do the kernels to be fair
+    cycle_t sink = 0;
+    clock_t start = clock();
+    for (reg_t n = 0; n < ops; n++)
+    {
+        DPFlags f = flags[n];
+        sink += dataProcessing(f) + _output;
+    }
+    double generic = (double)(clock() - start) / CLOCKS_PER_SEC;
+    
+    start = clock();
+    for (reg_t n = 0; n < ops; n++)
+    {
+        DPFlags f = flags[n];
+        sink += execute(f) + _output;
+    }
+    double kernels = (double)(clock() - start) / CLOCKS_PER_SEC;
+    
+    _vm->_psr = psr;
+    free(flags);
+    
+    printf("Done.\n");
+    printf("\tdataProcessing: %.2f ns/op\n", generic * 1e9 / ops);
+    printf("\tkernels: %.2f ns/op (%.2fx)\n", kernels * 1e9 / ops,
+        kernels ? generic / kernels : 0.0);
+    printf("\t(checksum %lu)\n", (unsigned long)sink);
+    return (false);
+}
@@ -69,6 +69,10 @@ class Assembler:
                             "orr" : "0110", "not" : "0111", "xor" : "1000",
                             "bic" : "1110" }
     
+    # the other multiplies are MUL with their kind where rd would be
+    multiply = {    "umul" : "10000", "mac" : "10001", "macl" : "10010",
+                    "umacl" : "10011" }
+    
     # mnemonics for comparing and testing
     comp_test = {   "cmp" : "1001", "cmn" : "1010", "tst": "1011",
                     "teq" : "1100", "mov" : "1101", "nop" : "1111"}
@@ -86,8 +90,31 @@ class Assembler:
     interrupt = {   "int" : "1111" };
     
     # fp ops
-    floating_point = {  "fad" : "0000", "fsb" : "0001", "fml" : "0011", 
-                        "fdv" : "0111", "cmf" : "1010", "cnf" : "1100" }
+    floating_point = {  "fad" : "0000", "fsb" : "0001", "fma" : "0010",
+                        "fml" : "0011", "fsq" : "0100", "flt" : "0101",
+                        "fix" : "0110", "fdv" : "0111", "cmf" : "1010",
+                        "cnf" : "1100" }
+    
+    # fp ops that only take one operand, and the ones that only compare
+    fp_unary = [ "fsq", "flt", "fix" ]
+    fp_compare = [ "cmf", "cnf" ]
+    
+    # packed ops, which end in b for four byte lanes or h for two halfwords
+    packed = {  "padd" : "0000", "psub" : "0001", "padds" : "0010",
+                "psubs" : "0011", "paddus" : "0100", "psubus" : "0101",
+                "pmin" : "0110", "pmax" : "0111", "pminu" : "1000",
+                "pmaxu" : "1001", "pcmpeq" : "1010", "pcmpgt" : "1011",
+                "pcmpgtu" : "1100", "pavgu" : "1101" }
+    packed_lanes = { "b" : "0", "h" : "1" }
+    
+    # atomic memory ops, of which ldl doesn't store anything
+    atomic = {  "swp" : "0000", "cas" : "0001", "ldl" : "0010",
+                "stc" : "0011" }
+    
+    # cache control, which only takes an address, or a level to prefetch to
+    # or a value to store as well
+    cache_control = {   "pld" : "0100", "stnt" : "0101", "clean" : "0110",
+                        "inval" : "0111", "flush" : "1000" }
     
     # Member function definitions
     def __init__(self):
@@ -376,6 +403,17 @@ class Assembler:
                 print("MOV argument one must be a register specifier.")
                 return None
         
+        # UMUL r1, r2 is MUL with the kind of multiply as its destination,
+        # since every multiply writes pq0 and pq1.  MUL takes the same form,
+        # or the older one with a destination that means nothing.
+        kind = None
+        if instruction in self.multiply:
+            kind = self.multiply[instruction]
+            instruction = "mul"
+            line = ["r0"] + line
+        elif instruction == "mul" and len(line) == 2:
+            line = ["r0"] + line
+        
         # If it's not a mov or nop, continue
         if instruction in self.arithmetic_logic:
             # ADD r0, r1, r5 LSL r2
@@ -389,6 +427,8 @@ class Assembler:
                 print("Invalid register specifier '"+line[0]+"'.")
                 return None
             dest = self.registers[line[0]]
+            if kind != None:
+                dest = kind
             
             if line[1] not in self.registers:
                 print("Invalid register specifier '"+line[1]+"'.")
@@ -558,7 +598,8 @@ class Assembler:
             
             # check if its an arithmetic/logic/compare/test instruction
             if (instruction in self.arithmetic_logic) or \
-                (instruction in self.comp_test): 
+                (instruction in self.comp_test) or \
+                (instruction in self.multiply): 
                 
                 val = self.parseDPInstruction(instruction, line)
                 # Error should cause it to skip the line
@@ -606,16 +647,101 @@ class Assembler:
                 
                 bin += self.decToBin(offset, 24);
             elif (instruction in self.floating_point):
-                if(len(line) < 4):
-                        print "Not enough arguments for FP operation, need 4";
+                # Registers are s, d, n, m.  Shorter forms leave out the
+                # ones the op doesn't use: "fsq s, n", "cmf n, m" and
+                # "fad s, n, m".  fma adds in d, so it always takes four.
+                if (instruction in self.fp_compare):
+                    needed = 2;
+                    regs = ["fpr0", "fpr0"] + line[0:2];
+                elif (instruction in self.fp_unary):
+                    needed = 2;
+                    regs = [line[0], line[0]] + line[1:2] + ["fpr0"];
+                elif (len(line) == 3 and instruction != "fma"):
+                    needed = 3;
+                    regs = [line[0], line[0]] + line[1:3];
+                else:
+                    needed = 4;
+                    regs = line[0:4];
+                
+                if (len(line) < needed):
+                    print "Not enough arguments for FP operation, need " + \
+                        str(needed);
                 else:
                     bin += "1110";
                     bin += self.floating_point[instruction];
-                    bin += self.fp_registers[line[0]];
-                    bin += self.fp_registers[line[1]];
-                    bin += self.fp_registers[line[2]];
-                    bin += self.fp_registers[line[3]];
+                    bin += self.fp_registers[regs[0]];
+                    bin += self.fp_registers[regs[1]];
+                    bin += self.fp_registers[regs[2]];
+                    bin += self.fp_registers[regs[3]];
                     bin += "00000000"
+            elif (instruction[:-1] in self.packed and \
+                instruction[-1] in self.packed_lanes):
+                # PADDB rd, rs, rm
+                if (len(line) < 3):
+                    print "Not enough arguments for packed operation, need 3";
+                    continue
+                
+                bad = [r for r in line[0:3] if r not in self.registers]
+                if (bad):
+                    print "Invalid register specifier '" + bad[0] + "'.";
+                    continue
+                
+                bin += "1000";
+                bin += self.packed[instruction[:-1]];
+                bin += self.registers[line[1]];
+                bin += self.registers[line[0]];
+                bin += self.registers[line[2]];
+                bin += self.packed_lanes[instruction[-1]];
+                bin += "0000"
+            elif (instruction in self.atomic):
+                # SWP rd, rs, rm where rs holds the address, or LDL rd, rs
+                needed = 2 if instruction == "ldl" else 3
+                if (len(line) < needed):
+                    print "Not enough arguments for atomic operation, need " + \
+                        str(needed);
+                    continue
+                
+                bad = [r for r in line[0:needed] if r not in self.registers]
+                if (bad):
+                    print "Invalid register specifier '" + bad[0] + "'.";
+                    continue
+                
+                bin += "1001";
+                bin += self.atomic[instruction];
+                bin += self.registers[line[1]];
+                bin += self.registers[line[0]];
+                if (needed == 3):
+                    bin += self.registers[line[2]];
+                else:
+                    bin += "00000"
+                bin += "00000"
+            elif (instruction in self.cache_control):
+                # PLD rs, level or STNT rs, rm where rs holds the address,
+                # like STW, or FLUSH rs
+                needed = 2 if instruction in ["pld", "stnt"] else 1
+                if (len(line) < needed):
+                    print "Not enough arguments for cache operation, need " + \
+                        str(needed);
+                    continue
+                
+                if (line[0] not in self.registers):
+                    print "Invalid register specifier '" + line[0] + "'.";
+                    continue
+                
+                bin += "1001";
+                bin += self.cache_control[instruction];
+                bin += self.registers[line[0]];
+                bin += "00000"
+                if (instruction == "pld"):
+                    bin += self.decToBin(int(line[1]), 5);
+                elif (instruction == "stnt"):
+                    if (line[1] not in self.registers):
+                        print "Invalid register specifier '" + line[1] + "'.";
+                        continue
+                    bin += self.registers[line[1]];
+                else:
+                    bin += "00000"
+                bin += "00000"
             else:
                 print "Invalid operation '" + instruction + "'.";
                 bin = self.condition_codes["nv"] + self.decToBin(0, 28)
@@ -0,0 +1,464 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "includes/batch.h"
+#include "includes/virtualmachine.h"
+#include "includes/util.h"
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec + tv.tv_usec / 1000000.0);
+}
+
+// JSON strings can't hold quotes or backslashes as they are
+static void writeString(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\') fputc('\\', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+// CSV fields with commas or quotes in them have to be quoted
+static void writeField(FILE *f, const char *s)
+{
+    if (!strpbrk(s, ",\"\n"))
+    {
+        fputs(s, f);
+        return;
+    }
+    
+    fputc('"', f);
+    for (; *s; s++)
+    {
+        if (*s == '"') fputc('"', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+BatchDriver::BatchDriver(const char *summary, reg_t jobs) :
+    _summary(summary), _jobs(jobs)
+{
+    _queues = NULL;
+    _parameter_count = 0;
+    _wall = 0.0;
+    _stolen = 0;
+    pthread_mutex_init(&_lock, NULL);
+}
+
+BatchDriver::~BatchDriver()
+{
+    if (_queues)
+    {
+        for (reg_t i = 0; i < _jobs; i++)
+            pthread_mutex_destroy(&_queues[i].lock);
+        delete[] _queues;
+    }
+    
+    pthread_mutex_destroy(&_lock);
+}
+
+bool BatchDriver::init()
+{
+    printf("Initializing batch driver... ");
+    
+    if (!_list.size())
+    {
+        printf("no jobs.\n");
+        return (true);
+    }
+    
+    if (!_jobs) _jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (!_jobs) _jobs = 1;
+    if (_jobs > _list.size()) _jobs = _list.size();
+    
+    // Deal the jobs out in turn, so every worker starts with a share
+    _queues = new WorkQueue[_jobs];
+    for (reg_t i = 0; i < _jobs; i++)
+        pthread_mutex_init(&_queues[i].lock, NULL);
+    for (size_t i = 0; i < _list.size(); i++)
+        _queues[i % _jobs].jobs.push_back(i);
+    
+    printf("(%lu jobs, %u workers) Done.\n", _list.size(), _jobs);
+    return (false);
+}
+
+bool BatchDriver::readManifest(const char *manifest)
+{
+    // One "<program> <config>" a line.  Blank lines and lines starting
+    // with '#' are skipped.
+    FILE *f = fopen(manifest, "r");
+    if (!f)
+    {
+        fprintf(stderr, "Could not open manifest '%s'.\n", manifest);
+        return (true);
+    }
+    
+    char line[kMaxBatchPath * 2 + 16];
+    char program[kMaxBatchPath], config[kMaxBatchPath];
+    size_t number = 0;
+    bool err = false;
+    while (!err && fgets(line, sizeof(line), f))
+    {
+        number++;
+        
+        char *start = line;
+        while (*start == ' ' || *start == '\t') start++;
+        if (*start == '#' || *start == '\n' || *start == '\0') continue;
+        
+        if (sscanf(start, "%1023s %1023s", program, config) != 2)
+        {
+            fprintf(stderr, "Line %lu of '%s' badly formatted.\n", number,
+                manifest);
+            err = true;
+            break;
+        }
+        
+        err = addJob(program, config);
+    }
+    
+    fclose(f);
+    return (err);
+}
+
+bool BatchDriver::addJob(const char *program, const char *config)
+{
+    Sweep *sweep = new Sweep(config);
+    if (sweep->init())
+    {
+        delete sweep;
+        return (true);
+    }
+    
+    // Every setting swept gets a column
+    SweepPoint p;
+    sweep->point(0, p);
+    for (reg_t d = 0; d < p.dimensions; d++)
+    {
+        reg_t c = 0;
+        while (c < _parameter_count && strcmp(_parameters[c], p.names[d]))
+            c++;
+        if (c < _parameter_count) continue;
+        
+        if (_parameter_count == kMaxBatchParameters)
+        {
+            fprintf(stderr, "Too many settings swept, '%s' isn't reported.\n",
+                p.names[d]);
+            continue;
+        }
+        
+        strcpy(_parameters[_parameter_count++], p.names[d]);
+    }
+    
+    const char *name = program ? program : sweep->program();
+    for (size_t n = 0; n < sweep->points(); n++)
+    {
+        BatchJob job;
+        strncpy(job.program, name ? name : "", kMaxBatchPath - 1);
+        job.program[kMaxBatchPath - 1] = '\0';
+        strncpy(job.config, config, kMaxBatchPath - 1);
+        job.config[kMaxBatchPath - 1] = '\0';
+        sweep->point(n, job.point);
+        
+        // Until it has run
+        job.failed = true;
+        job.seconds = 0.0;
+        job.worker = 0;
+        job.result.clear();
+        _list.push_back(job);
+    }
+    
+    delete sweep;
+    return (false);
+}
+
+bool BatchDriver::run(const char *log)
+{
+    printf("Running %lu jobs on %u workers...\n", _list.size(), _jobs);
+    
+    // Make sure the log can be written before stdout is given up for it
+    FILE *f = fopen(log, "w");
+    if (!f)
+    {
+        fprintf(stderr, "Could not open the log '%s'.\n", log);
+        return (true);
+    }
+    fclose(f);
+    
+    // Every machine talks as it runs, so send all of that to the log and
+    // put the console back for the results
+    fflush(stdout);
+    int console = dup(STDOUT_FILENO);
+    if (console < 0 || !freopen(log, "w", stdout))
+    {
+        fprintf(stderr, "Could not send output to the log '%s'.\n", log);
+        if (console >= 0) close(console);
+        return (true);
+    }
+    
+    double start = now();
+    bool err = runWorkers();
+    _wall = now() - start;
+    
+    fflush(stdout);
+    dup2(console, STDOUT_FILENO);
+    close(console);
+    return (err);
+}
+
+bool BatchDriver::runWorkers()
+{
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * _jobs);
+    Worker *workers = (Worker *)malloc(sizeof(Worker) * _jobs);
+    if (!threads || !workers)
+    {
+        fprintf(stderr, "Could not allocate batch workers.\n");
+        if (threads) free(threads);
+        if (workers) free(workers);
+        return (true);
+    }
+    
+    // Anything a worker that didn't start was dealt gets stolen
+    reg_t started = 0;
+    for (; started < _jobs; started++)
+    {
+        workers[started].driver = this;
+        workers[started].index = started;
+        if (pthread_create(&threads[started], NULL, work,
+            (void *)&workers[started]))
+            break;
+    }
+    
+    if (!started)
+    {
+        fprintf(stderr, "Could not start batch workers.\n");
+        free(threads);
+        free(workers);
+        return (true);
+    }
+    
+    for (reg_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(workers);
+    
+    return (false);
+}
+
+bool BatchDriver::take(reg_t worker, size_t &job)
+{
+    // Own work comes off the front
+    WorkQueue &own = _queues[worker];
+    pthread_mutex_lock(&own.lock);
+    bool found = !own.jobs.empty();
+    if (found)
+    {
+        job = own.jobs.front();
+        own.jobs.pop_front();
+    }
+    pthread_mutex_unlock(&own.lock);
+    if (found) return (true);
+    
+    // and everyone else's off the back, starting with the next worker
+    for (reg_t i = 1; i < _jobs; i++)
+    {
+        WorkQueue &other = _queues[(worker + i) % _jobs];
+        pthread_mutex_lock(&other.lock);
+        found = !other.jobs.empty();
+        if (found)
+        {
+            job = other.jobs.back();
+            other.jobs.pop_back();
+        }
+        pthread_mutex_unlock(&other.lock);
+        
+        if (!found) continue;
+        
+        pthread_mutex_lock(&_lock);
+        _stolen++;
+        pthread_mutex_unlock(&_lock);
+        return (true);
+    }
+    
+    return (false);
+}
+
+void *BatchDriver::work(void *worker)
+{
+    Worker *w = (Worker *)worker;
+    BatchDriver *d = w->driver;
+    
+    // Keep each worker, and the memory its machine keeps, on one core
+    _pin_thread(w->index);
+    
+    VirtualMachine *vm = new VirtualMachine(false);
+    
+    size_t i;
+    while (!terminate && d->take(w->index, i))
+    {
+        d->_list[i].worker = w->index;
+        d->runJob(vm, d->_list[i]);
+    }
+    
+    delete vm;
+    return (NULL);
+}
+
+void BatchDriver::runJob(VirtualMachine *vm, BatchJob &job)
+{
+    double start = now();
+    job.failed = vm->init(job.config, NULL,
+        job.program[0] ? job.program : NULL, &job.point);
+    if (!job.failed)
+    {
+        vm->run();
+        vm->measurement(job.result);
+    }
+    
+    job.seconds = now() - start;
+    
+    if (job.failed)
+        fprintf(stderr, "Job '%s' with '%s' failed.\n", job.program,
+            job.config);
+}
+
+char BatchDriver::summaryCaches()
+{
+    // Every row has a column for each level any job had
+    char caches = 0;
+    for (size_t i = 0; i < _list.size(); i++)
+        if (_list[i].result.caches > caches) caches = _list[i].result.caches;
+    return (caches);
+}
+
+const char *BatchDriver::parameter(BatchJob &job, reg_t column)
+{
+    // Jobs that don't sweep over it leave it empty
+    for (reg_t d = 0; d < job.point.dimensions; d++)
+        if (!strcmp(job.point.names[d], _parameters[column]))
+            return (job.point.values[d]);
+    return ("");
+}
+
+bool BatchDriver::writeSummary()
+{
+    FILE *f = fopen(_summary, "w");
+    if (!f)
+    {
+        fprintf(stderr, "Could not open '%s' for the summary.\n", _summary);
+        return (true);
+    }
+    
+    const char *ext = strrchr(_summary, '.');
+    if (ext && !strcmp(ext, ".json"))
+        writeJSON(f);
+    else
+        writeCSV(f);
+    
+    fclose(f);
+    printf("Wrote the summary of %lu jobs to '%s'.\n", _list.size(),
+        _summary);
+    return (false);
+}
+
+void BatchDriver::writeCSV(FILE *f)
+{
+    char caches = summaryCaches();
+    
+    fprintf(f, "program,config");
+    for (reg_t c = 0; c < _parameter_count; c++)
+        fprintf(f, ",%s", _parameters[c]);
+    fprintf(f, ",status,instructions,cycles,ipc");
+    for (int l = 0; l < caches; l++)
+        fprintf(f, ",l%i_accesses,l%i_misses", l, l);
+    fprintf(f, ",worker,seconds\n");
+    
+    for (size_t i = 0; i < _list.size(); i++)
+    {
+        BatchJob &j = _list[i];
+        IntervalResult &r = j.result;
+        writeField(f, j.program);
+        fputc(',', f);
+        writeField(f, j.config);
+        for (reg_t c = 0; c < _parameter_count; c++)
+        {
+            fputc(',', f);
+            writeField(f, parameter(j, c));
+        }
+        fprintf(f, ",%s,%lu,%lu,%.4f", j.failed ? "failed" : "ok",
+            r.instructions, r.cycles,
+            r.cycles ? (double)r.instructions / r.cycles : 0.0);
+        for (int l = 0; l < caches; l++)
+            fprintf(f, ",%lu,%lu", r.accesses[l], r.misses[l]);
+        fprintf(f, ",%u,%.3f\n", j.worker, j.seconds);
+    }
+}
+
+void BatchDriver::writeJSON(FILE *f)
+{
+    fprintf(f, "[\n");
+    for (size_t i = 0; i < _list.size(); i++)
+    {
+        BatchJob &j = _list[i];
+        IntervalResult &r = j.result;
+        
+        fprintf(f, "  {\"program\": ");
+        writeString(f, j.program);
+        fprintf(f, ", \"config\": ");
+        writeString(f, j.config);
+        fprintf(f, ", \"parameters\": {");
+        for (reg_t d = 0; d < j.point.dimensions; d++)
+        {
+            fprintf(f, "%s", d ? ", " : "");
+            writeString(f, j.point.names[d]);
+            fprintf(f, ": ");
+            writeString(f, j.point.values[d]);
+        }
+        fprintf(f, "}");
+        fprintf(f, ", \"status\": \"%s\", \"instructions\": %lu, "
+            "\"cycles\": %lu, \"ipc\": %.4f, \"caches\": [",
+            j.failed ? "failed" : "ok", r.instructions, r.cycles,
+            r.cycles ? (double)r.instructions / r.cycles : 0.0);
+        for (int l = 0; l < r.caches; l++)
+        {
+            fprintf(f, "%s{\"accesses\": %lu, \"misses\": %lu}",
+                l ? ", " : "", r.accesses[l], r.misses[l]);
+        }
+        fprintf(f, "], \"worker\": %u, \"seconds\": %.3f}%s\n", j.worker,
+            j.seconds, i + 1 < _list.size() ? "," : "");
+    }
+    fprintf(f, "]\n");
+}
+
+void BatchDriver::printStatistics()
+{
+    size_t failed = 0, instructions = 0;
+    cycle_t cycles = 0;
+    double seconds = 0.0;
+    
+    for (size_t i = 0; i < _list.size(); i++)
+    {
+        seconds += _list[i].seconds;
+        if (_list[i].failed)
+        {
+            failed++;
+            continue;
+        }
+        
+        instructions += _list[i].result.instructions;
+        cycles += _list[i].result.cycles;
+    }
+    
+    printf("Batch: %lu run, %lu failed, %lu instructions in %lu cycles\n",
+        _list.size() - failed, failed, instructions, cycles);
+    printf("\t%lu jobs stolen between workers\n", _stolen);
+    printf("\tHost time: %.2fs, %.2fs of simulation (%.1fx on %u workers)\n",
+        _wall, seconds, _wall ? seconds / _wall : 0.0, _jobs);
+}
@@ -0,0 +1,99 @@
+#include <signal.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../includes/virtualmachine.h"
+#include "../includes/batch.h"
+
+#define kDefaultSummaryPath "batch.csv"
+#define kDefaultLogPath "batch.log"
+
+void sigint_handler(int sig)
+{
+    printf("Caught signal.  Finishing the jobs that are running.\n");
+    terminate = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    char c;
+    char manifest[PATH_MAX] = "";
+    char summary[PATH_MAX] = kDefaultSummaryPath;
+    char log[PATH_MAX] = kDefaultLogPath;
+    reg_t jobs = 0;
+    
+    // Register signal handler for SIGINT
+    struct sigaction sa;
+    sa.sa_handler = sigint_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    
+    // Initialize our terminate value
+    terminate = 0;
+    
+    if (sigaction(SIGINT, &sa, NULL) == -1)
+    {
+        exit(1);
+    }
+    
+    // Handle command line options
+    while ((c = getopt(argc, argv, "m:o:l:j:h")) != -1)
+    {
+        switch (c)
+        {
+            case 'm':
+            strcpy(manifest, optarg);
+            break;
+            
+            case 'o':
+            strcpy(summary, optarg);
+            break;
+            
+            case 'l':
+            strcpy(log, optarg);
+            break;
+            
+            case 'j':
+            jobs = atoi(optarg);
+            break;
+            
+            case 'h':
+            printf("YAAA VM Batch Help:\n");
+            printf("m <path>\t\tManifest of \"<program> <config>\" jobs.  ");
+            printf("Configs with a sweep run every point of it.\n");
+            printf("o <path>\t\tSummary to write, JSON if it ends in ");
+            printf(".json and CSV otherwise.\n");
+            printf("l <path>\t\tWhere the machines' own output goes.\n");
+            printf("j <jobs>\t\tWorkers, one per core by default.\n");
+            exit(0);
+            
+            default:
+            break;
+        }
+    }
+    
+    if (!manifest[0])
+    {
+        fprintf(stderr, "No manifest given, see -h.\n");
+        exit(1);
+    }
+    
+    BatchDriver *driver = new BatchDriver(summary, jobs);
+    if (driver->readManifest(manifest) || driver->init())
+    {
+        fprintf(stderr, "Batch driver init failed, aborting.\n");
+        exit(1);
+    }
+    
+    bool err = driver->run(log);
+    if (err || driver->writeSummary())
+    {
+        fprintf(stderr, "Batch run failed, aborting.\n");
+        exit(1);
+    }
+    
+    driver->printStatistics();
+    delete driver;
+    return (0);
+}
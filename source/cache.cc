@@ -8,6 +8,10 @@ MemoryCache::MemoryCache()
     _tag = NULL;
     _dirty = NULL;
     _lru = NULL;
+    _state = NULL;
+    _forwarded = false;
+    _linked = false;
+    _link = 0;
 }
 
 MemoryCache::~MemoryCache()
@@ -15,6 +19,7 @@ MemoryCache::~MemoryCache()
     if (_tag) free(_tag);
     if (_dirty) free(_dirty);
     if (_lru) free(_lru);
+    if (_state) free(_state);
 }
 
 bool MemoryCache::init(MMU *mmu, CacheDescription &desc, MemoryCache *parent)
@@ -82,13 +87,17 @@ bool MemoryCache::init(MMU *mmu, CacheDescription &desc, MemoryCache *parent)
     _tag = (reg_t *)malloc(_size * sizeof(reg_t));
     _dirty = (bool *)calloc(_size, sizeof(bool));
     _lru = (char *)calloc(_size, sizeof(char));
+    _state = (char *)calloc(_size, sizeof(char));
     
-    if (!_tag || !_dirty || !_lru)
+    if (!_tag || !_dirty || !_lru || !_state)
     {
         printf("Data allocation error.\n");
         return (true);
     }
     
+    _accesses = 0;
+    _misses = 0;
+    
     // initialize tag to -1 for "empty" because it can't get that big
     for (reg_t i = 0; i < _size; i++)
         _tag[i] = kWordMask;
@@ -200,12 +209,18 @@ cycle_t MemoryCache::cache(reg_t addr, reg_t &index, bool write)
     cycle_t ret = accessTime();
     reg_t valToWrite = index;
     
+    // Only the miss of this access can be forwarded
+    bool forwarded = _forwarded;
+    _forwarded = false;
+    
     if (addr & kIgnoredBitsMask)
     {
         fprintf(stderr, "CACHE: Lookup address not word aligned.\n");
         return (0);
     }
     
+    _accesses++;
+    
     if (_debug)
     {
         if (write)
@@ -229,6 +244,7 @@ cycle_t MemoryCache::cache(reg_t addr, reg_t &index, bool write)
         if (write)
         {
             _dirty[index] = true;
+            _state[index] = kLineModified;
             
             // actually write the value
         } else {
@@ -242,6 +258,7 @@ cycle_t MemoryCache::cache(reg_t addr, reg_t &index, bool write)
     }
     
     // it's not in the cache, so we need to calculate where to put it
+    _misses++;
     reg_t set = (addr & _index_mask);
     // ignore the offset entirely, we're just looking for a line in a set
     set >>= (_offset_bits + kIgnoredBits);
@@ -266,7 +283,7 @@ cycle_t MemoryCache::cache(reg_t addr, reg_t &index, bool write)
             _tag[index] = addr & _tag_mask;
             
             // This is where we would actually get the value requested
-            if (!write)
+            if (!write && !forwarded)
             {
                 if (_parent)
                 {
@@ -279,7 +296,7 @@ cycle_t MemoryCache::cache(reg_t addr, reg_t &index, bool write)
                         temp = addr + (j << 2);
                         ret += _parent->read(temp);
                     }
-                    
+                
                 } else {
                     // Go to main memory
                     for (int j = 0; j < _line_length; j++)
@@ -295,6 +312,7 @@ cycle_t MemoryCache::cache(reg_t addr, reg_t &index, bool write)
             
             // set the dirty bit
             _dirty[index] = write;
+            _state[index] = write ? kLineModified : kLineExclusive;
             
             // Set the value otherwise
             if (!write) index = 0;
@@ -329,26 +347,29 @@ cycle_t MemoryCache::cache(reg_t addr, reg_t &index, bool write)
             reg_t temp = 5;
             for (int i = 0; i < _line_length; i++)
                 ret += _parent->write(addr + (i << 2), valToWrite);
-            
+        
         } else {
             // go to main memory
             for (int i = 0; i < _line_length; i++)
                 ret += _mmu->writeTime();
         }
-        
+    
     }
     
-    // replace victim with addr
+    // replace victim with addr, and its reservation goes with it
+    if (_linked && index == _link) _linked = false;
     _tag[index] = addr & _tag_mask;
     
     // This is where we would actually get the value requested
     
     // TODO: Optimize this so that we don't read from the word
     // we're going to write to.
-    if (_parent)
+    if (forwarded)
     {
+        if (_debug) printf("forwarded ");
+    } else if (_parent) {
         if (_debug) printf("\n");
-    
+        
         // If there is more cache above us, ask it for the value
         reg_t temp;
         for (int i = 0; i < _line_length; i++)
@@ -367,6 +388,7 @@ cycle_t MemoryCache::cache(reg_t addr, reg_t &index, bool write)
     
     // if write, mark line as dirty
     _dirty[index] = write;
+    _state[index] = write ? kLineModified : kLineExclusive;
     
     if (write)
     {
@@ -380,6 +402,87 @@ cycle_t MemoryCache::cache(reg_t addr, reg_t &index, bool write)
     return (ret);
 }
 
+char MemoryCache::state(reg_t addr)
+{
+    reg_t index;
+    if (!isCached(addr & ~kIgnoredBitsMask, index)) return (kLineInvalid);
+    return (_state[index]);
+}
+
+void MemoryCache::setState(reg_t addr, char state)
+{
+    reg_t index;
+    if (!isCached(addr & ~kIgnoredBitsMask, index)) return;
+    
+    // Whatever isn't modified any more went back with the bus transaction
+    _state[index] = state;
+    _dirty[index] = (state == kLineModified);
+}
+
+bool MemoryCache::invalidate(reg_t addr)
+{
+    reg_t index;
+    if (!isCached(addr & ~kIgnoredBitsMask, index)) return (false);
+    
+    bool modified = (_state[index] == kLineModified);
+    if (_linked && index == _link) _linked = false;
+    _tag[index] = kWordMask;
+    _dirty[index] = false;
+    _state[index] = kLineInvalid;
+    return (modified);
+}
+
+cycle_t MemoryCache::maintain(reg_t addr, bool clean, bool drop)
+{
+    cycle_t ret = accessTime();
+    reg_t index;
+    reg_t line = addr & ~(_offset_mask | kIgnoredBitsMask);
+    
+    if (isCached(line, index))
+    {
+        // Written back the same way an eviction would
+        if (clean && _dirty[index])
+        {
+            for (int i = 0; i < _line_length; i++)
+            {
+                if (_parent)
+                    ret += _parent->write(line + (i << 2), 0);
+                else
+                    ret += _mmu->writeTime();
+            }
+            
+            _dirty[index] = false;
+            if (_state[index] == kLineModified) _state[index] = kLineExclusive;
+        }
+        
+        if (drop)
+        {
+            if (_linked && index == _link) _linked = false;
+            _tag[index] = kWordMask;
+            _dirty[index] = false;
+            _state[index] = kLineInvalid;
+        }
+    }
+    
+    if (_parent) ret += _parent->maintain(addr, clean, drop);
+    return (ret);
+}
+
+void MemoryCache::link(reg_t addr)
+{
+    reg_t index;
+    _linked = isCached(addr & ~kIgnoredBitsMask, index);
+    if (_linked) _link = index;
+}
+
+bool MemoryCache::linked(reg_t addr)
+{
+    reg_t index;
+    if (!_linked) return (false);
+    if (!isCached(addr & ~kIgnoredBitsMask, index)) return (false);
+    return (index == _link);
+}
+
 reg_t MemoryCache::lru(reg_t set)
 {
     // Assume set points to the BEGINNING of the set
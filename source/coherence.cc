@@ -0,0 +1,191 @@
+#include "includes/coherence.h"
+#include "includes/virtualmachine.h"
+#include "includes/cache.h"
+
+CoherenceBus::CoherenceBus(reg_t cores, const CoherenceTiming &timing) :
+    _cores(cores), _timing(timing)
+{
+    _vm = NULL;
+    _cache = NULL;
+    _next = NULL;
+    _supplied = NULL;
+    _invalidated = NULL;
+    _started = 0;
+    _busy = 0;
+    _transactions = 0;
+    _upgrades = 0;
+    _transfers = 0;
+    _invalidations = 0;
+    _writebacks = 0;
+    _wait = 0;
+    
+    // Atomics hold the bus around accesses that take it themselves
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+CoherenceBus::~CoherenceBus()
+{
+    if (_vm) free(_vm);
+    if (_cache) free(_cache);
+    if (_next) free(_next);
+    if (_supplied) free(_supplied);
+    if (_invalidated) free(_invalidated);
+    pthread_mutex_destroy(&_lock);
+}
+
+bool CoherenceBus::init()
+{
+    printf("Initializing coherence bus for %u cores... ", _cores);
+    
+    _vm = (VirtualMachine **)calloc(_cores, sizeof(VirtualMachine *));
+    _cache = (MemoryCache **)calloc(_cores, sizeof(MemoryCache *));
+    _next = (char *)calloc(_cores, sizeof(char));
+    _supplied = (size_t *)calloc(_cores, sizeof(size_t));
+    _invalidated = (size_t *)calloc(_cores, sizeof(size_t));
+    
+    if (!_vm || !_cache || !_next || !_supplied || !_invalidated)
+    {
+        printf("Error.\n");
+        return (true);
+    }
+    
+    printf("Done.\n");
+    return (false);
+}
+
+void CoherenceBus::attach(reg_t core, VirtualMachine *vm, MemoryCache *cache)
+{
+    if (core >= _cores) return;
+    
+    _vm[core] = vm;
+    _cache[core] = cache;
+}
+
+cycle_t CoherenceBus::request(reg_t core, reg_t addr, bool write)
+{
+    MemoryCache *own = _cache[core];
+    char state = own->state(addr);
+    
+    // Reads of anything it has and writes of what's only its own don't
+    // need the bus.  A write to an exclusive line just makes it modified.
+    if (state == kLineModified || state == kLineExclusive ||
+        (state == kLineShared && !write))
+    {
+        _next[core] = write ? (char)kLineModified : state;
+        return (0);
+    }
+    
+    // Writes of a shared line only have to get rid of the other copies
+    _transactions++;
+    if (state == kLineShared) _upgrades++;
+    
+    cycle_t duration = _timing.snoop;
+    bool shared = false, supplied = false;
+    for (reg_t c = 0; c < _cores; c++)
+    {
+        if (c == core || !_cache[c]) continue;
+        
+        char other = _cache[c]->state(addr);
+        if (other == kLineInvalid) continue;
+        
+        // The first cache that has the line hands it over, and a modified
+        // one goes back to memory on the way
+        if (state == kLineInvalid && !supplied)
+        {
+            supplied = true;
+            _supplied[c]++;
+            _transfers++;
+            duration += _timing.transfer;
+        }
+        
+        if (other == kLineModified) _writebacks++;
+        
+        if (write)
+        {
+            _cache[c]->invalidate(addr);
+            _invalidated[c]++;
+            _invalidations++;
+            duration += _timing.invalidate;
+        } else {
+            _cache[c]->setState(addr, kLineShared);
+        }
+        
+        shared = true;
+    }
+    
+    if (supplied) own->forward();
+    if (write)
+        _next[core] = kLineModified;
+    else
+        _next[core] = shared ? kLineShared : kLineExclusive;
+    
+    return (occupy(core, duration));
+}
+
+cycle_t CoherenceBus::maintain(reg_t core, reg_t addr, bool clean, bool drop)
+{
+    _transactions++;
+    
+    cycle_t duration = _timing.snoop;
+    for (reg_t c = 0; c < _cores; c++)
+    {
+        if (c == core || !_cache[c]) continue;
+        
+        char other = _cache[c]->state(addr);
+        if (other == kLineInvalid) continue;
+        
+        if (other == kLineModified && clean) _writebacks++;
+        if (drop)
+        {
+            _cache[c]->invalidate(addr);
+            _invalidated[c]++;
+            _invalidations++;
+            duration += _timing.invalidate;
+        } else if (other == kLineModified) {
+            _cache[c]->setState(addr, kLineExclusive);
+        }
+    }
+    
+    return (occupy(core, duration));
+}
+
+cycle_t CoherenceBus::occupy(reg_t core, cycle_t duration)
+{
+    // The bus is one transaction at a time.  A core whose clock is behind
+    // the latest one's would have had the bus first, so it doesn't wait.
+    cycle_t now = _vm[core]->cycleCount();
+    cycle_t start = now;
+    if (now >= _started && now < _busy) start = _busy;
+    if (start + duration > _busy)
+    {
+        _started = start;
+        _busy = start + duration;
+    }
+    _wait += start - now;
+    
+    return (start - now + duration);
+}
+
+void CoherenceBus::granted(reg_t core, reg_t addr)
+{
+    _cache[core]->setState(addr, _next[core]);
+}
+
+void CoherenceBus::printStatistics()
+{
+    printf("Coherence: %lu bus transactions (%lu upgrades), waited %lu "
+        "cycles for the bus\n", _transactions, _upgrades, _wait);
+    printf("Coherence: %lu cache to cache transfers, %lu invalidations, %lu "
+        "writebacks of modified lines\n", _transfers, _invalidations,
+        _writebacks);
+    
+    for (reg_t c = 0; c < _cores; c++)
+    {
+        printf("Coherence: core %u supplied %lu lines, lost %lu to "
+            "invalidations\n", c, _supplied[c], _invalidated[c]);
+    }
+}
@@ -6,6 +6,10 @@ print_branch_offset = false
 program_length_trap = 0x1000
 machine_cycle_trap = 30000
 
+-- Port the monitor server listens on, or 0 for no server.  Give each
+-- machine in a process a port of its own.
+monitor_port = 1337
+
 -- YAAA Machine Description
 
 -- Memory size in bytes
@@ -13,14 +17,115 @@ memory_size = 3772
 stack_size = 8
 break_count = 10
 
--- Pipeline configuration
+-- Pipeline configuration.  stages can be 1, 4 (no writeback) or 5, or the
+-- pipeline can be laid out stage by stage, which overrides it.  Any part
+-- can be split over several stages; the list must go through fetch,
+-- decode, execute and memory in order, and writeback is optional.
 stages = 5
+-- pipeline = {
+--     "fetch", "fetch", "decode", "execute", "execute",
+--     "memory", "memory", "writeback"
+-- }
+
+-- Bypass network for pipelines with a writeback stage.  Without it
+-- dependent instructions wait in decode until writeback.
+bypass_ex = true
+bypass_mem = true
+
+-- Superscalar issue.  Up to issue_width (1, 2 or 4) adjacent instructions
+-- issue together, as long as they don't depend on each other and the units
+-- below aren't all taken.  Missing units default to one each, or one ALU
+-- per slot.
+issue_width = 1
+issue_units = {
+    alu = 2,
+    fpu = 1,
+    memory = 1
+}
+
+-- Out of order timing model.  When on, everything the pipeline retires is
+-- also run through a model of an out of order core with register renaming,
+-- reservation stations for each kind of unit above, a load/store queue and
+-- a reorder buffer, which reports its own IPC.  Window sizes are in entries.
+ooo_model = false
+ooo_core = {
+    width = 4,              -- fetch, dispatch and commit per cycle
+    depth = 4,              -- cycles from fetch to dispatch
+    rob = 64,
+    lsq = 32,
+    rename = 64,            -- physical registers beyond the architectural
+    alu_stations = 16,
+    fpu_stations = 8,
+    memory_stations = 16
+}
+
+-- Sampled simulation.  Most of the program is run functionally, which keeps
+-- the caches and the branch predictor warm, and every period instructions
+-- the pipeline warms up for warmup instructions and then measures length
+-- of them.  Reports estimated CPI and cache miss rates with 95% confidence
+-- intervals.
+sampling = false
+sample = {
+    period = 100000,
+    warmup = 2000,
+    length = 1000
+}
+
+-- Profiling.  Runs the whole program functionally and writes a basic block
+-- vector for every bbv_interval instructions to bbv_file, which simpoint.py
+-- clusters into a few representative intervals and their weights.  Given
+-- those back as simpoints, or with checkpoint_intervals on, the start of
+-- each interval is checkpointed to <checkpoint_prefix>.<interval>.ckpt
+-- (checkpoint_prefix defaults to the program's name).  Checkpoints are
+-- taken interval_warmup instructions early, to warm up the caches and the
+-- predictor before the interval.
+-- bbv_file = "out.bb"
+-- simpoints = "out.simpoints"
+checkpoint_intervals = false
+bbv_interval = 100000
+interval_warmup = 10000
+
+-- Start from a checkpoint instead of the top of the program.  The warmup
+-- runs functionally and then the interval in detail, unless
+-- instruction_limit (0 is no limit) says to run something else.
+-- "vm -i out.simpoints -j <jobs>" does this for each simulation point in
+-- parallel and weighs the results, "vm -i all" for every checkpoint.
+-- checkpoint = "out.3.ckpt"
+instruction_limit = 0
+
+-- Branch prediction
+-- One of "none", "static", "bimodal", "gshare" or "tournament"
+branch_predictor = "tournament"
+-- Counter tables hold 2^predictor_bits entries (also the history length)
+predictor_bits = 10
+btb_entries = 64
+ras_depth = 8
 
 -- Cache configuration
 -- Each element in the list is {lines, ways, line length, access time}
 caches = {{2, 1, 4, 1}}
 debug_cache = true
 
+-- Cores.  Each has its own registers, pipeline and caches, and they all run
+-- the program out of the same memory, each with its own stack and which
+-- core it is in r0.  Their first level caches are kept coherent with MESI
+-- on a snooping bus: each transaction takes snoop cycles, a line another
+-- cache has comes from it in transfer cycles, and a write takes invalidate
+-- cycles more for each copy it does away with.  With shared_cache the last
+-- level, if it isn't the first, is one cache for all of them.  Cores are
+-- always simulated in detail, and nothing can attach to one.
+cores = 1
+shared_cache = false
+coherence = {snoop = 4, transfer = 8, invalidate = 2}
+
+-- With a quantum, each core runs on a host thread of its own, that many
+-- cycles at a time before they all wait for each other.  0 runs them in
+-- lockstep on one thread, which is slower but as accurate as it gets.
+-- Listing quanta runs the program at each and reports what each took and
+-- how far its cycle count is from the smallest's.
+quantum = 0
+-- quanta = {0, 100, 1000, 10000}
+
 -- Breakpoints (total should be LE to break_count)
 -- (NOTE: this is the line number of the LAST instruction you want to execute)
 breakpoints = {}
@@ -32,11 +137,87 @@ read_cycles = 100
 write_cycles = 100
 
 -- ALU timings
---  If not set, defaults to 1
-alu_timings = {DIV=10, MUL=5}
+--  If not set, defaults to 1.  MUL covers UMUL as well, MAC is the 32 bit
+--  multiply-accumulate and MACL covers both 64 bit ones (MACL and UMACL).
+alu_timings = {DIV=10, MUL=5, MAC=5, MACL=6}
+
+-- FPU timings
+--  Cycles from issue to result for each FP op, by mnemonic.  Ops that aren't
+--  pipelined hold the unit until they finish.  If not set, defaults to
+--  FAD=3, FSB=3, FMA=5, FML=4, FSQ=14, FLT=2, FIX=2, FDV=12, CMF=1, CNF=1
+--  with FDV and FSQ not pipelined
+fpu_timings = {FDV=12, FSQ=14}
+fpu_pipelined = {FDV=false, FSQ=false}
+
+-- Packed (SIMD) op timings, by mnemonic without the lane size
+--  If not set, defaults to 0
+simd_timings = {PADD=1, PSUB=1}
+
+-- Memory mapped devices, which have to be above the end of memory.  Each is
+-- {kind, base address, cycles per access}.
+--  uart:       +0 writes a byte to the console, +4 is 1 when it can take one
+--  counter:    +0 is the low word of the cycle count, +4 is the high word as
+--              it was when the low word was read
+--  disk:       +0 sector, +4 memory address, +8 sector count, then write
+--              1 (read) or 2 (write) to +12 and wait for it to read 0, not
+--              1 (busy) or 2 (error).  +16 is the size in 512 byte sectors.
+--  dma:        copies +8 bytes from +0 to +4 once 1 is written to +12,
+--              which reads like the disk's.  A device at either end is
+--              read or written a word at a time without moving along.
+devices = {{"uart", 0x10000000, 10}, {"counter", 0x10000010, 1}}
+
+-- The disk is a host file, mapped.  Going anywhere but the sector after the
+-- last one costs a seek, then it moves disk_bandwidth bytes a cycle.  If
+-- disk_interrupt is set, it raises that interrupt when it's done.  Add
+-- {"disk", 0x10000020, 10} to the devices to use it.
+-- disk_image = "input.bin"
+disk_seek_cycles = 2000
+disk_bandwidth = 8
+-- disk_interrupt = 12
+
+-- The DMA engine takes memory a burst at a time whenever it's free, and
+-- processor accesses that miss the caches wait for it, or it for them.
+-- Add {"dma", 0x10000040, 1} to the devices to use it.
+-- dma_interrupt = 13
 
 -- INT timings
 swint_cycles = 25
 
+-- The interrupt table.  "int n" runs entry n+1 of this list, which is either
+-- a routine that runs in supervisor mode until it does int 0xFF (RETURN), or
+-- the name of a handler built into the host: break, write, read or clock.
+-- Host handlers take what interrupt_costs says they do, or swint_cycles if
+-- it doesn't say, plus any memory traffic.  Without this, int 0 is BREAK.
+interrupts = {
+    {0xEF00000F, 0xEF0000FF},   -- BREAK, then RETURN
+    {0xEF0000FF},               -- do nothing
+    "write",                    -- r1 bytes at r0 to the console
+    "read",                     -- r1 bytes at offset r3 of file r2 into r0
+    "clock",                    -- the cycle count in r0 and r1
+    "timer",                    -- raise int r1 in r0 cycles
+    "memcpy",                   -- the C library's, arguments from r0 up
+    "memmove",
+    "memset",
+    "memcmp",
+    "strlen"
+}
+interrupt_costs = {write=50, read=200, clock=2, timer=2, memcpy=4, memmove=4,
+    memset=4, memcmp=4, strlen=4}
+
+-- Or load the table from a file: the number of entries, the entries, then
+-- the routines.  Entries are byte offsets into the routines, or 0x80000000
+-- plus the number of a host handler in the order listed above.
+-- interrupt_table = "ints.bin"
+
 -- Branch Timings
 branch_cycles = 10
+
+-- Parameter sweep.  Each setting named here takes every value in its list
+-- in turn, and every combination is run, many machines at a time.  The
+-- settings each point used are columns of the summary (-o, CSV unless it
+-- ends in .json), and the machines' own output goes to the log (-l).
+-- sweep = {
+--     stages = {1, 4, 5},
+--     caches = {{{2, 1, 4, 1}}, {{2, 1, 4, 1}, {16, 2, 8, 10}}},
+--     alu_timings = {{DIV=10, MUL=5}, {DIV=20, MUL=3}}
+-- }
@@ -0,0 +1,526 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "includes/virtualmachine.h"
+#include "includes/devices.h"
+#include "includes/mmu.h"
+
+DeviceBus::DeviceBus(VirtualMachine *vm) : _vm(vm)
+{
+    _count = 0;
+}
+
+DeviceBus::~DeviceBus()
+{
+    _vm = NULL;
+}
+
+bool DeviceBus::attach(const char *name, reg_t base, reg_t size,
+    cycle_t latency, void *device, DeviceRead read, DeviceWrite write)
+{
+    if (!name || !size || !read || !write) return (true);
+    
+    if (_count == kMaxDevices)
+    {
+        fprintf(stderr, "No room on the bus for '%s'.\n", name);
+        return (true);
+    }
+    
+    // Ranges can't wrap or overlap
+    if (base + size < base) return (true);
+    for (reg_t i = 0; i < _count; i++)
+    {
+        if (base < _ranges[i].base + _ranges[i].size &&
+            _ranges[i].base < base + size)
+        {
+            fprintf(stderr, "'%s' at %#x overlaps '%s'.\n", name, base,
+                _ranges[i].name);
+            return (true);
+        }
+    }
+    
+    DeviceRange *r = &_ranges[_count++];
+    strncpy(r->name, name, kMaxDeviceName - 1);
+    r->name[kMaxDeviceName - 1] = '\0';
+    r->base = base;
+    r->size = size;
+    r->latency = latency;
+    r->device = device;
+    r->read = read;
+    r->write = write;
+    
+    printf("(%s @ %#x) ", r->name, base);
+    return (false);
+}
+
+DeviceRange *DeviceBus::find(reg_t addr)
+{
+    for (reg_t i = 0; i < _count; i++)
+        if (addr - _ranges[i].base < _ranges[i].size)
+            return (&_ranges[i]);
+    
+    return (NULL);
+}
+
+cycle_t DeviceBus::read(reg_t addr, reg_t &value)
+{
+    DeviceRange *r = find(addr);
+    if (!r || r->read(r->device, addr - r->base, value))
+    {
+        fprintf(stderr, "MMU ABORT: No device at %#x.\n", addr);
+        value = 0x0;
+        return (kMMUAbortCycles);
+    }
+    
+    return (r->latency);
+}
+
+cycle_t DeviceBus::write(reg_t addr, reg_t value)
+{
+    DeviceRange *r = find(addr);
+    if (!r || r->write(r->device, addr - r->base, value))
+    {
+        fprintf(stderr, "MMU ABORT: No device at %#x.\n", addr);
+        return (kMMUAbortCycles);
+    }
+    
+    return (r->latency);
+}
+
+UART::UART()
+{
+    _used = 0;
+}
+
+UART::~UART()
+{
+    flush();
+}
+
+void UART::flush()
+{
+    if (!_used) return;
+    
+    fwrite(_buffer, 1, _used, stdout);
+    fflush(stdout);
+    _used = 0;
+}
+
+bool UART::read(void *, reg_t offset, reg_t &value)
+{
+    switch (offset)
+    {
+        case kUARTData:
+        value = 0x0;
+        return (false);
+        
+        case kUARTStatus:
+        value = kUARTReady;
+        return (false);
+        
+        default:
+        return (true);
+    }
+}
+
+bool UART::write(void *device, reg_t offset, reg_t value)
+{
+    UART *u = (UART *)device;
+    
+    // Status is read only, but writing it is harmless
+    if (offset == kUARTStatus) return (false);
+    if (offset != kUARTData) return (true);
+    
+    u->_buffer[u->_used++] = (char)(value & kByteMask);
+    if (u->_used == kUARTBufferSize || (char)value == '\n') u->flush();
+    return (false);
+}
+
+CycleCounter::CycleCounter(VirtualMachine *vm) : _vm(vm)
+{
+    _high = 0;
+}
+
+CycleCounter::~CycleCounter()
+{
+    _vm = NULL;
+}
+
+bool CycleCounter::read(void *device, reg_t offset, reg_t &value)
+{
+    CycleCounter *c = (CycleCounter *)device;
+    unsigned long long now = c->_vm->cycleCount();
+    
+    switch (offset)
+    {
+        case kCounterLow:
+        c->_high = (reg_t)(now >> 32);
+        value = (reg_t)now;
+        return (false);
+        
+        case kCounterHigh:
+        value = c->_high;
+        return (false);
+        
+        default:
+        return (true);
+    }
+}
+
+bool CycleCounter::write(void *, reg_t offset, reg_t)
+{
+    // The count only goes one way
+    return (offset >= kCounterSize);
+}
+
+BlockDevice::BlockDevice(VirtualMachine *vm, cycle_t seek, reg_t bandwidth,
+    reg_t interrupt) : _vm(vm), _seek(seek), _bandwidth(bandwidth),
+    _interrupt(interrupt)
+{
+    _fd = -1;
+    _data = NULL;
+    _size = 0;
+    _writable = false;
+    _sector = 0;
+    _address = 0;
+    _count = 0;
+    _status = kDeviceIdle;
+    _command = 0;
+    _head = 0;
+}
+
+BlockDevice::~BlockDevice()
+{
+    if (_data) munmap(_data, _size);
+    if (_fd >= 0) close(_fd);
+    _vm = NULL;
+}
+
+bool BlockDevice::init(const char *path)
+{
+    if (!_vm || !path) return (true);
+    if (!_bandwidth) _bandwidth = 1;
+    
+    // Writes go back to the file if we're allowed to
+    _writable = true;
+    _fd = open(path, O_RDWR);
+    if (_fd < 0)
+    {
+        _writable = false;
+        _fd = open(path, O_RDONLY);
+    }
+    
+    struct stat st;
+    if (_fd < 0 || fstat(_fd, &st))
+    {
+        fprintf(stderr, "Could not open disk image '%s'.\n", path);
+        return (true);
+    }
+    
+    // Only whole sectors are reachable
+    _size = (size_t)st.st_size;
+    if (_size < kSectorSize)
+    {
+        fprintf(stderr, "Disk image '%s' is smaller than a sector.\n", path);
+        return (true);
+    }
+    
+    void *m = mmap(NULL, _size, _writable ? PROT_READ | PROT_WRITE :
+        PROT_READ, MAP_SHARED, _fd, 0);
+    if (m == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map disk image '%s'.\n", path);
+        return (true);
+    }
+    
+    _data = (char *)m;
+    return (false);
+}
+
+bool BlockDevice::start(reg_t command)
+{
+    if (_status == kDeviceBusy) return (true);
+    if (command != kDiskRead && command != kDiskWrite) return (true);
+    if (command == kDiskWrite && !_writable) return (true);
+    
+    // The whole transfer has to be on the disk and in memory
+    size_t from = (size_t)_sector * kSectorSize;
+    size_t len = (size_t)_count * kSectorSize;
+    if (!_count || from / kSectorSize != _sector || from >= _size ||
+        len > _size - from || !_vm->hostMemory(_address, len))
+        return (true);
+    
+    cycle_t time = (len + _bandwidth - 1) / _bandwidth;
+    if (_sector != _head) time += _seek;
+    
+    _command = command;
+    _status = kDeviceBusy;
+    _head = _sector + _count;
+    _vm->scheduleEvent(_vm->cycleCount() + time, complete, this);
+    return (false);
+}
+
+void BlockDevice::complete(VirtualMachine *vm, void *data)
+{
+    BlockDevice *d = (BlockDevice *)data;
+    
+    // The data only shows up once the transfer is done.  Memory is always
+    // current, the caches only keep time, so they have nothing to update.
+    size_t len = (size_t)d->_count * kSectorSize;
+    char *mem = vm->hostMemory(d->_address, len);
+    char *disk = d->_data + (size_t)d->_sector * kSectorSize;
+    
+    if (d->_command == kDiskRead)
+        memcpy(mem, disk, len);
+    else
+        memcpy(disk, mem, len);
+    
+    d->_status = kDeviceIdle;
+    if (d->_interrupt != kNoDeviceInterrupt) vm->raiseInterrupt(d->_interrupt);
+}
+
+bool BlockDevice::read(void *device, reg_t offset, reg_t &value)
+{
+    BlockDevice *d = (BlockDevice *)device;
+    
+    switch (offset)
+    {
+        case kDiskSector:
+        value = d->_sector;
+        return (false);
+        
+        case kDiskAddress:
+        value = d->_address;
+        return (false);
+        
+        case kDiskCount:
+        value = d->_count;
+        return (false);
+        
+        case kDiskCommand:
+        value = d->_status;
+        return (false);
+        
+        case kDiskSectors:
+        value = (reg_t)(d->_size / kSectorSize);
+        return (false);
+        
+        default:
+        return (true);
+    }
+}
+
+bool BlockDevice::write(void *device, reg_t offset, reg_t value)
+{
+    BlockDevice *d = (BlockDevice *)device;
+    
+    // Changing a transfer while it's going would change where it lands
+    if (d->_status == kDeviceBusy && offset != kDiskCommand) return (false);
+    
+    switch (offset)
+    {
+        case kDiskSector:
+        d->_sector = value;
+        return (false);
+        
+        case kDiskAddress:
+        d->_address = value;
+        return (false);
+        
+        case kDiskCount:
+        d->_count = value;
+        return (false);
+        
+        case kDiskCommand:
+        // A bad command is the guest's problem, not the bus's
+        if (d->start(value) && d->_status != kDeviceBusy)
+            d->_status = kDeviceError;
+        return (false);
+        
+        case kDiskSectors:
+        return (false);
+        
+        default:
+        return (true);
+    }
+}
+
+DMAEngine::DMAEngine(VirtualMachine *vm, MMU *mmu, reg_t interrupt) :
+    _vm(vm), _mmu(mmu), _interrupt(interrupt)
+{
+    _memory_size = _mmu->memorySize();
+    _source = 0;
+    _dest = 0;
+    _length = 0;
+    _status = kDeviceIdle;
+    _done = 0;
+    _burst = 0;
+    _source_device = false;
+    _dest_device = false;
+    _transfers = 0;
+    _bytes = 0;
+    
+    // Nothing waited for memory before there was something to wait for
+    _mmu->shareMemory();
+}
+
+DMAEngine::~DMAEngine()
+{
+    _vm = NULL;
+    _mmu = NULL;
+}
+
+void DMAEngine::printStatistics()
+{
+    printf("DMA: %lu transfers, %lu bytes, processor waited %lu cycles for "
+        "memory\n", _transfers, _bytes, _mmu->contentionCycles());
+}
+
+bool DMAEngine::start()
+{
+    if (_status == kDeviceBusy || !_length) return (true);
+    
+    // Memory ends have to be in memory, and devices go a word at a time
+    _source_device = _source >= _memory_size;
+    _dest_device = _dest >= _memory_size;
+    if (!_source_device && !_vm->hostMemory(_source, _length)) return (true);
+    if (!_dest_device && !_vm->hostMemory(_dest, _length)) return (true);
+    if ((_source_device || _dest_device) && (_length % kRegSize))
+        return (true);
+    
+    _status = kDeviceBusy;
+    _done = 0;
+    _transfers++;
+    next();
+    return (false);
+}
+
+cycle_t DMAEngine::burstTime(reg_t len)
+{
+    reg_t words = (len + kRegSize - 1) / kRegSize;
+    
+    // Devices keep their own time, memory is by the word like a line fill
+    cycle_t time = 0;
+    if (!_source_device) time += words * _mmu->readTime();
+    if (!_dest_device) time += words * _mmu->writeTime();
+    return (time ? time : 1);
+}
+
+void DMAEngine::next()
+{
+    // Take memory for the next burst, which lands when that's over
+    _burst = _length - _done;
+    if (_burst > kDMABurstSize) _burst = kDMABurstSize;
+    
+    cycle_t time = burstTime(_burst);
+    cycle_t start = (_source_device && _dest_device) ? _vm->cycleCount() :
+        _mmu->claimMemory(time);
+    _vm->scheduleEvent(start + time, burst, this);
+}
+
+void DMAEngine::move(reg_t len)
+{
+    DeviceBus *bus = _mmu->bus();
+    reg_t from = _source_device ? _source : _source + _done;
+    reg_t to = _dest_device ? _dest : _dest + _done;
+    
+    if (!_source_device && !_dest_device)
+    {
+        memmove(_vm->hostMemory(to, len), _vm->hostMemory(from, len), len);
+        return;
+    }
+    
+    // Device time was already counted in the burst
+    for (reg_t i = 0; i < len; i += kRegSize)
+    {
+        reg_t word;
+        
+        if (_source_device)
+            bus->read(from, word);
+        else
+            memcpy(&word, _vm->hostMemory(from + i, kRegSize), kRegSize);
+        
+        if (_dest_device)
+            bus->write(to, word);
+        else
+            memcpy(_vm->hostMemory(to + i, kRegSize), &word, kRegSize);
+    }
+}
+
+void DMAEngine::burst(VirtualMachine *vm, void *data)
+{
+    DMAEngine *d = (DMAEngine *)data;
+    
+    d->move(d->_burst);
+    d->_done += d->_burst;
+    d->_bytes += d->_burst;
+    
+    if (d->_done < d->_length)
+    {
+        d->next();
+        return;
+    }
+    
+    d->_status = kDeviceIdle;
+    if (d->_interrupt != kNoDeviceInterrupt) vm->raiseInterrupt(d->_interrupt);
+}
+
+bool DMAEngine::read(void *device, reg_t offset, reg_t &value)
+{
+    DMAEngine *d = (DMAEngine *)device;
+    
+    switch (offset)
+    {
+        case kDMASource:
+        value = d->_source;
+        return (false);
+        
+        case kDMADest:
+        value = d->_dest;
+        return (false);
+        
+        case kDMALength:
+        value = d->_length;
+        return (false);
+        
+        case kDMAControl:
+        value = d->_status;
+        return (false);
+        
+        default:
+        return (true);
+    }
+}
+
+bool DMAEngine::write(void *device, reg_t offset, reg_t value)
+{
+    DMAEngine *d = (DMAEngine *)device;
+    
+    // Changing a transfer while it's going would change where it lands
+    if (d->_status == kDeviceBusy) return (false);
+    
+    switch (offset)
+    {
+        case kDMASource:
+        d->_source = value;
+        return (false);
+        
+        case kDMADest:
+        d->_dest = value;
+        return (false);
+        
+        case kDMALength:
+        d->_length = value;
+        return (false);
+        
+        case kDMAControl:
+        if (value != kDMAStart || d->start()) d->_status = kDeviceError;
+        return (false);
+        
+        default:
+        return (true);
+    }
+}
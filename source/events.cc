@@ -0,0 +1,116 @@
+#include "includes/events.h"
+
+EventQueue::EventQueue(VirtualMachine *vm) : _vm(vm)
+{
+    _heap = NULL;
+    _count = 0;
+    _capacity = 0;
+    _last_id = 0;
+}
+
+EventQueue::~EventQueue()
+{
+    if (_heap) free(_heap);
+    _vm = NULL;
+}
+
+bool EventQueue::init()
+{
+    // Return true if instantiation failed
+    if (!_vm) return (true);
+    
+    _capacity = kDefaultEventCapacity;
+    _heap = (ScheduledEvent *)malloc(sizeof(ScheduledEvent) * _capacity);
+    return (!_heap);
+}
+
+reg_t EventQueue::schedule(cycle_t when, EventCallback callback, void *data)
+{
+    if (!callback) return (0);
+    
+    if (_count == _capacity)
+    {
+        ScheduledEvent *temp = (ScheduledEvent *)realloc(_heap,
+            sizeof(ScheduledEvent) * _capacity * 2);
+        if (!temp) return (0);
+        
+        _heap = temp;
+        _capacity *= 2;
+    }
+    
+    // Skip 0 when the ids wrap, so that it can mean "nothing"
+    if (!++_last_id) _last_id++;
+    
+    _heap[_count].when = when;
+    _heap[_count].id = _last_id;
+    _heap[_count].callback = callback;
+    _heap[_count].data = data;
+    up(_count++);
+    
+    return (_last_id);
+}
+
+bool EventQueue::cancel(reg_t id)
+{
+    // There are never many, so there's no index to keep up to date
+    for (reg_t i = 0; i < _count; i++)
+    {
+        if (_heap[i].id != id) continue;
+        
+        remove(i);
+        return (false);
+    }
+    
+    return (true);
+}
+
+void EventQueue::run(cycle_t now)
+{
+    while (_count && _heap[0].when <= now)
+    {
+        // Take it off first, the callback may schedule more
+        ScheduledEvent e = _heap[0];
+        remove(0);
+        e.callback(_vm, e.data);
+    }
+}
+
+void EventQueue::swap(reg_t a, reg_t b)
+{
+    ScheduledEvent temp = _heap[a];
+    _heap[a] = _heap[b];
+    _heap[b] = temp;
+}
+
+void EventQueue::up(reg_t i)
+{
+    while (i && before(i, (i - 1) >> 1))
+    {
+        swap(i, (i - 1) >> 1);
+        i = (i - 1) >> 1;
+    }
+}
+
+void EventQueue::down(reg_t i)
+{
+    for (;;)
+    {
+        reg_t child = (i << 1) + 1;
+        if (child >= _count) return;
+        if (child + 1 < _count && before(child + 1, child)) child++;
+        if (!before(child, i)) return;
+        
+        swap(i, child);
+        i = child;
+    }
+}
+
+void EventQueue::remove(reg_t i)
+{
+    _count--;
+    if (i == _count) return;
+    
+    _heap[i] = _heap[_count];
+    up(i);
+    down(i);
+}
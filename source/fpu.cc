@@ -1,3 +1,6 @@
+#include <fenv.h>
+#include <math.h>
+
 #include "includes/virtualmachine.h"
 #include "includes/pipeline.h"
 #include "includes/fpu.h"
@@ -10,45 +13,146 @@ FPU::~FPU()
     _vm = NULL;
 }
 
-bool FPU::init()
+bool FPU::init(FPUTimings &timing)
 {
     // Return true if instantiation failed
     if (!_vm) return (true);
+    
+    // Copy the supplied timing struct
+    _timing.copy(timing);
+    
+    _output = 0x0;
+    _exceptions = 0x0;
+    _latency = 0;
+    _busy = 0;
+    for (int i = 0; i < kFPRegisters; i++)
+        _ready[i] = 0;
+    
     return (false);
 }
 
-cycle_t FPU::execute(const FPFlags &flags)
+bool FPU::writesResult(char op)
 {
-    cycle_t cycles = 0;
-    bool shift_carry = false;
-    bool arithmetic = true;
-    reg_t dest;
-    //reg_t fpd = _vm->selectRegister(flags.d);
-    reg_t fpn = _vm->selectRegister(flags.n);
-    reg_t fpm = _vm->selectRegister(flags.m);
+    return (FPOpMnemonics[op & 0xF] && !compares(op));
+}
 
-   // printf("%u %u", fpn, fpm);
+bool FPU::compares(char op)
+{
+    return (op == kCMF || op == kCNF);
+}
+
+reg_t FPU::compare(float n, float m)
+{
+    if (isunordered(n, m)) return (kPSRCBit | kPSRVBit);
+    if (n < m) return (kPSRNBit);
+    if (n == m) return (kPSRZBit | kPSRCBit);
+    return (kPSRCBit);
+}
+
+cycle_t FPU::execute(const FPFlags &flags)
+{
+    // volatile, so that the host does the math in between the exception
+    // flag reads
+    volatile float n = toFloat(_vm->selectRegister(flags.n + kFPR0Code));
+    volatile float m = toFloat(_vm->selectRegister(flags.m + kFPR0Code));
+    volatile float d = toFloat(_vm->selectRegister(flags.d + kFPR0Code));
+    volatile float result = 0.0f;
+    reg_t bits = 0x0;
+    int fixed;
     
+    feclearexcept(FE_ALL_EXCEPT);
     
-    //Add FPn + FPm and store result in FPs and FPd.
     switch (flags.op)
     {
         case kFAD:
-            _output = fpn + fpm;
-            break;
+        result = n + m;
+        break;
+        
         case kFSB:
-            _output = fpn - fpm;
-            break;
+        result = n - m;
+        break;
+        
+        case kFMA:
+        result = fmaf(n, m, d);
+        break;
+        
         case kFML:
-            _output = (fpn * fpm);
-            break;
+        result = n * m;
+        break;
+        
+        case kFSQ:
+        result = sqrtf(n);
+        break;
+        
+        case kFLT:
+        result = (float)(signed int)_vm->selectRegister(flags.n + kFPR0Code);
+        break;
+        
+        case kFIX:
+        // Out of range and NaN saturate, and are invalid
+        if (isnan(n)) {
+            fixed = 0;
+            feraiseexcept(FE_INVALID);
+        } else if (n >= 2147483648.0f) {
+            fixed = 0x7FFFFFFF;
+            feraiseexcept(FE_INVALID);
+        } else if (n < -2147483648.0f) {
+            fixed = -0x7FFFFFFF - 1;
+            feraiseexcept(FE_INVALID);
+        } else {
+            fixed = (int)n;
+            if ((float)fixed != n) feraiseexcept(FE_INEXACT);
+        }
+        bits = (reg_t)fixed;
+        break;
+        
         case kFDV:
-            printf("========================");
-            _output = fpn / fpm;
-            break;
+        result = n / m;
+        break;
+        
+        case kCMF:
+        bits = compare(n, m);
+        break;
+        
+        case kCNF:
+        bits = compare(n, -m);
+        break;
+        
         default:
-            break;
+        break;
+    }
+    
+    int raised = fetestexcept(FE_ALL_EXCEPT);
+    _exceptions = 0x0;
+    if (raised & FE_INVALID) _exceptions |= kFPSRInvalid;
+    if (raised & FE_DIVBYZERO) _exceptions |= kFPSRDivideByZero;
+    if (raised & FE_OVERFLOW) _exceptions |= kFPSROverflow;
+    if (raised & FE_UNDERFLOW) _exceptions |= kFPSRUnderflow;
+    if (raised & FE_INEXACT) _exceptions |= kFPSRInexact;
+    
+    if (compares(flags.op))
+    {
+        // Status bits are set as we go, like the ALU does
+        _vm->_psr = (_vm->_psr & ~NVCZ_MASK) | bits;
+        _output = _vm->_psr;
+    } else if (flags.op == kFIX) {
+        _output = bits;
+    } else {
+        _output = toReg(result);
     }
-    //fpd = _output;   
-    return (cycles);
+    
+    // Wait for the operands, and for the unit if this or the op in it
+    // isn't pipelined
+    cycle_t now = _vm->cycleCount();
+    cycle_t start = now;
+    if (_ready[flags.n] > start) start = _ready[flags.n];
+    if (_ready[flags.m] > start) start = _ready[flags.m];
+    if (flags.op == kFMA && _ready[flags.d] > start) start = _ready[flags.d];
+    if (_busy > start) start = _busy;
+    
+    _latency = _timing.op[flags.op];
+    if (writesResult(flags.op)) _ready[flags.s] = start + _latency;
+    if (!_timing.pipelined[flags.op]) _busy = start + _latency;
+    
+    return (start - now);
 }
@@ -40,30 +40,64 @@ static const char *DPOpMnumonics[kDPOpcodeCount] =
     "XOR", "CMP", "CMN", "TST", "TEQ", "MOV", "BIC", "NOP"
 };
 
+// MUL always writes its 64 bit product to pq0 (low) and pq1 (high), so its
+// rd field says what kind of multiply it is instead.  Anything below 0x10
+// is a general register, which is what older programs put there, and means
+// a signed MUL.  The accumulating kinds add the product to what is already
+// in pq: MAC only into pq0, the long ones into all 64 bits of pq1:pq0.
+enum MultiplyKinds {
+    kMULSigned          = 0x00,
+    kMULUnsigned        = 0x10,
+    kMULAccumulate      = 0x11,
+    kMULAccumulateLong  = 0x12,
+    kMULAccumulateLongUnsigned = 0x13
+};
+
+// The accumulating multiplies have timings of their own, after the ops
+enum MultiplyTimings {
+    kMACTiming = kDPOpcodeCount, kMACLTiming, kALUTimingCount
+};
+
+static const char *MultiplyTimingNames[kALUTimingCount - kDPOpcodeCount] =
+{   "MAC", "MACL" };
+
 // Default timing for ANY instruction not specified in config file
 #define kDefaultALUTiming   0
 
 struct ALUTimings {
     ALUTimings()
     {
-        for (int i = 0; i < kDPOpcodeCount; i++)
+        for (int i = 0; i < kALUTimingCount; i++)
             op[i] = kDefaultALUTiming;
     }
     
     inline void copy(ALUTimings &src)
     {
-        for (int i = 0; i < kDPOpcodeCount; i++)
+        for (int i = 0; i < kALUTimingCount; i++)
             op[i] = src.op[i];
     }
     
-    cycle_t op[kDPOpcodeCount];
+    cycle_t op[kALUTimingCount];
+};
+
+// What decode knows about how operand two is made: an immediate, or rm
+// shifted by a literal or a register.  The shifter only does LSL and ROR.
+enum ALUOperandForms {
+    kFormImmediate, kFormLSLLiteral, kFormRORLiteral, kFormLSLRegister,
+    kFormRORRegister, kALUFormCount
 };
 
+#define kALUKernelCount (kDPOpcodeCount * kALUFormCount * 2)
+
 struct DPFlags;
 struct STFlags;
 
 // Forward class definitions
 class VirtualMachine;
+class ALU;
+
+// One data processing op specialized for its operand form and S bit
+typedef cycle_t (*ALUKernel)(ALU *alu, DPFlags &f);
 
 class ALU
 {
@@ -77,12 +111,23 @@ public:
     cycle_t dataProcessing(DPFlags &instruction);
     cycle_t singleTransfer(STFlags &f);
     
+    // The kernel for this form of the op, picked once in decode so that
+    // execute doesn't have to work it out again every time
+    static ALUKernel kernelFor(const DPFlags &f);
+    cycle_t execute(DPFlags &f);
+    
+    // Checks the kernels against dataProcessing() and times them both
+    bool benchmark(reg_t ops);
+    
     // Access to the barrel shifter.
     void shiftOffset(reg_t &offset);
     void shiftOffset(reg_t &offset, reg_t &val);
     
     static bool shift(reg_t &offset, reg_t val, reg_t shift, reg_t op);
     
+    // Whether a MUL with this rd field reads pq as well
+    static bool accumulates(char kind);
+    
     inline bool result()
     {
         return (_result);
@@ -97,8 +142,14 @@ public:
     {
         return (_aux_out);
     }
-    
+
 private:
+    cycle_t multiply(DPFlags &f, reg_t source);
+    
+    template <int op, int form, int s>
+    static cycle_t kernel(ALU *alu, DPFlags &f);
+    template <int index> friend struct ALUKernelTable;
+    
     VirtualMachine *_vm;
     ALUTimings _timing;
     bool _carry_out, _result;
@@ -0,0 +1,44 @@
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+#include "global.h"
+
+// Atomic memory ops and cache control live in what used to be reserved
+// opcode 1001:
+// cond | 1001 | op | rs | rd | rm | 00000
+// rs holds the word aligned address, rd gets the result and rm is the value
+// to store.  Nothing else can get at the word between an atomic op's read
+// and its write, on this core or any other.
+enum AtomicInstructionMasks {
+    kAtomicOpCodeMask   = 0x00F00000,
+    kAtomicAddressMask  = 0x000F8000,
+    kAtomicDestMask     = 0x00007C00,
+    kAtomicValueMask    = 0x000003E0
+};
+
+// SWP puts the word in rd and rm in the word.  CAS does the same only if
+// the word is what rd was, and sets Z if it did.  LDL loads the word and
+// reserves its line, and STC stores rm only if the reservation is still
+// there, putting 0 in rd if it did and 1 if it didn't.  The reservation
+// goes away with an STC, and with the line when the first level cache
+// loses it to another core or evicts it.
+//
+// The rest don't have a result.  PLD starts bringing the line into the
+// cache level in rm's field, and whatever uses the line before it's there
+// waits for the rest of it.  STNT stores rm straight to memory, and takes
+// the line out of every cache on the way.  CLEAN writes the line back
+// from every level that has it modified, INVAL drops it without doing
+// that, and FLUSH does both.  On a coherent core they reach the other
+// cores' first level caches too.
+enum AtomicOpCodes {
+    kSWP, kCAS, kLDL, kSTC, kPLD, kSTNT, kCLEAN, kINVAL, kFLUSH,
+    kAtomicOpcodeCount = 0x10
+};
+
+// Unassigned encodings don't have a name, and trap
+static const char *AtomicOpMnemonics[kAtomicOpcodeCount] =
+{   "SWP", "CAS", "LDL", "STC", "PLD", "STNT", "CLEAN", "INVAL",
+    "FLUSH", NULL, NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <pthread.h>
+#include <vector>
+#include <deque>
+
+#include "global.h"
+#include "intervals.h"
+#include "sweep.h"
+
+#define kMaxBatchPath 1024
+#define kMaxBatchParameters 32
+
+// Forward class definitions
+class VirtualMachine;
+
+// One line of the manifest, or one point of its config's sweep, and what
+// running it measured.  An empty program is the config's own.
+typedef struct BatchJob
+{
+    char program[kMaxBatchPath], config[kMaxBatchPath];
+    SweepPoint point;
+    bool failed;
+    double seconds;
+    reg_t worker;
+    IntervalResult result;
+};
+
+// Runs every (program, config) pair in a manifest, jobs at a time, and
+// writes what each measured to one summary.  The summary is JSON if its
+// name ends in .json and CSV otherwise.  A config with a sweep is run at
+// every one of its points, and what each setting was goes in columns of
+// its own.
+//
+// Each worker is pinned to a core and keeps one machine, which it
+// initializes again for every job.  That keeps the machine's memory, so
+// jobs the same size don't each allocate their own.  Jobs are dealt out
+// to the workers up front; one that runs out takes from the back of
+// another's queue, so a few long jobs don't leave the rest of the pool
+// idle.
+class BatchDriver
+{
+public:
+    BatchDriver(const char *summary, reg_t jobs);
+    ~BatchDriver();
+    
+    // Add jobs, then init() to deal them out
+    bool readManifest(const char *manifest);
+    bool addJob(const char *program, const char *config);
+    
+    bool init();
+    
+    // The machines' own output goes to the log while they run
+    bool run(const char *log);
+    bool writeSummary();
+    void printStatistics();
+
+private:
+    typedef struct WorkQueue
+    {
+        std::deque<size_t> jobs;
+        pthread_mutex_t lock;
+    };
+    
+    typedef struct Worker
+    {
+        BatchDriver *driver;
+        reg_t index;
+    };
+    
+    bool runWorkers();
+    bool take(reg_t worker, size_t &job);
+    void runJob(VirtualMachine *vm, BatchJob &job);
+    static void *work(void *worker);
+    
+    void writeCSV(FILE *f);
+    void writeJSON(FILE *f);
+    char summaryCaches();
+    const char *parameter(BatchJob &job, reg_t column);
+    
+    const char *_summary;
+    reg_t _jobs;
+    
+    // Every setting any job's sweep changes
+    char _parameters[kMaxBatchParameters][kMaxSweepName];
+    reg_t _parameter_count;
+    
+    std::vector<BatchJob> _list;
+    WorkQueue *_queues;
+    
+    // Accounting
+    double _wall;
+    size_t _stolen;
+    pthread_mutex_t _lock;
+};
+
+#endif
@@ -11,6 +11,16 @@ enum CacheConstants
     kLineSize = 4
 };
 
+// MESI states of a line, for caches kept coherent with other cores'.  A
+// line that isn't in the cache is invalid.
+enum LineStates
+{
+    kLineInvalid,
+    kLineShared,
+    kLineExclusive,
+    kLineModified
+};
+
 typedef struct CacheDescription
 {
     reg_t size;
@@ -45,6 +55,49 @@ public:
         return (_store);
     }
     
+    inline size_t accesses()
+    {
+        return (_accesses);
+    }
+    
+    inline size_t misses()
+    {
+        return (_misses);
+    }
+    
+    inline reg_t lineBytes()
+    {
+        return (_line_length << kIgnoredBits);
+    }
+    
+    // Coherence
+    char state(reg_t addr);
+    void setState(reg_t addr, char state);
+    
+    // Drops the line, and returns true if it was modified
+    bool invalidate(reg_t addr);
+    
+    // The next miss is filled by another cache over the bus, so nothing
+    // below this one is asked for the line
+    inline void forward()
+    {
+        _forwarded = true;
+    }
+    
+    // Writes the line addr is in back if it's modified, and drops it if
+    // asked to, here and in every level above
+    cycle_t maintain(reg_t addr, bool clean, bool drop);
+    
+    // LDL's reservation of the line addr is in, which the line takes with it
+    // when it's invalidated or evicted
+    void link(reg_t addr);
+    bool linked(reg_t addr);
+    
+    inline void unlink()
+    {
+        _linked = false;
+    }
+
 private:
     reg_t lru(reg_t set);
     bool isCached(reg_t addr, reg_t &index);
@@ -67,9 +120,18 @@ private:
     reg_t *_tag;
     bool *_dirty;
     char *_lru;
+    char *_state;
+    bool _forwarded;
+    
+    // Where the reserved line is
+    bool _linked;
+    reg_t _link;
     
     // do we actually save data?
     bool _store;
+    
+    // Accounting
+    size_t _accesses, _misses;
 };
 
 #endif // Include Guard
@@ -0,0 +1,26 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include "global.h"
+#include "virtualmachine.h"
+
+#define kCheckpointMagic    0x41414159 // "YAAA"
+#define kCheckpointVersion  1
+
+// Architectural state of the machine at the start of a profiled interval.
+// The whole of memory follows it in the file.  Nothing microarchitectural
+// is kept, so caches and predictors start cold from a checkpoint.
+typedef struct CheckpointHeader
+{
+    reg_t magic, version;
+    reg_t r[kGeneralRegisters], pq[kPQRegisters], fpr[kFPRegisters];
+    reg_t pc, cs, ds, ss, psr, fpsr;
+    reg_t supervisor, memory_size;
+    
+    // Which interval this is, how long intervals were, and how many
+    // instructions ran before it
+    reg_t interval, interval_length;
+    cycle_t instructions;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef _COHERENCE_H_
+#define _COHERENCE_H_
+
+#include <pthread.h>
+
+#include "global.h"
+
+#define kDefaultSnoopCycles         4
+#define kDefaultTransferCycles      8
+#define kDefaultInvalidateCycles    2
+
+// Forward class definitions
+class VirtualMachine;
+class MemoryCache;
+
+// What the bus takes for a transaction, in cycles.  Every one snoops the
+// other caches, a line one of them has comes over in transfer cycles
+// instead of from below, and each copy a write does away with takes
+// invalidate more.
+typedef struct CoherenceTiming
+{
+    cycle_t snoop, transfer, invalidate;
+};
+
+// Keeps the first level caches of the cores of a machine coherent with
+// MESI, by snooping on a bus they share.  Memory is always current, so all
+// the protocol decides is what an access costs and what it leaves in the
+// other caches: reads of a line others have make every copy shared, and
+// writes invalidate the rest.  Hits on a line the core has the right to
+// use stay off the bus.
+//
+// Cores can run on threads of their own, with clocks that are apart, so
+// the bus is locked around every access that goes through it, and a
+// transaction only waits for one that started no later than it did.
+class CoherenceBus
+{
+public:
+    CoherenceBus(reg_t cores, const CoherenceTiming &timing);
+    ~CoherenceBus();
+    
+    bool init();
+    void attach(reg_t core, VirtualMachine *vm, MemoryCache *cache);
+    
+    // Before and after 'core' has its cache look up the word at addr
+    cycle_t request(reg_t core, reg_t addr, bool write);
+    void granted(reg_t core, reg_t addr);
+    
+    // Cleans, drops or flushes the line in every other core's cache
+    cycle_t maintain(reg_t core, reg_t addr, bool clean, bool drop);
+    
+    // Held around both, and the cache access in between.  It can be taken
+    // again by whoever holds it.
+    inline void lock()
+    {
+        pthread_mutex_lock(&_lock);
+    }
+    
+    inline void unlock()
+    {
+        pthread_mutex_unlock(&_lock);
+    }
+    
+    inline size_t transactions()
+    {
+        return (_transactions);
+    }
+    
+    void printStatistics();
+
+private:
+    cycle_t occupy(reg_t core, cycle_t duration);
+    
+    reg_t _cores;
+    CoherenceTiming _timing;
+    VirtualMachine **_vm;
+    MemoryCache **_cache;
+    
+    // What the line each core asked for becomes once it has it
+    char *_next;
+    pthread_mutex_t _lock;
+    
+    // When the latest transaction started, and when the bus is free of it
+    cycle_t _started, _busy;
+    
+    // Accounting
+    size_t _transactions, _upgrades, _transfers, _invalidations, _writebacks;
+    cycle_t _wait;
+    size_t *_supplied, *_invalidated;
+};
+
+#endif
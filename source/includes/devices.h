@@ -0,0 +1,225 @@
+#ifndef _DEVICES_H_
+#define _DEVICES_H_
+
+#include "global.h"
+
+#define kMaxDevices             16
+#define kMaxDeviceName          16
+#define kUARTBufferSize         256
+
+// The devices that can be put on the bus from config.lua
+enum DeviceKinds {
+    kDeviceUART, kDeviceCounter, kDeviceDisk, kDeviceDMA,
+    kDeviceKindCount
+};
+
+static const char *DeviceKindNames[kDeviceKindCount] =
+{   "uart", "counter", "disk", "dma" };
+
+// What a device that works in the background says it's doing, and the
+// interrupt it raises when it's done if it has been given one
+enum DeviceStatus {
+    kDeviceIdle, kDeviceBusy, kDeviceError
+};
+
+#define kNoDeviceInterrupt      ((reg_t) -1)
+
+// Registers of the console UART
+//  data:   writing sends the low byte to the console, reads are 0
+//  status: bit 0 is set when it can take another byte, which is always
+enum UARTRegisters {
+    kUARTData           = 0x0,
+    kUARTStatus         = 0x4,
+    kUARTSize           = 0x8
+};
+
+#define kUARTReady              0x1
+
+// Registers of the cycle counter.  Reading the low word keeps the high word
+// as it was then, so that the two make one count.
+enum CounterRegisters {
+    kCounterLow         = 0x0,
+    kCounterHigh        = 0x4,
+    kCounterSize        = 0x8
+};
+
+// Registers of the block device.  Set up a transfer, then write the
+// command; status reads busy until the data has moved, and if an interrupt
+// was configured it is raised then.
+//  sector:     the first sector on the disk
+//  address:    where in memory it goes to or comes from
+//  count:      how many sectors
+//  command:    writing starts one, reading gives the status
+//  sectors:    how many sectors the disk has
+enum DiskRegisters {
+    kDiskSector         = 0x0,
+    kDiskAddress        = 0x4,
+    kDiskCount          = 0x8,
+    kDiskCommand        = 0xC,
+    kDiskSectors        = 0x10,
+    kDiskSize           = 0x14
+};
+
+enum DiskCommands {
+    kDiskRead           = 0x1,
+    kDiskWrite          = 0x2
+};
+
+#define kSectorSize             512
+
+// Registers of the DMA engine, which copies 'length' bytes from 'source' to
+// 'dest' in the background.  Either end can be a device, which is read or
+// written a word at a time at the same address.  Writing 1 to control
+// starts it, and reading it gives the status, as for the disk.
+enum DMARegisters {
+    kDMASource          = 0x0,
+    kDMADest            = 0x4,
+    kDMALength          = 0x8,
+    kDMAControl         = 0xC,
+    kDMASize            = 0x10
+};
+
+#define kDMAStart               0x1
+
+// Bytes moved each time the engine gets memory
+#define kDMABurstSize           32
+
+// Forward class definitions
+class VirtualMachine;
+class MMU;
+
+// Accesses are relative to the base of the device.  They return true if
+// the device doesn't have anything at that offset.
+typedef bool (*DeviceRead)(void *device, reg_t offset, reg_t &value);
+typedef bool (*DeviceWrite)(void *device, reg_t offset, reg_t value);
+
+typedef struct DeviceRange
+{
+    char name[kMaxDeviceName];
+    reg_t base, size;
+    cycle_t latency;
+    void *device;
+    DeviceRead read;
+    DeviceWrite write;
+};
+
+// Devices live above the end of memory, so the MMU only has to come here
+// when an address is past it.  Every access takes the device's latency,
+// the caches never see them.
+class DeviceBus
+{
+public:
+    DeviceBus(VirtualMachine *vm);
+    ~DeviceBus();
+    
+    // Returns true if the range is taken or there's no room
+    bool attach(const char *name, reg_t base, reg_t size, cycle_t latency,
+        void *device, DeviceRead read, DeviceWrite write);
+    
+    // Operational: must return the timing
+    cycle_t read(reg_t addr, reg_t &value);
+    cycle_t write(reg_t addr, reg_t value);
+private:
+    DeviceRange *find(reg_t addr);
+    
+    VirtualMachine *_vm;
+    DeviceRange _ranges[kMaxDevices];
+    reg_t _count;
+};
+
+// Console output, kept until there's a line or the buffer fills up so that
+// the host isn't asked to write a byte at a time
+class UART
+{
+public:
+    UART();
+    ~UART();
+    
+    void flush();
+    
+    static bool read(void *device, reg_t offset, reg_t &value);
+    static bool write(void *device, reg_t offset, reg_t value);
+private:
+    char _buffer[kUARTBufferSize];
+    reg_t _used;
+};
+
+class CycleCounter
+{
+public:
+    CycleCounter(VirtualMachine *vm);
+    ~CycleCounter();
+    
+    static bool read(void *device, reg_t offset, reg_t &value);
+    static bool write(void *device, reg_t offset, reg_t value);
+private:
+    VirtualMachine *_vm;
+    reg_t _high;
+};
+
+// A host file, mapped rather than read so that it can be as big as the
+// host allows, moved to and from memory a sector at a time without going
+// through the processor.  Going anywhere but the sector after the last one
+// transferred costs a seek, and the data moves at 'bandwidth' bytes per
+// cycle.
+class BlockDevice
+{
+public:
+    BlockDevice(VirtualMachine *vm, cycle_t seek, reg_t bandwidth,
+        reg_t interrupt);
+    ~BlockDevice();
+    
+    bool init(const char *path);
+    
+    static bool read(void *device, reg_t offset, reg_t &value);
+    static bool write(void *device, reg_t offset, reg_t value);
+private:
+    bool start(reg_t command);
+    static void complete(VirtualMachine *vm, void *data);
+    
+    VirtualMachine *_vm;
+    cycle_t _seek;
+    reg_t _bandwidth, _interrupt;
+    
+    // The mapped file
+    int _fd;
+    char *_data;
+    size_t _size;
+    bool _writable;
+    
+    // Registers, and the transfer in flight
+    reg_t _sector, _address, _count, _status, _command, _head;
+};
+
+// Moves a burst at a time, each as soon as memory is free after the last,
+// so the processor and the engine slow each other down
+class DMAEngine
+{
+public:
+    DMAEngine(VirtualMachine *vm, MMU *mmu, reg_t interrupt);
+    ~DMAEngine();
+    
+    void printStatistics();
+    
+    static bool read(void *device, reg_t offset, reg_t &value);
+    static bool write(void *device, reg_t offset, reg_t value);
+private:
+    bool start();
+    cycle_t burstTime(reg_t len);
+    void move(reg_t len);
+    void next();
+    static void burst(VirtualMachine *vm, void *data);
+    
+    VirtualMachine *_vm;
+    MMU *_mmu;
+    reg_t _interrupt, _memory_size;
+    
+    // Registers, and how far the transfer in flight has got
+    reg_t _source, _dest, _length, _status, _done, _burst;
+    bool _source_device, _dest_device;
+    
+    // Accounting
+    size_t _transfers, _bytes;
+};
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef _EVENTS_H_
+#define _EVENTS_H_
+
+#include "global.h"
+
+// next() when nothing is scheduled, which the cycle count never reaches
+#define kNoEvent                ((cycle_t) -1)
+#define kDefaultEventCapacity   16
+
+// Forward class definitions
+class VirtualMachine;
+
+// Called with whatever was given to schedule() once the cycle comes
+typedef void (*EventCallback)(VirtualMachine *vm, void *data);
+
+typedef struct ScheduledEvent
+{
+    cycle_t when;
+    reg_t id;
+    EventCallback callback;
+    void *data;
+};
+
+// Things that have to happen at some cycle, kept in a binary heap so that
+// the machine only has to look at the soonest one.  Events due on the same
+// cycle happen in the order they were scheduled.
+class EventQueue
+{
+public:
+    EventQueue(VirtualMachine *vm);
+    ~EventQueue();
+    
+    bool init();
+    
+    // Returns an id for cancel(), which is never 0
+    reg_t schedule(cycle_t when, EventCallback callback, void *data);
+    bool cancel(reg_t id);
+    
+    inline cycle_t next()
+    {
+        return (_count ? _heap[0].when : kNoEvent);
+    }
+    
+    inline reg_t pending()
+    {
+        return (_count);
+    }
+    
+    // Do everything due on or before 'now'
+    void run(cycle_t now);
+private:
+    inline bool before(reg_t a, reg_t b)
+    {
+        if (_heap[a].when != _heap[b].when)
+            return (_heap[a].when < _heap[b].when);
+        return (_heap[a].id < _heap[b].id);
+    }
+    
+    void swap(reg_t a, reg_t b);
+    void up(reg_t i);
+    void down(reg_t i);
+    void remove(reg_t i);
+    
+    VirtualMachine *_vm;
+    ScheduledEvent *_heap;
+    reg_t _count, _capacity, _last_id;
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define _FPU_H_
 
 #include "global.h"
+#include "virtualmachine.h"
 
 enum FPUInstructionMasks {
     kFPOpcodeMask       = 0x00F00000,
@@ -11,16 +12,69 @@ enum FPUInstructionMasks {
     kFPmMask            = 0x00000700
 };
 
+// Encodings are the ones assem.py uses.  Results go to FPs; FMA also adds
+// in FPd, and the unary ops only look at FPn.  The compares set the NZCV
+// bits of the PSR the way a subtraction would, so that the usual condition
+// codes work after them: N for less, Z for equal, C for greater or equal,
+// and C and V together for unordered.  CNF compares FPn with -FPm.
 enum FPUProcessingOpCodes {
-    kFAD, kFSB, kFML, kFDV
+    kFAD                = 0x0,  // FPs = FPn + FPm
+    kFSB                = 0x1,  // FPs = FPn - FPm
+    kFMA                = 0x2,  // FPs = FPd + FPn * FPm, rounded once
+    kFML                = 0x3,  // FPs = FPn * FPm
+    kFSQ                = 0x4,  // FPs = sqrt(FPn)
+    kFLT                = 0x5,  // FPs = FPn, a signed integer, as a float
+    kFIX                = 0x6,  // FPs = FPn as a signed integer, truncated
+    kFDV                = 0x7,  // FPs = FPn / FPm
+    kCMF                = 0xA,
+    kCNF                = 0xC,
+    kFPOpcodeCount      = 0x10
 };
 
-enum FPUProcessingTimings {
-    kFADCycles          = 1,
-    kFSBCycles          = 1,
-    kFMLCycles          = 1,
-    kFDVCycles          = 1
-}; 
+// Unassigned encodings don't have a name, and trap
+static const char *FPOpMnemonics[kFPOpcodeCount] =
+{   "FAD", "FSB", "FMA", "FML", "FSQ", "FLT", "FIX", "FDV",
+    NULL, NULL, "CMF", NULL, "CNF", NULL, NULL, NULL
+};
+
+// Cycles from issue to result when fpu_timings doesn't say
+static const cycle_t FPOpDefaultTimings[kFPOpcodeCount] =
+{   3, 3, 5, 4, 14, 2, 2, 12, 0, 0, 1, 0, 1, 0, 0, 0 };
+
+// Sticky exception flags in the FPSR
+enum FPSRBits {
+    kFPSRInvalid        = 0x00000001,
+    kFPSRDivideByZero   = 0x00000002,
+    kFPSROverflow       = 0x00000004,
+    kFPSRUnderflow      = 0x00000008,
+    kFPSRInexact        = 0x00000010
+};
+
+// Per op latency, and whether the unit can start another op of any kind
+// while it works on one of these.  Divide and square root aren't pipelined
+// by default.
+struct FPUTimings {
+    FPUTimings()
+    {
+        for (int i = 0; i < kFPOpcodeCount; i++)
+        {
+            op[i] = FPOpDefaultTimings[i];
+            pipelined[i] = (i != kFDV && i != kFSQ);
+        }
+    }
+    
+    inline void copy(FPUTimings &src)
+    {
+        for (int i = 0; i < kFPOpcodeCount; i++)
+        {
+            op[i] = src.op[i];
+            pipelined[i] = src.pipelined[i];
+        }
+    }
+    
+    cycle_t op[kFPOpcodeCount];
+    bool pipelined[kFPOpcodeCount];
+};
 
 // Forward struct definitions
 struct FPFlags;
@@ -28,23 +82,61 @@ struct FPFlags;
 // Forward class definitions
 class VirtualMachine;
 
+// Single precision IEEE-754, on the bit patterns in the FP registers.  The
+// FPU keeps its own scoreboard: an op waits for its operands and for any
+// unpipelined op before it, and that wait is what execute() returns.  The
+// full latency of the op is in latency() afterwards.
 class FPU
 {
 public:
     FPU(VirtualMachine *vm);
     ~FPU();
     
-    bool init();
+    bool init(FPUTimings &timings);
+    static bool writesResult(char op);
+    static bool compares(char op);
     
     inline reg_t output()
     {
         return (_output);
     }
     
+    inline reg_t exceptions()
+    {
+        return (_exceptions);
+    }
+    
+    inline cycle_t latency()
+    {
+        return (_latency);
+    }
+    
+    static inline float toFloat(reg_t r)
+    {
+        union { reg_t r; float f; } u;
+        u.r = r;
+        return (u.f);
+    }
+    
+    static inline reg_t toReg(float f)
+    {
+        union { reg_t r; float f; } u;
+        u.f = f;
+        return (u.r);
+    }
+    
     // Operational: must return the timing
     cycle_t execute(const FPFlags &flags);
 private:
-    reg_t _output;
+    reg_t compare(float n, float m);
+    
+    FPUTimings _timing;
+    reg_t _output, _exceptions;
+    cycle_t _latency;
+    
+    // When each register's newest value is done, and when the unit is
+    // free of unpipelined ops
+    cycle_t _ready[kFPRegisters], _busy;
     VirtualMachine *_vm;
 };
 
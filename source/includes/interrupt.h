@@ -7,25 +7,108 @@ enum SWIntInstructionMask {
     kSWIntCommentMask   = 0x00FFFFFF
 };
 
+// Entries in the table at 0x0 are offsets into the routines installed after
+// it, unless this bit is set, in which case the rest is a host handler
+#define kIntHostBit             0x80000000
+
+// Supervisor mode interrupts that always mean the same thing
+enum SupervisorInterrupts {
+    kIntBreak           = 0xF,
+    kIntReturn          = 0xFF
+};
+
+// Handlers built into the host, in the order they are registered.  Binary
+// interrupt tables refer to them by this number.
+//  break:  stop the machine, as BREAK does
+//  write:  write r1 bytes at r0 to the console, r0 = bytes written
+//  read:   read r1 bytes at offset r3 of the file named by the string at
+//          r2 into r0, r0 = bytes read or -1
+//  clock:  r0 = low word of the cycle count, r1 = the high word
+//  timer:  raise interrupt r1 in r0 cycles, or never if r0 is 0
+// The string and memory intrinsics take their arguments in the same order
+// as the C library, from r0 up, and leave what it would return in r0.  They
+// cost the memory traffic on top of their fixed cost.
+enum HostInterrupts {
+    kHostBreak, kHostWrite, kHostRead, kHostClock, kHostTimer,
+    kHostMemcpy, kHostMemmove, kHostMemset, kHostMemcmp, kHostStrlen,
+    kHostInterruptCount
+};
+
+static const char *HostInterruptNames[kHostInterruptCount] =
+{   "break", "write", "read", "clock", "timer", "memcpy", "memmove",
+    "memset", "memcmp", "strlen"
+};
+
+#define kMaxHostHandlers        32
+#define kMaxHandlerName         16
+
+// One "int n" as the config describes it: the name of a host handler, or
+// the words of a guest routine
+typedef struct InterruptDescription
+{
+    char handler[kMaxHandlerName];
+    reg_t *code, length;
+};
+
 // Forward struct definitions
 struct IntFlags;
 
 // Forward class definitions
 class VirtualMachine;
 
+// Returns true if the interrupt failed.  Handlers add any time that depends
+// on what they did to 'cycles'.
+typedef bool (*InterruptHandler)(VirtualMachine *vm, cycle_t &cycles);
+
+// Software interrupts index a table.  Each entry either runs a routine in
+// guest code, in supervisor mode until it does RETURN, or calls a handler
+// on the host that does the whole job at once and charges a fixed cost.
 class InterruptController
 {
 public:
     InterruptController(VirtualMachine *vm, cycle_t timing = 0);
     ~InterruptController();
     
-    bool init();
+    // Handlers have to be registered before init() so that tables can
+    // name them
+    bool registerHandler(const char *name, InterruptHandler handler,
+        cycle_t cost);
+    bool init(InterruptDescription *desc, reg_t count, const char *file,
+        cycle_t *costs);
     
     // Operational: must return the timing
-    cycle_t swint(const IntFlags &flags);
+    cycle_t swint(const IntFlags &flags, reg_t location);
+    
+    // Interrupt n from outside the program, which goes back to 'next'
+    cycle_t raise(reg_t n, reg_t next);
 private:
+    bool buildTable(InterruptDescription *desc, reg_t count);
+    bool loadTable(const char *path);
+    cycle_t callHost(reg_t handler, reg_t next);
+    
+    // The built in handlers
+    static bool hostBreak(VirtualMachine *vm, cycle_t &cycles);
+    static bool hostWrite(VirtualMachine *vm, cycle_t &cycles);
+    static bool hostRead(VirtualMachine *vm, cycle_t &cycles);
+    static bool hostClock(VirtualMachine *vm, cycle_t &cycles);
+    static bool hostTimer(VirtualMachine *vm, cycle_t &cycles);
+    static bool hostMemmove(VirtualMachine *vm, cycle_t &cycles);
+    static bool hostMemset(VirtualMachine *vm, cycle_t &cycles);
+    static bool hostMemcmp(VirtualMachine *vm, cycle_t &cycles);
+    static bool hostStrlen(VirtualMachine *vm, cycle_t &cycles);
+    
     cycle_t _swint_cycles;
     VirtualMachine *_vm;
+    
+    // What was installed at 0x0
+    reg_t *_table, *_functions;
+    reg_t _entries, _function_words;
+    
+    // Registered host handlers
+    InterruptHandler _handlers[kMaxHostHandlers];
+    char _names[kMaxHostHandlers][kMaxHandlerName];
+    cycle_t _costs[kMaxHostHandlers];
+    reg_t _handler_count;
 };
 
 #endif
@@ -0,0 +1,78 @@
+#ifndef _INTERVALS_H_
+#define _INTERVALS_H_
+
+#include <pthread.h>
+#include <vector>
+
+#include "global.h"
+
+#define kMaxIntervalCaches 8
+
+// What one interval measured, once it was warmed up
+typedef struct IntervalResult
+{
+    inline void clear()
+    {
+        instructions = 0;
+        cycles = 0;
+        caches = 0;
+        for (int i = 0; i < kMaxIntervalCaches; i++)
+        {
+            accesses[i] = 0;
+            misses[i] = 0;
+        }
+    }
+    
+    size_t instructions;
+    cycle_t cycles;
+    char caches;
+    size_t accesses[kMaxIntervalCaches], misses[kMaxIntervalCaches];
+};
+
+// Runs the intervals profiling checkpointed through the detailed model,
+// jobs at a time, and puts their statistics back together.  Either the
+// simulation points simpoint.py picked are run and weighted, or every
+// checkpoint is and they all count for what they ran.
+//
+// Each interval runs in a child process of its own, so that the machine's
+// output can go to a log of its own.  A pool of threads hands out the
+// intervals and waits on the children.
+class IntervalDriver
+{
+public:
+    IntervalDriver(const char *config, const char *points, reg_t jobs);
+    ~IntervalDriver();
+    
+    bool init();
+    bool run();
+    void printStatistics();
+
+private:
+    typedef struct Interval
+    {
+        size_t number;
+        double weight, seconds;
+        bool failed;
+        IntervalResult result;
+    };
+    
+    bool readPoints();
+    bool findCheckpoints();
+    void checkpointPath(size_t interval, char *path, size_t len);
+    void runInterval(Interval &interval);
+    static void *work(void *driver);
+    
+    const char *_config, *_points;
+    char *_prefix;
+    reg_t _jobs;
+    bool _weighted;
+    
+    std::vector<Interval> _intervals;
+    size_t _next;
+    pthread_mutex_t _lock;
+    
+    // Accounting
+    double _wall;
+};
+
+#endif
@@ -38,8 +38,21 @@ public:
     LuaError openGlobalTable(const char *name);
     LuaError closeTable();
     
+    LuaError openTableAtTableKey(const char *name);
+    
+    // How many string keys the open table has.  The first 'max' of them
+    // are copied into 'keys', 'len' bytes apart.
+    size_t keysOfCurrentTable(char *keys, size_t len, size_t max);
+    
+    // Make the value at 'index' of the open table the global 'name', or
+    // write it out the way it would be written in Lua
+    LuaError setGlobalFromTableIndex(const char *name, int index);
+    LuaError describeTableIndex(int index, char *buf, size_t len);
+
 private:
     LuaError getTopField(LuaFields field, void *ret);
+    void describeTop(char *buf, size_t len, size_t &used);
+    void describeTable(char *buf, size_t len, size_t &used);
     void reportErrors();
     lua_State *L;
 };
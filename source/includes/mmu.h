@@ -20,10 +20,23 @@ enum SingleTransferOffsetMasks {
     kSTOShiftValMask    = 0x000003E0
 };
 
+// Prefetches that can be on their way at once
+#define kMaxPrefetches 8
+
+// A line a prefetch is bringing in, and when it will be there
+typedef struct PrefetchRecord
+{
+    reg_t line;
+    cycle_t ready;
+};
+
 struct CacheDescription;
 struct STFlags;
+struct AtomicFlags;
 
 class MemoryCache;
+class CoherenceBus;
+class DeviceBus;
 class VirtualMachine;
 
 class MMU
@@ -32,10 +45,27 @@ public:
     MMU(VirtualMachine *vm, reg_t size, cycle_t rtime, cycle_t wtime);
     ~MMU();
     
-    bool init(char caches, CacheDescription *desc);
+    // The cores of a machine after its first use the first one's memory,
+    // and its last level of cache too if it's shared
+    bool init(char caches, CacheDescription *desc, MMU *first = NULL,
+        bool shared_cache = false);
+    
+    // Memory can outlive the MMU, so a machine built again doesn't have to
+    // allocate it again.  reuse() is for before init(), and the memory has
+    // to be the size this MMU was made with.
+    char *giveUpMemory();
+    inline void reuse(char *memory)
+    {
+        _memory = memory;
+    }
+    
+    // The first level cache is kept coherent with other cores' on 'bus'
+    bool cohere(CoherenceBus *bus, reg_t core);
     
     reg_t loadProgramImageFile(const char *path, reg_t to, bool writeBreak);
     bool writeOut(const char *path);
+    bool saveImage(FILE *f);
+    bool restoreImage(FILE *f, reg_t size);
     
     inline const char *readOnlyMemory(reg_t &size)
     {
@@ -43,6 +73,14 @@ public:
         return (_memory);
     }
     
+    // Where the host keeps [addr, addr + len), or NULL if that's outside
+    // memory.  The caches only model timing, so this is always current.
+    inline char *hostMemory(reg_t addr, reg_t len)
+    {
+        if (addr > _memory_size || len > _memory_size - addr) return (NULL);
+        return (_memory + addr);
+    }
+    
     inline reg_t readOut()
     {
         return (_read_out);
@@ -63,30 +101,90 @@ public:
         return (_write_time);
     }
     
+    inline char caches()
+    {
+        return (_caches);
+    }
+    
+    // Where devices attach, above the end of memory
+    inline DeviceBus *bus()
+    {
+        return (_bus);
+    }
+    
+    // Once something other than the processor uses memory, processor
+    // accesses that get past the caches have to wait their turn for it
+    inline void shareMemory()
+    {
+        _contended = true;
+    }
+    
+    inline cycle_t contentionCycles()
+    {
+        return (_contention);
+    }
+    
+    // Takes memory for 'duration' cycles as soon as it's free, and returns
+    // the cycle that starts at
+    cycle_t claimMemory(cycle_t duration);
+    
+    void cacheStatistics(char level, size_t &accesses, size_t &misses);
+    
     // Operational: must return the timing
     cycle_t singleTransfer(const STFlags &f, reg_t addr);
+    cycle_t atomic(const AtomicFlags &f, reg_t addr, reg_t expected,
+        reg_t value);
+    cycle_t cacheControl(const AtomicFlags &f, reg_t addr, reg_t value);
     cycle_t writeWord(reg_t addr, reg_t valueToSave);
     cycle_t writeByte(reg_t addr, char valueToSave);
     cycle_t writeBlock(reg_t addr, reg_t *data, reg_t size);
     cycle_t readWord(reg_t addr, reg_t &valueToRet);
     cycle_t readByte(reg_t addr, char &valueToRet);
     cycle_t readRange(reg_t start, reg_t end, bool hex, char **ret);
+    
+    // What it costs to move [addr, addr + len) when something else already
+    // did, a line at a time the way a burst would
+    cycle_t touchBlock(reg_t addr, reg_t len, bool write);
 
 private:
-    cycle_t cache(reg_t addr, bool write = false, bool word = true);
+    cycle_t cache(reg_t addr, bool write = false, bool word = true,
+        bool own = false);
+    cycle_t cacheAccess(reg_t addr, bool write, bool word, bool own);
+    cycle_t contend(cycle_t timing, size_t misses);
+    cycle_t prefetched(reg_t addr);
+    cycle_t prefetch(reg_t addr, char level);
+    cycle_t maintain(reg_t addr, bool clean, bool drop);
     void abort(const reg_t &location);
     
     reg_t _read_out;
     
     VirtualMachine *_vm;
-    char _caches;
+    char _caches, _private;
     MemoryCache *_cache;
+    DeviceBus *_bus;
     reg_t _memory_size;
     cycle_t _read_time, _write_time;
     char *_memory;
     
     // Cache accounting
     cycle_t _evictions, _misses;
+    
+    // Other cores
+    MMU *_first;
+    CoherenceBus *_coherence;
+    reg_t _core;
+    
+    // What LDL reserved, for when there's no cache to keep it
+    bool _linked;
+    reg_t _link;
+    
+    // Prefetches on their way, the oldest replaced first
+    PrefetchRecord _prefetch[kMaxPrefetches];
+    reg_t _prefetch_next, _prefetches;
+    
+    // Sharing memory
+    bool _contended;
+    cycle_t _memory_busy, _contention;
 };
 
 #endif
@@ -0,0 +1,89 @@
+#ifndef _MULTICORE_H_
+#define _MULTICORE_H_
+
+#include <pthread.h>
+
+#include "global.h"
+#include "coherence.h"
+
+#define kMaxCores 64
+#define kMaxQuanta 16
+
+// Forward class definitions
+class VirtualMachine;
+
+// What running the machine at one quantum took, and what it simulated
+typedef struct QuantumResult
+{
+    cycle_t quantum;
+    double seconds;
+    cycle_t cycles;
+    size_t instructions, transactions;
+};
+
+// A machine with several cores.  Each is a machine of its own, with its
+// registers, pipeline and caches, and they all run the config's program
+// out of the first core's memory, each with a stack of its own and its
+// number in r0.  Their first level caches are kept coherent, and the last
+// level can be shared.
+//
+// With a quantum of 0 the cores go one cycle at a time on one thread,
+// whichever is furthest behind first, so the bus sees their accesses about
+// when they would happen.  Otherwise each core has a thread of its own and
+// runs a quantum of cycles at a time, and none starts the next until they
+// have all finished this one.  That's faster, but within a quantum the
+// cores' clocks can be that far apart.  A config can list several quanta
+// to compare what each costs and how far it is from the smallest.
+class MulticoreSystem
+{
+public:
+    MulticoreSystem(const char *config);
+    ~MulticoreSystem();
+    
+    // How many cores a config asks for, 1 if it can't be read
+    static reg_t coresIn(const char *config);
+    
+    bool init();
+    
+    // Runs at every quantum, starting the machine over for each
+    bool run();
+    void printStatistics();
+
+private:
+    typedef struct CoreThread
+    {
+        MulticoreSystem *system;
+        reg_t index;
+    };
+    
+    bool configure();
+    bool build();
+    void release();
+    void runLockstep();
+    bool runThreads();
+    bool sync(cycle_t &horizon);
+    static void *work(void *core);
+    void printRun(QuantumResult &r);
+    
+    const char *_config;
+    reg_t _cores;
+    bool _shared_cache;
+    CoherenceTiming _timing;
+    VirtualMachine **_core;
+    CoherenceBus *_bus;
+    
+    // Quanta to run at, in cycles
+    cycle_t _quanta[kMaxQuanta];
+    reg_t _quantum_count;
+    QuantumResult _results[kMaxQuanta];
+    
+    // Threads wait for each other here at the end of every quantum
+    pthread_mutex_t _lock;
+    pthread_cond_t _turn;
+    reg_t _threads, _waiting;
+    size_t _generation;
+    cycle_t _quantum, _horizon;
+    bool _done;
+};
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef _OOO_H_
+#define _OOO_H_
+
+#include <map>
+#include <set>
+#include <deque>
+
+#include "global.h"
+#include "pipeline.h"
+#include "virtualmachine.h"
+
+// Sizes of the out of order core's windows, as named in config.lua
+enum OOOParameters {
+    kOOOWidth, kOOODepth, kOOOROB, kOOOLSQ, kOOORename,
+    kOOOALUStations, kOOOFPUStations, kOOOMemoryStations,
+    kOOOParameterCount
+};
+
+static const char *OOOParameterNames[kOOOParameterCount] =
+{   "width", "depth", "rob", "lsq", "rename",
+    "alu_stations", "fpu_stations", "memory_stations"
+};
+
+static const reg_t OOOParameterDefaults[kOOOParameterCount] =
+{   4, 4, 64, 32, 64, 16, 8, 16 };
+
+// Why an instruction couldn't dispatch as soon as it was renamed
+enum DispatchStalls {
+    kDispatchFrontEnd,
+    kDispatchSerialize,
+    kDispatchROB,
+    kDispatchLSQ,
+    kDispatchRename,
+    kDispatchStations,
+    kDispatchStallCount
+};
+
+static const char *DispatchStallNames[kDispatchStallCount] =
+{   "front end", "serializing op", "ROB full", "LSQ full",
+    "no rename registers", "reservation stations full"
+};
+
+struct OOODescription {
+    OOODescription()
+    {
+        for (int i = 0; i < kOOOParameterCount; i++)
+            value[i] = OOOParameterDefaults[i];
+    }
+    
+    reg_t value[kOOOParameterCount];
+};
+
+// A timing model of an out of order core.  The in-order pipeline still
+// does all of the work; every instruction it retires is handed to commit()
+// in program order, and this works out when an out of order core with
+// register renaming, a reservation station per functional unit, a
+// load/store queue and a reorder buffer would have dispatched, issued,
+// completed and committed it.  Memory disambiguation is perfect, since the
+// addresses are already known.
+class OutOfOrderCore
+{
+public:
+    OutOfOrderCore(const OOODescription &desc, const IssueDescription &issue);
+    ~OutOfOrderCore();
+    
+    bool init();
+    void commit(PipelineData *d, bool mispredicted);
+    void printStatistics();
+    
+    inline cycle_t cycles()
+    {
+        return (_commit_cycle);
+    }
+
+private:
+    cycle_t frontEnd(PipelineData *d);
+    cycle_t dispatch(char unit, reg_t dests, bool memory, cycle_t t);
+    cycle_t issue(char unit, cycle_t t);
+    cycle_t retire(cycle_t t);
+    void stall(char reason, cycle_t &t, cycle_t until);
+    
+    reg_t _p[kOOOParameterCount];
+    reg_t _units[kIssueUnitCount];
+    
+    // Ready time of the newest value of each architectural register
+    cycle_t _ready[kVMRegisterMax];
+    
+    // Windows that free up in order keep the commit times of their last
+    // entries, the reservation stations keep issue times
+    cycle_t *_rob, *_lsq, *_rename;
+    size_t _rob_count, _lsq_count, _rename_count;
+    std::multiset<cycle_t> _stations[kIssueUnitCount];
+    std::map<cycle_t, reg_t> _busy[kIssueUnitCount];
+    
+    typedef struct StoreRecord
+    {
+        reg_t word;
+        cycle_t complete, commit;
+    };
+    
+    // The youngest store to each word, and every store in the order they
+    // commit, so the ones nothing can forward from anymore can be dropped
+    std::map<reg_t, StoreRecord> _stores;
+    std::deque<StoreRecord> _store_order;
+    
+    // Where each in order stage of the machine is
+    cycle_t _fetch_cycle, _dispatch_cycle, _commit_cycle, _redirect;
+    reg_t _fetched, _dispatched, _committed;
+    
+    // Accounting
+    size_t _instructions, _mispredictions, _forwarded_loads;
+    size_t _rob_max;
+    cycle_t _rob_occupancy;
+    cycle_t _stalls[kDispatchStallCount];
+};
+
+#endif
@@ -2,6 +2,8 @@
 #define _PIPELINE_H_
 
 #include "global.h"
+#include "virtualmachine.h"
+#include "alu.h"
 
 enum InstructionClasses {
     kDataProcessing,
@@ -9,7 +11,43 @@ enum InstructionClasses {
     kBranch,
     kReserved,
     kInterrupt,
-    kFloatingPoint
+    kFloatingPoint,
+    kSIMD,
+    kAtomic,
+    kCacheControl
+};
+
+// Why an instruction had to wait in decode
+enum StallCauses {
+    kStallRAW,
+    kStallLoadUse,
+    kStallPQ,
+    kStallFP,
+    kStallCauseCount
+};
+
+static const char *StallCauseNames[kStallCauseCount] =
+{   "RAW on ALU result", "load-use", "PQ after MUL", "FP" };
+
+// Functional units that the instructions in one issue group have to share
+enum IssueUnits {
+    kIssueALU,
+    kIssueFPU,
+    kIssueMemory,
+    kIssueUnitCount
+};
+
+static const char *IssueUnitNames[kIssueUnitCount] =
+{   "alu", "fpu", "memory" };
+
+enum IssueDefaults {
+    kMaxIssueWidth      = 4
+};
+
+typedef struct IssueDescription
+{
+    reg_t width;
+    reg_t units[kIssueUnitCount];
 };
 
 typedef struct DPFlags
@@ -17,6 +55,7 @@ typedef struct DPFlags
     unsigned int i:1, s:1, op:4, unused:2;
     char rs, rd;
     reg_t offset;
+    ALUKernel kernel;
 };
 
 typedef struct STFlags
@@ -32,6 +71,18 @@ typedef struct FPFlags
     reg_t value;
 };
 
+typedef struct SIMDFlags
+{
+    unsigned int op:4, h:1, unused:3;
+    char rs, rd, rm;
+};
+
+typedef struct AtomicFlags
+{
+    unsigned int op:4, unused:4;
+    char rs, rd, rm;
+};
+
 typedef struct BFlags
 {
     bool link;
@@ -52,6 +103,11 @@ typedef struct PipelineData
         instruction_class = kReserved;
         condition_code = 0xF; // Never
         executes = false;
+        predicted_pc = 0x0;
+        reads = 0x0;
+        writes = 0x0;
+        latency = 0;
+        memory_latency = 0;
     }
     
     // Metadata
@@ -67,12 +123,24 @@ typedef struct PipelineData
         DPFlags dp;
         BFlags b;
         FPFlags fp;
+        SIMDFlags p;
+        AtomicFlags a;
         IntFlags i;
     } flags;
     
     // Instructions save as many as two values
     bool record;
     reg_t output0, output1;
+    
+    // Branch prediction: where fetch went after this instruction and the
+    // predictor state it assumed when it did, down to the return address
+    // on top of the stack, which a wrong path can pop and push over
+    reg_t predicted_pc, history, ras_top, ras_entry;
+    
+    // What the timing models need to know: the registers decode found,
+    // the address a transfer went to, and how long each part of it took
+    reg_t reads, writes, address;
+    cycle_t fetch_latency, latency, memory_latency;
 };
 
 class VirtualMachine;
@@ -83,7 +151,8 @@ typedef void (VirtualMachine::*pipeFunc)(PipelineData *data);
 class InstructionPipeline
 {
 public:
-    InstructionPipeline(char stages, VirtualMachine *vm);
+    InstructionPipeline(char stages, const IssueDescription &issue,
+        VirtualMachine *vm);
     ~InstructionPipeline();
     
     // setup
@@ -92,9 +161,16 @@ public:
     
     // Pipe manipulation
     bool cycle();
-    bool lock(char reg);
+    void setIssueStage(char stage);
+    void drain(bool draining);
+    bool isEmpty();
     void unlock();
     bool waitOnRegister(char reg);
+    bool reserveRegister(char reg);
+    
+    // Bypass network
+    void produce(char reg, reg_t val);
+    bool forward(char reg, reg_t &val);
     bool isSquashed();
     void squash();
     void invalidate();
@@ -103,36 +179,92 @@ public:
     bool step();
     char *stateString();
     void printState();
+    void printStatistics();
     reg_t locationToExecute();
+    static char issueUnit(PipelineData *d);
     
-private:
+    inline size_t retired()
+    {
+        return (_retired);
+    }
     
+    // Squashes while fast forwarding aren't the pipe's, so aren't counted
+    inline void account(bool on)
+    {
+        _accounting = on;
+    }
+
+private:
+
     typedef struct PipelineFlags
     {
         inline void clear()
         {
-            squash = 0; bubble = 0; unused = 0;
-            lock = 0x0; wait = 0x0;
+            squash = 0; bubble = 0; load = 0; issued = 0; unused = 0;
+            wait = 0x0; writes = 0x0; ready = 0x0;
         }
         
-        char squash:1, bubble:1, unused:6;
-        reg_t lock, wait;
+        char squash:1, bubble:1, load:1, issued:1, unused:4;
+        
+        // Registers decode found this op reads and writes.  Once it issues,
+        // the writes are held on the scoreboard until it unlocks.
+        reg_t wait, writes;
+        
+        // Ready registers have been computed and can be forwarded from
+        // result, but haven't been written back yet.  The values travel
+        // with the flags so they stay with the instruction as it advances.
+        reg_t ready;
+        char result_reg[3];
+        reg_t result[3];
     };
     
-    char _stages, _stages_in_use;
+    // Scoreboard
+    void claim(int position);
+    char stallCause(int stage);
+    
+    // Wide (superscalar) pipe
+    bool cycleWide();
+    void fetchGroup();
+    void issueGroup();
+    void moveGroup(int stage);
+    void retireGroup(int stage);
+    void movePosition(int from, int to);
+    bool groupIsEmpty(int stage);
+    void startGroup();
+    void endSlot();
+    void endGroup();
+    
+    // Each stage of a wide pipe is a group of _width positions, laid out
+    // so that older instructions always have higher indices
+    inline int slot(int stage, int k)
+    {
+        return (stage * _width + (_width - 1 - k));
+    }
+    
+    char _stages, _stages_in_use, _positions, _issue_stage;
+    char _width, _units[kIssueUnitCount];
+    cycle_t _group_start, _group_cycles;
     
     // Data registers
     pipeFunc *_inst;
     PipelineData **_data;
     
-    // Control registers
-    reg_t _registers_in_use;
+    // Control registers.  The scoreboard counts, for every register, the
+    // issued ops that will write it and the ones of those that haven't
+    // computed it yet.  The masks mirror which counts are non-zero.
+    reg_t _in_flight[kVMRegisterMax], _pending[kVMRegisterMax];
+    reg_t _registers_in_use, _registers_pending;
     PipelineFlags *_flags;
     
     char _current_stage;
+    bool _draining;
     
     // Accounting
+    bool _accounting;
     size_t _bubbles, _invalidations, _instructions_invalidated;
+    size_t _stalls[kStallCauseCount];
+    size_t _retired, _group_dependencies;
+    size_t _issued[kMaxIssueWidth + 1], _structural[kIssueUnitCount];
     
     VirtualMachine *_vm;
 };
@@ -0,0 +1,112 @@
+#ifndef _PREDICTOR_H_
+#define _PREDICTOR_H_
+
+#include <map>
+
+#include "global.h"
+
+enum PredictorTypes {
+    kPredictNone, kPredictStatic, kPredictBimodal, kPredictGShare,
+    kPredictTournament, kPredictorTypeCount
+};
+
+static const char *PredictorNames[kPredictorTypeCount] =
+{   "none", "static", "bimodal", "gshare", "tournament" };
+
+// What kind of control transfer an instruction turned out to be
+enum BranchKinds {
+    kNotBranch, kBranchDirect, kBranchCall, kBranchReturn, kBranchIndirect
+};
+
+enum PredictorDefaults {
+    kDefaultPredictorBits   = 10,
+    kMaxPredictorBits       = 20,
+    kDefaultBTBEntries      = 64,
+    kDefaultRASDepth        = 8
+};
+
+// Two bit saturating counters
+enum CounterStates {
+    kStronglyNotTaken, kWeaklyNotTaken, kWeaklyTaken, kStronglyTaken
+};
+
+struct PipelineData;
+
+class BranchPredictor
+{
+public:
+    BranchPredictor(char type, reg_t bits, reg_t btb_entries, reg_t ras_depth);
+    ~BranchPredictor();
+    
+    bool init();
+    
+    // Called by fetch: returns the address to fetch next and records in the
+    // datum what was assumed so that resolve() can check it later
+    reg_t predict(PipelineData *d);
+    
+    // Called once the real successor of d is known.  Returns true if fetch
+    // went the wrong way and everything younger has to be squashed.
+    bool resolve(PipelineData *d, reg_t target, char kind);
+    
+    void printStatistics();
+    
+    // Fast forwarding still trains the predictor, but isn't counted
+    inline void account(bool on)
+    {
+        _accounting = on;
+    }
+    
+    inline char type()
+    {
+        return (_type);
+    }
+
+private:
+    typedef struct BTBEntry
+    {
+        reg_t tag;
+        reg_t target;
+        char kind;
+        bool valid;
+    };
+    
+    typedef struct BranchRecord
+    {
+        size_t executed, taken, mispredicted;
+    };
+    
+    bool direction(reg_t pc, reg_t target, reg_t history);
+    void train(reg_t pc, reg_t history, bool taken);
+    BTBEntry *lookup(reg_t pc);
+    void push(reg_t addr);
+    reg_t pop();
+    void repair(PipelineData *d);
+    
+    static inline void count(char &c, bool up)
+    {
+        if (up && c < kStronglyTaken) c++;
+        if (!up && c > kStronglyNotTaken) c--;
+    }
+    
+    char _type;
+    reg_t _bits, _mask;
+    
+    // Direction state
+    char *_bimodal, *_gshare, *_chooser;
+    reg_t _history;
+    
+    // Target state
+    reg_t _btb_entries;
+    BTBEntry *_btb;
+    
+    // The return stack holds what BL leaves in r15, the call's own address
+    reg_t _ras_depth, _ras_top;
+    reg_t *_ras;
+    
+    // Accounting
+    bool _accounting;
+    size_t _branches, _mispredictions, _btb_hits;
+    std::map<reg_t, BranchRecord> _records;
+};
+
+#endif
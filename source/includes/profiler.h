@@ -0,0 +1,62 @@
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#include <map>
+#include <set>
+
+#include "global.h"
+
+#define kDefaultProfileInterval 100000
+
+struct PipelineData;
+
+// Basic block vector profiling.  Every interval instructions, this writes
+// out how many of them each basic block executed, as one line of
+//
+//     T:<block>:<count> :<block>:<count> ...
+//
+// which is the format SimPoint reads.  Blocks are numbered from 1 in the
+// order they're first seen.  simpoint.py clusters the vectors and picks the
+// intervals worth simulating in detail; given those back, the profiler says
+// when each of them is about to start, so the machine can be checkpointed.
+// Checkpoints are taken warmup instructions early, so that whatever runs
+// from them can warm up the caches and predictor before the interval.
+class Profiler
+{
+public:
+    Profiler(reg_t interval, reg_t warmup, bool all, const char *bbv_path,
+        const char *points_path);
+    ~Profiler();
+    
+    bool init();
+    void retire(PipelineData *d);
+    bool checkpointDue(size_t &interval);
+    void finish();
+    void printStatistics();
+
+private:
+    void endBlock();
+    void endInterval();
+    void scheduleCheckpoint();
+    
+    reg_t _interval, _warmup;
+    const char *_bbv_path, *_points_path;
+    FILE *_bbv;
+    
+    // Where the current block started and how long it is so far
+    reg_t _block_start, _block_length, _interval_length;
+    
+    // Dense block ids, and the counts of the current interval by id
+    std::map<reg_t, reg_t> _blocks;
+    std::map<reg_t, size_t> _counts;
+    
+    // Intervals to checkpoint the start of, or all of them
+    std::set<size_t> _points;
+    bool _all, _checkpoint_due;
+    size_t _checkpoint_interval;
+    
+    // Accounting
+    size_t _intervals, _instructions;
+};
+
+#endif
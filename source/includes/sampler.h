@@ -0,0 +1,107 @@
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+
+#include "global.h"
+
+// How a sampled run is laid out, in instructions, as named in config.lua
+enum SampleParameters {
+    kSamplePeriod, kSampleWarmup, kSampleLength,
+    kSampleParameterCount
+};
+
+static const char *SampleParameterNames[kSampleParameterCount] =
+{   "period", "warmup", "length" };
+
+static const reg_t SampleParameterDefaults[kSampleParameterCount] =
+{   100000, 2000, 1000 };
+
+// What the machine is doing at any point of a sampled run
+enum SamplePhases {
+    kSampleFastForward,
+    kSampleWarming,
+    kSampleMeasuring,
+    kSampleDraining
+};
+
+struct SampleDescription {
+    SampleDescription()
+    {
+        for (int i = 0; i < kSampleParameterCount; i++)
+            value[i] = SampleParameterDefaults[i];
+    }
+    
+    reg_t value[kSampleParameterCount];
+};
+
+// Mean and confidence interval of something measured once per sample
+typedef struct SampleStatistic
+{
+    inline void clear()
+    {
+        sum = 0.0;
+        sum_squares = 0.0;
+        count = 0;
+    }
+    
+    inline void add(double x)
+    {
+        sum += x;
+        sum_squares += x * x;
+        count++;
+    }
+    
+    inline double mean()
+    {
+        return (count ? sum / count : 0.0);
+    }
+    
+    // Half width of the 95% confidence interval of the mean
+    double interval();
+    
+    double sum, sum_squares;
+    size_t count;
+};
+
+class MMU;
+
+// Systematic sampling (SMARTS).  Most of the program is fast forwarded
+// functionally, which keeps the caches and the branch predictor warm.  Every
+// period instructions, the detailed pipeline takes over for warmup
+// instructions to fill itself up again, and then measures the next length
+// instructions.  Once those are done the pipe drains, so that nothing in
+// flight is lost, and fast forwarding picks up where it stopped.
+class Sampler
+{
+public:
+    Sampler(const SampleDescription &desc, char caches);
+    ~Sampler();
+    
+    bool init();
+    void fastForward(size_t retired);
+    void cycle(size_t retired, cycle_t cycles, MMU *mmu);
+    void drained();
+    void printStatistics(size_t retired);
+    
+    inline char phase()
+    {
+        return (_phase);
+    }
+
+private:
+    void snapshot(MMU *mmu);
+    
+    reg_t _p[kSampleParameterCount];
+    char _phase, _caches;
+    
+    // Where the current phase started
+    size_t _fast_forwarded, _skipped, _retired_start;
+    cycle_t _cycle_start;
+    size_t *_accesses, *_misses;
+    
+    // Accounting
+    size_t _detailed;
+    SampleStatistic _cpi;
+    SampleStatistic *_miss_rate;
+};
+
+#endif
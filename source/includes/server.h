@@ -1,10 +1,12 @@
 #ifndef _SERVER_H_
 #define _SERVER_H_
 
+#include <pthread.h>
+
 #include "global.h"
 
-// port to listen on
-#define PORT "1337"
+// port to listen on unless the config says otherwise
+#define DEFAULT_PORT 1337
 
 // How many pending connections do we tell to wait before we
 // establish a TCP connection with them?
@@ -61,10 +63,12 @@ typedef struct MemoryRequest
 // Forward class definitions
 class VirtualMachine;
 
+// Each machine has its own, on a port of its own, so several machines can
+// be watched from one process
 class MonitorServer
 {
 public:
-    MonitorServer(VirtualMachine *vm);
+    MonitorServer(VirtualMachine *vm, reg_t port);
     ~MonitorServer();
     
     bool init();
@@ -72,9 +76,19 @@ public:
     
     bool isRunning();
     bool ready();
-    
+
 private:
+    static void *serve(void *ptr);
+    
     VirtualMachine *_vm;
+    char _port[8];
+    pthread_t _listener;
+    
+    // Only ever set by the listener thread, see serve()
+    volatile bool _ready;
+    
+    // Tells the listener to stop without stopping every other machine
+    volatile bool _stop;
 };
 
 #endif
@@ -0,0 +1,85 @@
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+#include "global.h"
+
+// Packed ops live in what used to be reserved opcode 1000:
+// cond | 1000 | op | rs | rd | rm | h | 0000
+// rs and rm are the sources and rd the destination, as for data processing.
+// The general registers are treated as four byte lanes, or as two halfword
+// lanes if h is set.
+enum SIMDInstructionMasks {
+    kSIMDOpCodeMask     = 0x00F00000,
+    kSIMDSourceMask     = 0x000F8000,
+    kSIMDDestMask       = 0x00007C00,
+    kSIMDOperandMask    = 0x000003E0,
+    kSIMDHalfwordMask   = 0x00000010
+};
+
+// Saturating ops clamp to the lane's range instead of wrapping, U means
+// the lanes are unsigned.  Compares fill a lane with ones where they hold.
+enum SIMDOpCodes {
+    kPADD, kPSUB, kPADDS, kPSUBS, kPADDUS, kPSUBUS, kPMIN, kPMAX,
+    kPMINU, kPMAXU, kPCMPEQ, kPCMPGT, kPCMPGTU, kPAVGU,
+    kSIMDOpcodeCount = 0x10
+};
+
+// Unassigned encodings don't have a name, and trap
+static const char *SIMDOpMnemonics[kSIMDOpcodeCount] =
+{   "PADD", "PSUB", "PADDS", "PSUBS", "PADDUS", "PSUBUS", "PMIN", "PMAX",
+    "PMINU", "PMAXU", "PCMPEQ", "PCMPGT", "PCMPGTU", "PAVGU", NULL, NULL
+};
+
+// Default timing for ANY packed op not specified in config file
+#define kDefaultSIMDTiming  0
+
+struct SIMDTimings {
+    SIMDTimings()
+    {
+        for (int i = 0; i < kSIMDOpcodeCount; i++)
+            op[i] = kDefaultSIMDTiming;
+    }
+    
+    inline void copy(SIMDTimings &src)
+    {
+        for (int i = 0; i < kSIMDOpcodeCount; i++)
+            op[i] = src.op[i];
+    }
+    
+    cycle_t op[kSIMDOpcodeCount];
+};
+
+struct SIMDFlags;
+
+// Forward class definitions
+class VirtualMachine;
+
+// Does the lanes of a packed op all at once, with the host's SSE2 unit if
+// it has one and a lane at a time otherwise.
+class SIMDUnit
+{
+public:
+    SIMDUnit(VirtualMachine *vm);
+    ~SIMDUnit();
+    
+    bool init(SIMDTimings &timings);
+    
+    // The op alone, on already read operands
+    static reg_t packed(char op, bool halfwords, reg_t n, reg_t m);
+    
+    inline reg_t output()
+    {
+        return (_output);
+    }
+    
+    // Operational: must return the timing
+    cycle_t execute(const SIMDFlags &flags);
+private:
+    static reg_t lanes(char op, bool halfwords, reg_t n, reg_t m);
+    
+    VirtualMachine *_vm;
+    SIMDTimings _timing;
+    reg_t _output;
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef _SWEEP_H_
+#define _SWEEP_H_
+
+#include "global.h"
+
+#define kMaxSweepDimensions     8
+#define kMaxSweepName           32
+#define kMaxSweepValue          128
+
+// Forward class definitions
+class LuaVM;
+
+// One combination of the values a config sweeps over.  index is where the
+// value is in the dimension's list, which starts at 1 as Lua's do.
+typedef struct SweepPoint
+{
+    reg_t dimensions;
+    char names[kMaxSweepDimensions][kMaxSweepName];
+    char values[kMaxSweepDimensions][kMaxSweepValue];
+    reg_t index[kMaxSweepDimensions];
+};
+
+// A config can have a sweep table whose keys name other settings, each
+// holding a list of values for it to take:
+//
+//  sweep = {
+//      stages = {1, 4, 5},
+//      caches = {{{64, 2, 8, 1}}, {{64, 2, 8, 1}, {256, 4, 8, 10}}},
+//  }
+//
+// Every combination is a point, and a machine initialized with one sees
+// those values in place of the config's own.  Dimensions are kept in the
+// order of their names, and the last one changes fastest.
+class Sweep
+{
+public:
+    Sweep(const char *config);
+    ~Sweep();
+    
+    // Returns true if the config can't be read or the sweep is malformed.
+    // A config without one has no dimensions and a single point.
+    bool init();
+    
+    inline reg_t dimensions()
+    {
+        return (_dimensions);
+    }
+    
+    size_t points();
+    void point(size_t n, SweepPoint &p);
+    
+    // The config's program, or NULL
+    inline const char *program()
+    {
+        return (_program);
+    }
+    
+    // Replace the config's values with the point's, after it has run
+    static bool apply(LuaVM *lua, const SweepPoint &p);
+
+private:
+    const char *_config;
+    char *_program;
+    reg_t _dimensions;
+    char _names[kMaxSweepDimensions][kMaxSweepName];
+    reg_t _sizes[kMaxSweepDimensions];
+    
+    // Descriptions of every value, kMaxSweepValue apart
+    char *_values[kMaxSweepDimensions];
+};
+
+#endif
@@ -8,4 +8,8 @@ unsigned int _hex_to_int(const char *str);
 char *_int_to_binary(unsigned int val, char **start);
 unsigned int _nearest_power_of_two(unsigned int val);
 
+// Keeps the calling thread on one of the host's cores, so that threads
+// with consecutive indices are spread over them
+void _pin_thread(reg_t index);
+
 #endif
\ No newline at end of file
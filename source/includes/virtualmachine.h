@@ -4,6 +4,11 @@
 #include <pthread.h>
 
 #include "global.h"
+#include "intervals.h"
+#include "interrupt.h"
+#include "events.h"
+#include "devices.h"
+#include "sweep.h"
 
 #define kWriteCommand   "WRITE"
 #define kReadCommand    "READ"
@@ -16,6 +21,7 @@
 #define kDefaultBreakCount 5
 #define kMinimumMemorySize 1024
 #define kDefaultPipelineStages 5
+#define kMaxPipelineStages 24
 
 enum VMRegisterCounts {
     kGeneralRegisters = 16,
@@ -70,6 +76,20 @@ enum VMRegisterDefaults {
     kPSRDefault = 0x0000
 };
 
+// The parts of a pipeline, in the order an instruction goes through them.
+// Each can be split into several stages in config.lua.
+enum PipelineStageKinds {
+    kStageFetch,
+    kStageDecode,
+    kStageExecute,
+    kStageMemory,
+    kStageWriteBack,
+    kStageKindCount
+};
+
+static const char *PipelineStageNames[kStageKindCount] =
+{   "fetch", "decode", "execute", "memory", "writeback" };
+
 enum InstructionOpCodeMasks {
     kConditionCodeMask  = 0xF0000000,
     kOpCodeMask         = 0x0F000000,
@@ -78,6 +98,7 @@ enum InstructionOpCodeMasks {
     kBranchMask         = 0x04000000,
     kFloatingPointMask  = 0x01000000,
     kReservedSpaceMask  = 0x06000000,
+    kSIMDSpaceMask      = 0x01000000,
     kSWInterruptMask    = 0x00000000
 };
 
@@ -89,6 +110,11 @@ enum BranchMasks {
 // Forward class and struct definitions
 struct PipelineData;
 struct ALUTimings;
+struct FPUTimings;
+struct SIMDTimings;
+struct IssueDescription;
+struct OOODescription;
+struct SampleDescription;
 struct MachineStatus;
 struct MachineDescription;
 struct CacheDescription;
@@ -98,17 +124,41 @@ class InterruptController;
 class ALU;
 class MMU;
 class FPU;
+class SIMDUnit;
 class InstructionPipeline;
+class BranchPredictor;
+class OutOfOrderCore;
+class Sampler;
+class Profiler;
+class CoherenceBus;
 
 class VirtualMachine
 {
 public:
-    VirtualMachine();
+    VirtualMachine(bool interactive = true);
     ~VirtualMachine();
     
-    bool init(const char *config);
+    // Can be called again once a run is over, to reuse the machine.  The
+    // config is read again and every unit built over from it, but guest
+    // memory is kept and zeroed if it's still the same size.  The checkpoint
+    // and the program replace the config's when they're given, and so do
+    // the values of a point of its sweep.
+    bool init(const char *config, const char *checkpoint = NULL,
+        const char *program = NULL, const SweepPoint *point = NULL);
     void run();
     void step();
+    
+    // Makes this machine core 'core' of 'cores', before init().  Every core
+    // after the first uses its memory, and its last level of cache if
+    // that's shared, and their first levels are kept coherent on 'bus'.
+    void joinSystem(reg_t core, reg_t cores, VirtualMachine *first,
+        CoherenceBus *bus, bool shared_cache);
+    
+    // For whatever runs the machine instead of run(): one cycle, which
+    // returns true once the machine has halted, and what run() does after
+    bool cycle();
+    void finish();
+    bool benchmarkALU(reg_t ops);
     void installJumpTable(reg_t *data, reg_t size);
     void installIntFunctions(reg_t *data, reg_t size);
     bool loadProgramImage(const char *path, reg_t addr);
@@ -121,12 +171,16 @@ public:
     void readWord(reg_t addr, reg_t &val);
     void readRange(reg_t start, reg_t end, bool hex, char **ret);
     const char *readOnlyMemory(reg_t &size);
+    void measurement(IntervalResult &r);
     
     // Helper methods that might be nice for other things...
     inline reg_t selectRegister(const char val)
     {
         reg_t *temp = demuxRegID(val);
         if (!temp) return ((reg_t) -1);
+        
+        // Values still in flight come off the bypass network
+        if (_bypassing) return (forwardRegister(val, *temp));
         return (*temp);
     }
     
@@ -134,10 +188,25 @@ public:
     {
         _cycle_count += val;
         
-        // Set this up to break out of possible infinite loops
-        if (_cycle_trap)
-            if (_cycle_count > _cycle_trap)
-                trap("Cycle count unlikely to be this large.");
+        // Only the soonest event is worth looking at
+        if (_cycle_count >= _next_event) runEvents();
+    }
+    
+    inline cycle_t cycleCount()
+    {
+        return (_cycle_count);
+    }
+    
+    // What the pipe ran in detail took, leaving out fast forwarding
+    inline cycle_t detailedCycles()
+    {
+        return (_cycle_count - _skipped_cycles);
+    }
+    
+    inline void setCycleCount(cycle_t val)
+    {
+        _cycle_count = val;
+        if (_cycle_count >= _next_event) runEvents();
     }
     
     inline void setProgramCounter(reg_t val)
@@ -145,6 +214,26 @@ public:
         _pc = val;
     }
     
+    inline void setRegister(const char val, reg_t to)
+    {
+        reg_t *temp = demuxRegID(val);
+        if (temp) *temp = to;
+    }
+    
+    // For host handlers that work on guest memory directly
+    char *hostMemory(reg_t addr, reg_t len);
+    cycle_t touchMemory(reg_t addr, reg_t len, bool write);
+    
+    // Timed events, at an absolute cycle
+    reg_t scheduleEvent(cycle_t when, EventCallback callback, void *data);
+    bool cancelEvent(reg_t id);
+    
+    // Interrupt n of the table is taken once the machine is in user mode
+    // and between instructions.  The timer raises one 'delay' cycles from
+    // now, or never if that's 0.
+    void raiseInterrupt(reg_t n);
+    void setTimer(cycle_t delay, reg_t n);
+    
     // Execution control
     void addBreakpoint(reg_t addr);
     reg_t deleteBreakpoint(reg_t index);
@@ -155,19 +244,50 @@ public:
     reg_t _psr;
     bool supervisor, fex;
     
-    // The following should be READ/WRITE LOCKED by 'server_mutex'
+    // The following should be READ/WRITE LOCKED by 'server_mutex', which
+    // the machine's monitor server holds while it's listening
+    pthread_mutex_t server_mutex;
     char *operation, *response;
     size_t opsize, respsize;
     //////////////////////////////////////////////////////////////
 private:
     // Helper functions to keep code clean and relocatable
-    bool configure(const char *c_path, ALUTimings &at);
+    bool configure(const char *c_path, ALUTimings &at, FPUTimings &ft,
+        SIMDTimings &st, IssueDescription &issue, OOODescription &ooo_desc,
+        SampleDescription &sample_desc);
     void resetSegmentRegisters();
     void resetGeneralRegisters();
     void setMachineDefaults();
+    void release();
+    void runEvents();
+    void takeInterrupt(reg_t next);
+    static void cycleTrapEvent(VirtualMachine *vm, void *data);
+    static void timerEvent(VirtualMachine *vm, void *data);
+    void freeInterruptDescription();
     void relocateBreakpoints();
+    bool checkPipelineLayout(char *layout, reg_t stages);
     bool configurePipeline();
     reg_t *demuxRegID(const char id);
+    void printStatistics();
+    
+    // Branch resolution
+    char branchKind(PipelineData *d);
+    bool resolveBranch(PipelineData *d, reg_t target);
+    void commitRegister(char reg, reg_t val, reg_t &next);
+    
+    // Bypass network
+    reg_t forwardRegister(char reg, reg_t val);
+    void forwardResults(PipelineData *d);
+    
+    // Sampled simulation
+    void fastForward();
+    void sample();
+    
+    // Profiling and checkpoints
+    void retire(PipelineData *d, bool mispredicted);
+    bool saveCheckpoint(size_t interval);
+    bool restoreCheckpoint(const char *path);
+    void startMeasuring();
     
     // Six stage pipe (conditional evalution)
     void evaluateConditional(PipelineData *d);
@@ -178,12 +298,16 @@ private:
     // Four stage pipe (forwarding)
     void fetchInstruction(PipelineData *d);
     void decodeInstruction(PipelineData *d);
+    void decodeAtomic(PipelineData *d);
     void executeInstruction(PipelineData *d);
     void memoryAccess(PipelineData *d);
     
     // Single stage pipe
     void doInstruction(PipelineData *d);
     
+    // The extra cycles of a stage that is split in several
+    void delayInstruction(PipelineData *d);
+    
     // Server helper functions
     void waitForClientInput();
     cycle_t execute();
@@ -195,17 +319,46 @@ private:
     MMU *mmu;
     ALU *alu;
     FPU *fpu;
+    SIMDUnit *simd;
     InstructionPipeline *pipe;
     InterruptController *icu;
+    BranchPredictor *predictor;
+    OutOfOrderCore *ooo;
+    Sampler *sampler;
+    Profiler *profiler;
+    EventQueue *events;
+    UART *uart;
+    CycleCounter *counter;
+    BlockDevice *disk;
+    DMAEngine *dma;
     
     // Server
     MonitorServer *ms;
     
+    // The machine this is a core of
+    reg_t _core, _cores;
+    VirtualMachine *_first;
+    CoherenceBus *_coherence;
+    bool _shared_cache;
+    
     // VM state
     char *_program_file, *_dump_file;
+    char *_bbv_file, *_simpoints_file, *_checkpoint_prefix, *_checkpoint_file;
+    reg_t _bbv_interval, _interval_warmup, _instruction_limit;
+    bool _checkpoint_all, _interactive, _measuring, _fast_forwarding;
+    reg_t _monitor_port;
+    
+    // Only looked at by configure()
+    const SweepPoint *_sweep_point;
+    size_t _instructions, _warmup_instructions;
+    IntervalResult _measure_start;
     bool _print_branch_offset, _print_instruction;
     reg_t _length_trap;
-    cycle_t _cycle_trap;
+    cycle_t _cycle_trap, _next_event;
+    
+    // Interrupts from outside the program
+    bool _irq_pending;
+    reg_t _irq, _timer_irq, _timer_event;
     
     // execution control
     reg_t _breakpoint_count;
@@ -213,9 +366,27 @@ private:
     
     // Machine info
     char _pipe_stages, _caches;
-    bool _forwarding;
+    char _pipe_layout[kMaxPipelineStages];
+    bool _forwarding, _bypass_ex, _bypass_mem, _bypassing, _ooo_model;
+    bool _sampling;
+    PipelineData *_functional;
+    char _predictor_type;
+    reg_t _predictor_bits, _btb_entries, _ras_depth;
     reg_t _mem_size, _read_cycles, _write_cycles, _stack_size;
+    
+    // Memory the last build gave up, for the next one
+    char *_spare_memory;
+    reg_t _spare_size;
     CacheDescription *_cache_desc;
+    InterruptDescription *_int_desc;
+    reg_t _int_count;
+    char *_int_table_file;
+    cycle_t _int_costs[kHostInterruptCount];
+    reg_t _device_base[kDeviceKindCount];
+    cycle_t _device_latency[kDeviceKindCount];
+    char *_disk_image;
+    cycle_t _disk_seek;
+    reg_t _disk_bandwidth, _disk_interrupt, _dma_interrupt;
     
     // registers modifiable by client
     reg_t _r[kGeneralRegisters], _pq[kPQRegisters], _pc, _cs, _ds, _ss;
@@ -230,6 +401,10 @@ private:
     // state info
     cycle_t _cycle_count, _swint_cycles, _branch_cycles;
     
+    // The clock keeps running while fast forwarding, so that events and
+    // devices all see one timeline, but those cycles weren't measured
+    cycle_t _skipped_cycles;
+    
     // virtual machine configuration variables
     bool _debug_cache;
 };
@@ -237,10 +412,9 @@ private:
 // SIGINT flips this to tell everything to turn off
 // Must have it declared extern and at file scope so that we can
 // read it from anywhere, which is assumed safe because of it's type.
+// It is the only state shared by every machine in the process.
 extern "C" {
     extern volatile sig_atomic_t terminate;
 }
 
-extern pthread_mutex_t server_mutex;
-
 #endif
@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "includes/virtualmachine.h"
 #include "includes/interrupt.h"
 #include "includes/pipeline.h"
@@ -7,21 +9,45 @@
 #define kBREAK_INSTRUCTION      0xEF00000F
 #define kRETURN_INSTRUCTION     0xEF0000FF
 
-reg_t jump_table[] = {      0x0, sizeof(reg_t)          };
-reg_t functions[] = {       kBREAK_INSTRUCTION          ,
-                            kRETURN_INSTRUCTION
-                                                        };
+// Without a table in the config, int 0 is BREAK and int 1 does nothing.
+// Every controller copies these, so they are never written.
+static const reg_t jump_table[] = {    0x0, sizeof(reg_t)      };
+static const reg_t functions[] = {     kBREAK_INSTRUCTION      ,
+                                        kRETURN_INSTRUCTION
+                                                                };
 
 InterruptController::InterruptController(VirtualMachine *vm, cycle_t timing) :
     _vm(vm), _swint_cycles(timing)
-{}
+{
+    _table = NULL;
+    _functions = NULL;
+    _entries = 0;
+    _function_words = 0;
+    _handler_count = 0;
+}
 
 InterruptController::~InterruptController()
 {
+    if (_table) free(_table);
+    if (_functions) free(_functions);
     _vm = NULL;
 }
 
-bool InterruptController::init()
+bool InterruptController::registerHandler(const char *name,
+    InterruptHandler handler, cycle_t cost)
+{
+    if (!name || !handler || strlen(name) >= kMaxHandlerName) return (true);
+    if (_handler_count == kMaxHostHandlers) return (true);
+    
+    strcpy(_names[_handler_count], name);
+    _handlers[_handler_count] = handler;
+    _costs[_handler_count] = cost;
+    _handler_count++;
+    return (false);
+}
+
+bool InterruptController::init(InterruptDescription *desc, reg_t count,
+    const char *file, cycle_t *costs)
 {
     printf("Loading interrupt controller... ");
     
@@ -34,36 +60,204 @@ bool InterruptController::init()
     
     if (!_swint_cycles) _swint_cycles = kDefaultSWIntCycles;
     
-    _vm->installJumpTable(jump_table, sizeof(jump_table));
-    _vm->installIntFunctions(functions, sizeof(functions));
+    // The built in handlers come first, so that their numbers are fixed.
+    // They cost what the config says, or as much as entering a routine.
+    InterruptHandler builtin[kHostInterruptCount] =
+    {   hostBreak, hostWrite, hostRead, hostClock, hostTimer, hostMemmove,
+        hostMemmove, hostMemset, hostMemcmp, hostStrlen
+    };
+    for (int i = 0; i < kHostInterruptCount; i++)
+    {
+        cycle_t cost = costs && costs[i] ? costs[i] : _swint_cycles;
+        
+        // Anything registered before us moves up behind them
+        if (_handler_count < kMaxHostHandlers)
+        {
+            for (reg_t j = _handler_count; j > (reg_t)i; j--)
+            {
+                strcpy(_names[j], _names[j - 1]);
+                _handlers[j] = _handlers[j - 1];
+                _costs[j] = _costs[j - 1];
+            }
+            _handler_count++;
+        }
+        strcpy(_names[i], HostInterruptNames[i]);
+        _handlers[i] = builtin[i];
+        _costs[i] = cost;
+    }
+    
+    bool err;
+    if (file)
+        err = loadTable(file);
+    else if (desc && count)
+        err = buildTable(desc, count);
+    else
+    {
+        _entries = sizeof(jump_table) / sizeof(reg_t);
+        _function_words = sizeof(functions) / sizeof(reg_t);
+        _table = (reg_t *)malloc(sizeof(jump_table));
+        _functions = (reg_t *)malloc(sizeof(functions));
+        err = !_table || !_functions;
+        if (!err)
+        {
+            memcpy(_table, jump_table, sizeof(jump_table));
+            memcpy(_functions, functions, sizeof(functions));
+        }
+    }
+    
+    if (err) return (true);
+    
+    _vm->installJumpTable(_table, _entries * kRegSize);
+    _vm->installIntFunctions(_functions, _function_words * kRegSize);
     
     printf("Done.\n");
     return (false);
 }
 
-cycle_t InterruptController::swint(const IntFlags &flags)
+bool InterruptController::buildTable(InterruptDescription *desc, reg_t count)
 {
-    // There are two possible interpretations of the comments field
-    if (!_vm->supervisor)
+    _entries = count;
+    _function_words = 0;
+    for (reg_t i = 0; i < count; i++)
+        if (!desc[i].handler[0]) _function_words += desc[i].length;
+    
+    _table = (reg_t *)calloc(_entries, sizeof(reg_t));
+    _functions = (reg_t *)calloc(_function_words + 1, sizeof(reg_t));
+    if (!_table || !_functions)
     {
-        // If user-mode code called this then we treat the comment
-        // as an offset into the interrupt table.
-        
-        // Error check
-        if (flags.comment > sizeof(jump_table) -1)
+        printf("could not allocate the interrupt table.\n");
+        return (true);
+    }
+    
+    reg_t words = 0;
+    for (reg_t i = 0; i < count; i++)
+    {
+        if (!desc[i].handler[0])
         {
-            fprintf(stderr, "Instruction Unit TRAP: Invalid interrupt loc\n");
-            return (0);
+            // Guest code goes in after the routines before it
+            _table[i] = words * kRegSize;
+            memcpy(&_functions[words], desc[i].code,
+                desc[i].length * sizeof(reg_t));
+            words += desc[i].length;
+            continue;
         }
         
-        // Move the program counter to the start of the jump function
-        _vm->setProgramCounter(sizeof(jump_table) + jump_table[flags.comment]);
+        reg_t h = 0;
+        while (h < _handler_count && strcmp(_names[h], desc[i].handler))
+            h++;
         
-        // We're entering supervisor mode
-        _vm->supervisor = true;
-        return(_swint_cycles);
+        if (h == _handler_count)
+        {
+            printf("no host handler named '%s' (int %u).\n", desc[i].handler,
+                i);
+            return (true);
+        }
+        
+        _table[i] = kIntHostBit | h;
+    }
+    
+    return (false);
+}
+
+bool InterruptController::loadTable(const char *path)
+{
+    // A word with the number of entries, the entries, then the routines,
+    // all in the host's byte order
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        printf("could not open '%s'.\n", path);
+        return (true);
+    }
+    
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    
+    reg_t entries;
+    if (fread(&entries, sizeof(reg_t), 1, f) != 1 ||
+        (long)(entries + 1) * (long)sizeof(reg_t) > size)
+    {
+        printf("'%s' is not an interrupt table.\n", path);
+        fclose(f);
+        return (true);
+    }
+    
+    _entries = entries;
+    _function_words = size / sizeof(reg_t) - entries - 1;
+    _table = (reg_t *)calloc(_entries, sizeof(reg_t));
+    _functions = (reg_t *)calloc(_function_words + 1, sizeof(reg_t));
+    
+    bool err = !_table || !_functions ||
+        fread(_table, sizeof(reg_t), _entries, f) != _entries ||
+        fread(_functions, sizeof(reg_t), _function_words, f) !=
+            _function_words;
+    fclose(f);
+    
+    if (err)
+    {
+        printf("could not read '%s'.\n", path);
+        return (true);
+    }
+    
+    for (reg_t i = 0; i < _entries; i++)
+    {
+        if ((_table[i] & kIntHostBit) &&
+            (_table[i] & ~kIntHostBit) >= _handler_count)
+        {
+            printf("int %u names host handler %u, which doesn't exist.\n", i,
+                _table[i] & ~kIntHostBit);
+            return (true);
+        }
+    }
+    
+    return (false);
+}
+
+cycle_t InterruptController::callHost(reg_t handler, reg_t next)
+{
+    // The host does all of it, so carry on right after the int
+    cycle_t cycles = _costs[handler];
+    if (_handlers[handler](_vm, cycles))
+        fprintf(stderr, "Instruction Unit TRAP: %s failed\n",
+            _names[handler]);
+    
+    _vm->setProgramCounter(next);
+    return (cycles);
+}
+
+cycle_t InterruptController::raise(reg_t n, reg_t next)
+{
+    // Error check
+    if (n >= _entries)
+    {
+        fprintf(stderr, "Instruction Unit TRAP: Invalid interrupt loc\n");
+        _vm->setProgramCounter(next);
+        return (0);
     }
     
+    reg_t entry = _table[n];
+    if (entry & kIntHostBit) return (callHost(entry & ~kIntHostBit, next));
+    
+    // Move the program counter to the start of the jump function, and
+    // come back to 'next'
+    _vm->setRegister(kR15Code, next);
+    _vm->setProgramCounter(_entries * kRegSize + entry);
+    
+    // We're entering supervisor mode
+    _vm->supervisor = true;
+    return(_swint_cycles);
+}
+
+cycle_t InterruptController::swint(const IntFlags &flags, reg_t location)
+{
+    reg_t next = location + kRegSize;
+    
+    // There are two possible interpretations of the comments field.  If
+    // user-mode code called this then we treat the comment as an offset
+    // into the interrupt table.
+    if (!_vm->supervisor) return (raise(flags.comment, next));
+    
     // otherwise we're in supervisor mode and the vm is trying to talk to
     // the host machine's hardware.  We use the 'ret' value to simulate
     // the time it takes to do one of these hardware interrupts
@@ -71,14 +265,15 @@ cycle_t InterruptController::swint(const IntFlags &flags)
     
     switch (flags.comment)
     {
-        case 0xF:
+        case kIntBreak:
         // Treat this as BREAK, which should stop the FEX and allow the server
         // to query the state of the machine
         printf("Hardware Interrupt: BREAK\n");
         _vm->fex = false;
+        _vm->setProgramCounter(next);
         break;
         
-        case 0xFF:
+        case kIntReturn:
         // This is the return function, which sets PC to r15
         // and turns off supervisor mode
         _vm->setProgramCounter(_vm->selectRegister(kR15Code));
@@ -86,8 +281,140 @@ cycle_t InterruptController::swint(const IntFlags &flags)
         break;
         
         default:
+        // Routines can call the host handlers too, but not each other
+        if (flags.comment < _entries && (_table[flags.comment] & kIntHostBit))
+            return (callHost(_table[flags.comment] & ~kIntHostBit, next));
+        
+        fprintf(stderr, "Instruction Unit TRAP: Invalid supervisor interrupt"
+            " %#x\n", flags.comment);
+        _vm->setProgramCounter(next);
         break;
     }
     
     return (ret);
 }
+
+bool InterruptController::hostBreak(VirtualMachine *vm, cycle_t &)
+{
+    printf("Hardware Interrupt: BREAK\n");
+    vm->fex = false;
+    return (false);
+}
+
+bool InterruptController::hostWrite(VirtualMachine *vm, cycle_t &cycles)
+{
+    reg_t len = vm->selectRegister(kR1Code);
+    reg_t from = vm->selectRegister(kR0Code);
+    char *data = vm->hostMemory(from, len);
+    if (!data) return (true);
+    
+    size_t written = fwrite(data, 1, len, stdout);
+    fflush(stdout);
+    cycles += vm->touchMemory(from, written, false);
+    vm->setRegister(kR0Code, written);
+    return (false);
+}
+
+bool InterruptController::hostRead(VirtualMachine *vm, cycle_t &cycles)
+{
+    reg_t len = vm->selectRegister(kR1Code);
+    reg_t to = vm->selectRegister(kR0Code);
+    char *data = vm->hostMemory(to, len);
+    
+    // The name has to end before memory does
+    reg_t size;
+    reg_t at = vm->selectRegister(kR2Code);
+    char *name = vm->hostMemory(at, 1);
+    if (!data || !name) return (true);
+    vm->readOnlyMemory(size);
+    if (!memchr(name, '\0', size - at)) return (true);
+    
+    FILE *f = fopen(name, "rb");
+    if (!f || fseek(f, vm->selectRegister(kR3Code), SEEK_SET))
+    {
+        if (f) fclose(f);
+        vm->setRegister(kR0Code, (reg_t)-1);
+        return (false);
+    }
+    
+    reg_t got = fread(data, 1, len, f);
+    fclose(f);
+    
+    cycles += vm->touchMemory(to, got, true);
+    vm->setRegister(kR0Code, got);
+    return (false);
+}
+
+bool InterruptController::hostClock(VirtualMachine *vm, cycle_t &)
+{
+    unsigned long long now = vm->cycleCount();
+    vm->setRegister(kR0Code, (reg_t)now);
+    vm->setRegister(kR1Code, (reg_t)(now >> 32));
+    return (false);
+}
+
+bool InterruptController::hostTimer(VirtualMachine *vm, cycle_t &)
+{
+    vm->setTimer(vm->selectRegister(kR0Code), vm->selectRegister(kR1Code));
+    return (false);
+}
+
+bool InterruptController::hostMemmove(VirtualMachine *vm, cycle_t &cycles)
+{
+    // memcpy is this too, since overlapping is harmless here
+    reg_t to = vm->selectRegister(kR0Code);
+    reg_t from = vm->selectRegister(kR1Code);
+    reg_t len = vm->selectRegister(kR2Code);
+    char *dst = vm->hostMemory(to, len);
+    char *src = vm->hostMemory(from, len);
+    if (!dst || !src) return (true);
+    
+    memmove(dst, src, len);
+    cycles += vm->touchMemory(from, len, false);
+    cycles += vm->touchMemory(to, len, true);
+    return (false);
+}
+
+bool InterruptController::hostMemset(VirtualMachine *vm, cycle_t &cycles)
+{
+    reg_t to = vm->selectRegister(kR0Code);
+    reg_t len = vm->selectRegister(kR2Code);
+    char *dst = vm->hostMemory(to, len);
+    if (!dst) return (true);
+    
+    memset(dst, (int)(vm->selectRegister(kR1Code) & kByteMask), len);
+    cycles += vm->touchMemory(to, len, true);
+    return (false);
+}
+
+bool InterruptController::hostMemcmp(VirtualMachine *vm, cycle_t &cycles)
+{
+    reg_t a = vm->selectRegister(kR0Code);
+    reg_t b = vm->selectRegister(kR1Code);
+    reg_t len = vm->selectRegister(kR2Code);
+    char *n = vm->hostMemory(a, len);
+    char *m = vm->hostMemory(b, len);
+    if (!n || !m) return (true);
+    
+    vm->setRegister(kR0Code, (reg_t)memcmp(n, m, len));
+    cycles += vm->touchMemory(a, len, false);
+    cycles += vm->touchMemory(b, len, false);
+    return (false);
+}
+
+bool InterruptController::hostStrlen(VirtualMachine *vm, cycle_t &cycles)
+{
+    reg_t size;
+    reg_t at = vm->selectRegister(kR0Code);
+    char *str = vm->hostMemory(at, 1);
+    if (!str) return (true);
+    
+    vm->readOnlyMemory(size);
+    char *end = (char *)memchr(str, '\0', size - at);
+    if (!end) return (true);
+    
+    reg_t len = end - str;
+    cycles += vm->touchMemory(at, len + 1, false);
+    vm->setRegister(kR0Code, len);
+    return (false);
+}
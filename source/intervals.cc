@@ -0,0 +1,334 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "includes/intervals.h"
+#include "includes/virtualmachine.h"
+#include "includes/luavm.h"
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec + tv.tv_usec / 1000000.0);
+}
+
+IntervalDriver::IntervalDriver(const char *config, const char *points,
+    reg_t jobs) : _config(config), _points(points), _jobs(jobs)
+{
+    _prefix = NULL;
+    pthread_mutex_init(&_lock, NULL);
+}
+
+IntervalDriver::~IntervalDriver()
+{
+    if (_prefix) free(_prefix);
+    pthread_mutex_destroy(&_lock);
+}
+
+bool IntervalDriver::init()
+{
+    printf("Initializing interval driver... ");
+    
+    // Checkpoints are wherever profiling put them
+    LuaVM *lua = new LuaVM();
+    lua->init();
+    if (lua->exec(_config, 0))
+    {
+        printf("could not read '%s'.\n", _config);
+        delete lua;
+        return (true);
+    }
+    
+    const char *prefix = NULL;
+    lua->getGlobalField("program", kLString, &prefix);
+    lua->getGlobalField("checkpoint_prefix", kLString, &prefix);
+    if (!prefix)
+    {
+        printf("no checkpoint prefix.\n");
+        delete lua;
+        return (true);
+    }
+    
+    _prefix = (char *)malloc(sizeof(char) * strlen(prefix) + 1);
+    strcpy(_prefix, prefix);
+    delete lua;
+    
+    if (!_jobs) _jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (!_jobs) _jobs = 1;
+    
+    _weighted = strcmp(_points, "all");
+    if (_weighted ? readPoints() : findCheckpoints())
+        return (true);
+    
+    if (!_intervals.size())
+    {
+        printf("no intervals to run.\n");
+        return (true);
+    }
+    
+    printf("(%lu intervals, %u jobs) Done.\n", _intervals.size(), _jobs);
+    return (false);
+}
+
+bool IntervalDriver::readPoints()
+{
+    // simpoint.py writes <prefix>.simpoints and <prefix>.weights, both with
+    // a cluster on every line
+    FILE *points = fopen(_points, "r");
+    if (!points)
+    {
+        printf("could not open '%s'.\n", _points);
+        return (true);
+    }
+    
+    std::vector<size_t> clusters;
+    unsigned long number, cluster;
+    while (fscanf(points, "%lu %lu", &number, &cluster) == 2)
+    {
+        Interval interval;
+        interval.number = number;
+        interval.weight = 0.0;
+        interval.seconds = 0.0;
+        interval.failed = false;
+        interval.result.clear();
+        _intervals.push_back(interval);
+        clusters.push_back(cluster);
+    }
+    fclose(points);
+    
+    char path[1024];
+    strncpy(path, _points, sizeof(path) - 16);
+    path[sizeof(path) - 16] = '\0';
+    char *ext = strrchr(path, '.');
+    if (ext && !strcmp(ext, ".simpoints")) *ext = '\0';
+    strcat(path, ".weights");
+    
+    FILE *weights = fopen(path, "r");
+    if (!weights)
+    {
+        printf("could not open '%s'.\n", path);
+        return (true);
+    }
+    
+    double weight;
+    while (fscanf(weights, "%lf %lu", &weight, &cluster) == 2)
+    {
+        for (size_t i = 0; i < clusters.size(); i++)
+            if (clusters[i] == cluster) _intervals[i].weight = weight;
+    }
+    fclose(weights);
+    
+    return (false);
+}
+
+bool IntervalDriver::findCheckpoints()
+{
+    // Every interval was checkpointed, so run until they stop
+    char path[1024];
+    for (size_t i = 0; ; i++)
+    {
+        checkpointPath(i, path, sizeof(path));
+        if (access(path, R_OK)) break;
+        
+        Interval interval;
+        interval.number = i;
+        interval.weight = 0.0;
+        interval.seconds = 0.0;
+        interval.failed = false;
+        interval.result.clear();
+        _intervals.push_back(interval);
+    }
+    
+    return (false);
+}
+
+void IntervalDriver::checkpointPath(size_t interval, char *path, size_t len)
+{
+    snprintf(path, len, "%s.%lu.ckpt", _prefix, interval);
+}
+
+bool IntervalDriver::run()
+{
+    printf("Running %lu intervals on %u threads...\n", _intervals.size(),
+        _jobs);
+    
+    double start = now();
+    _next = 0;
+    
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * _jobs);
+    if (!threads)
+    {
+        fprintf(stderr, "Could not allocate interval threads.\n");
+        return (true);
+    }
+    
+    reg_t started = 0;
+    for (; started < _jobs; started++)
+        if (pthread_create(&threads[started], NULL, work, (void *)this)) break;
+    
+    if (!started)
+    {
+        fprintf(stderr, "Could not start interval threads.\n");
+        free(threads);
+        return (true);
+    }
+    
+    for (reg_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    
+    _wall = now() - start;
+    return (false);
+}
+
+void *IntervalDriver::work(void *driver)
+{
+    IntervalDriver *d = (IntervalDriver *)driver;
+    
+    while (true)
+    {
+        pthread_mutex_lock(&d->_lock);
+        size_t i = d->_next++;
+        pthread_mutex_unlock(&d->_lock);
+        
+        if (i >= d->_intervals.size() || terminate) break;
+        d->runInterval(d->_intervals[i]);
+    }
+    
+    return (NULL);
+}
+
+void IntervalDriver::runInterval(Interval &interval)
+{
+    char path[1024], log[1024];
+    checkpointPath(interval.number, path, sizeof(path));
+    snprintf(log, sizeof(log), "%s.%lu.log", _prefix, interval.number);
+    
+    double start = now();
+    interval.failed = true;
+    
+    int fd[2];
+    if (pipe(fd))
+    {
+        fprintf(stderr, "Could not open a pipe for interval %lu.\n",
+            interval.number);
+        return;
+    }
+    
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        fprintf(stderr, "Could not fork interval %lu.\n", interval.number);
+        close(fd[0]);
+        close(fd[1]);
+        return;
+    }
+    
+    if (!pid)
+    {
+        // The machine's chatter goes to a log of its own
+        close(fd[0]);
+        if (!freopen(log, "w", stdout)) _exit(1);
+        
+        IntervalResult r;
+        VirtualMachine *vm = new VirtualMachine(false);
+        if (vm->init(_config, path))
+        {
+            fflush(stdout);
+            _exit(1);
+        }
+        vm->run();
+        vm->measurement(r);
+        delete vm;
+        fflush(stdout);
+        
+        bool err = (write(fd[1], &r, sizeof(r)) != sizeof(r));
+        _exit(err ? 1 : 0);
+    }
+    
+    close(fd[1]);
+    bool got = (read(fd[0], &interval.result, sizeof(IntervalResult)) ==
+        sizeof(IntervalResult));
+    close(fd[0]);
+    
+    int status;
+    waitpid(pid, &status, 0);
+    
+    interval.failed = !got || !WIFEXITED(status) || WEXITSTATUS(status);
+    interval.seconds = now() - start;
+    
+    if (interval.failed)
+        fprintf(stderr, "Interval %lu failed, see '%s'.\n", interval.number,
+            log);
+}
+
+void IntervalDriver::printStatistics()
+{
+    size_t instructions = 0, failed = 0;
+    cycle_t cycles = 0;
+    double total = 0.0, seconds = 0.0;
+    
+    for (size_t i = 0; i < _intervals.size(); i++)
+    {
+        Interval &in = _intervals[i];
+        seconds += in.seconds;
+        if (in.failed || !in.result.instructions)
+        {
+            failed++;
+            continue;
+        }
+        
+        instructions += in.result.instructions;
+        cycles += in.result.cycles;
+        
+        // Without simulation points, each counts for what it ran
+        if (!_weighted) in.weight = in.result.instructions;
+        total += in.weight;
+    }
+    
+    printf("Intervals: %lu run, %lu failed, %lu instructions in %lu cycles\n",
+        _intervals.size() - failed, failed, instructions, cycles);
+    if (total <= 0.0) return;
+    
+    // Weighted means, over the intervals that made it
+    double cpi = 0.0;
+    double accesses[kMaxIntervalCaches], misses[kMaxIntervalCaches];
+    char caches = 0;
+    for (int l = 0; l < kMaxIntervalCaches; l++)
+    {
+        accesses[l] = 0.0;
+        misses[l] = 0.0;
+    }
+    
+    for (size_t i = 0; i < _intervals.size(); i++)
+    {
+        Interval &in = _intervals[i];
+        if (in.failed || !in.result.instructions) continue;
+        
+        double w = in.weight / total;
+        double c = (double)in.result.cycles / in.result.instructions;
+        cpi += w * c;
+        
+        printf("\tInterval %lu: weight %.3f, CPI %.3f\n", in.number, w, c);
+        
+        if (in.result.caches > caches) caches = in.result.caches;
+        for (int l = 0; l < in.result.caches; l++)
+        {
+            double scale = w / in.result.instructions;
+            accesses[l] += scale * in.result.accesses[l];
+            misses[l] += scale * in.result.misses[l];
+        }
+    }
+    
+    printf("\tEstimated CPI: %.3f (IPC %.3f)\n", cpi, cpi ? 1.0 / cpi : 0.0);
+    for (int l = 0; l < caches; l++)
+    {
+        printf("\tLevel-%i miss rate: %.2f%%\n", l,
+            accesses[l] ? 100.0 * misses[l] / accesses[l] : 0.0);
+    }
+    
+    printf("\tHost time: %.2fs, %.2fs of simulation (%.1fx on %u threads)\n",
+        _wall, seconds, _wall ? seconds / _wall : 0.0, _jobs);
+}
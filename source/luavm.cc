@@ -1,3 +1,6 @@
+#include <stdarg.h>
+#include <string.h>
+
 #include "includes/luavm.h"
 
 extern "C" {
@@ -6,6 +9,22 @@ extern "C" {
     #include "includes/lua/lauxlib.h"
 }
 
+// Descriptions that don't fit are cut off
+static void append(char *buf, size_t len, size_t &used, const char *format,
+    ...)
+{
+    if (used + 1 >= len) return;
+    
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + used, len - used, format, args);
+    va_end(args);
+    
+    if (n < 0) return;
+    used += n;
+    if (used >= len) used = len - 1;
+}
+
 LuaVM::LuaVM()
 {}
 
@@ -191,6 +210,20 @@ LuaError LuaVM::openTableAtTableIndex(int index)
     return (kLuaNoError);
 }
 
+LuaError LuaVM::openTableAtTableKey(const char *name)
+{
+    if (!name) return (kLuaInvalidName);
+    
+    if (!lua_istable(L, -1))
+        return (kLuaTableNotOpen);
+    
+    lua_getfield(L, -1, name);
+    if (!lua_istable(L, -1))
+        return (kLuaUnexpectedType);
+    
+    return (kLuaNoError);
+}
+
 LuaError LuaVM::openGlobalTable(const char *name)
 {
     if (!name) return (kLuaInvalidName);
@@ -216,3 +249,124 @@ size_t LuaVM::lengthOfCurrentObject()
 {
     return (lua_objlen(L, -1));
 }
+
+size_t LuaVM::keysOfCurrentTable(char *keys, size_t len, size_t max)
+{
+    if (!len || !lua_istable(L, -1)) return (0);
+    
+    // lua_next leaves each key and its value on the stack
+    size_t count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, -2))
+    {
+        if (lua_type(L, -2) == LUA_TSTRING)
+        {
+            if (count < max)
+            {
+                strncpy(&keys[count * len], lua_tostring(L, -2), len - 1);
+                keys[count * len + len - 1] = '\0';
+            }
+            count++;
+        }
+        
+        lua_pop(L, 1);
+    }
+    
+    return (count);
+}
+
+LuaError LuaVM::setGlobalFromTableIndex(const char *name, int index)
+{
+    if (!name) return (kLuaInvalidName);
+    
+    if (!lua_istable(L, -1))
+        return (kLuaTableNotOpen);
+    
+    lua_pushinteger(L, index);
+    lua_gettable(L, -2);
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        return (kLuaUnexpectedType);
+    }
+    
+    // This pops the value
+    lua_setfield(L, LUA_GLOBALSINDEX, name);
+    return (kLuaNoError);
+}
+
+LuaError LuaVM::describeTableIndex(int index, char *buf, size_t len)
+{
+    if (!buf || !len) return (kLuaInvalidName);
+    
+    if (!lua_istable(L, -1))
+        return (kLuaTableNotOpen);
+    
+    lua_pushinteger(L, index);
+    lua_gettable(L, -2);
+    
+    size_t used = 0;
+    buf[0] = '\0';
+    describeTop(buf, len, used);
+    
+    lua_pop(L, 1);
+    return (kLuaNoError);
+}
+
+void LuaVM::describeTop(char *buf, size_t len, size_t &used)
+{
+    switch (lua_type(L, -1))
+    {
+        case LUA_TNUMBER:
+        append(buf, len, used, "%g", lua_tonumber(L, -1));
+        break;
+        
+        case LUA_TBOOLEAN:
+        append(buf, len, used, lua_toboolean(L, -1) ? "true" : "false");
+        break;
+        
+        case LUA_TSTRING:
+        append(buf, len, used, "\"%s\"", lua_tostring(L, -1));
+        break;
+        
+        case LUA_TTABLE:
+        describeTable(buf, len, used);
+        break;
+        
+        default:
+        append(buf, len, used, "%s", lua_typename(L, lua_type(L, -1)));
+        break;
+    }
+}
+
+void LuaVM::describeTable(char *buf, size_t len, size_t &used)
+{
+    // The list part in order, then whatever has a name
+    append(buf, len, used, "{");
+    
+    size_t n = lua_objlen(L, -1);
+    for (size_t i = 1; i <= n; i++)
+    {
+        lua_rawgeti(L, -1, i);
+        if (i > 1) append(buf, len, used, ", ");
+        describeTop(buf, len, used);
+        lua_pop(L, 1);
+    }
+    
+    bool first = !n;
+    lua_pushnil(L);
+    while (lua_next(L, -2))
+    {
+        if (lua_type(L, -2) == LUA_TSTRING)
+        {
+            append(buf, len, used, "%s%s=", first ? "" : ", ",
+                lua_tostring(L, -2));
+            describeTop(buf, len, used);
+            first = false;
+        }
+        
+        lua_pop(L, 1);
+    }
+    
+    append(buf, len, used, "}");
+}
@@ -4,6 +4,10 @@
 #include <unistd.h>
 
 #include "includes/virtualmachine.h"
+#include "includes/intervals.h"
+#include "includes/batch.h"
+#include "includes/sweep.h"
+#include "includes/multicore.h"
 
 // Probably won't be using SDL in the server, but if we are ...
 #ifdef USE_SDL
@@ -17,6 +21,8 @@
 #endif
 
 #define kDefaultConfigPath "config.lua"
+#define kDefaultSweepSummary "sweep.csv"
+#define kDefaultSweepLog "sweep.log"
 
 void sigint_handler(int sig)
 {
@@ -28,6 +34,10 @@ int main(int argc, char *argv[])
 {
     char c;
     char config_path[PATH_MAX] = kDefaultConfigPath;
+    char summary[PATH_MAX] = kDefaultSweepSummary;
+    char log[PATH_MAX] = kDefaultSweepLog;
+    char *points = NULL;
+    reg_t jobs = 0, bench = 0;
     
     // Register signal handler for SIGINT
     void sigint_handler(int sig);
@@ -45,7 +55,7 @@ int main(int argc, char *argv[])
     }
     
     // Handle command line options
-    while ((c = getopt(argc, argv, "vc:h")) != -1)
+    while ((c = getopt(argc, argv, "vc:i:j:b:o:l:h")) != -1)
     {
         switch (c)
         {
@@ -57,10 +67,40 @@ int main(int argc, char *argv[])
             strcpy(config_path, optarg);
             break;
             
+            case 'i':
+            points = optarg;
+            break;
+            
+            case 'j':
+            jobs = atoi(optarg);
+            break;
+            
+            case 'b':
+            bench = atoi(optarg);
+            break;
+            
+            case 'o':
+            strcpy(summary, optarg);
+            break;
+            
+            case 'l':
+            strcpy(log, optarg);
+            break;
+            
             case 'h':
             printf("YAAA VM Help:\n");
             printf("v\t\t\tPrint version string.\n");
             printf("c <path>\t\tPath to the lua configuration file.\n");
+            printf("i <path>\t\tSimulate the checkpointed intervals in ");
+            printf("<path>.simpoints, or all of them.\n");
+            printf("j <jobs>\t\tIntervals or sweep points to simulate at ");
+            printf("once.\n");
+            printf("b <ops>\t\t\tBenchmark the ALU kernels on <ops> ");
+            printf("random ops.\n");
+            printf("o <path>\t\tSummary of a sweep, JSON if it ends in ");
+            printf(".json and CSV otherwise.\n");
+            printf("l <path>\t\tWhere the machines of a sweep write their ");
+            printf("output.\n");
             exit(0);
             
             default:
@@ -68,6 +108,62 @@ int main(int argc, char *argv[])
         }
     }
     
+    // Intervals are simulated from checkpoints, many machines at a time
+    if (points)
+    {
+        IntervalDriver *driver = new IntervalDriver(config_path, points, jobs);
+        if (driver->init() || driver->run())
+        {
+            fprintf(stderr, "Interval simulation failed, aborting.\n");
+            exit(1);
+        }
+        
+        driver->printStatistics();
+        delete driver;
+        return (0);
+    }
+    
+    // A config with a sweep runs every point of it, many machines at a time
+    Sweep *sweep = new Sweep(config_path);
+    bool swept = !sweep->init() && sweep->dimensions();
+    delete sweep;
+    
+    if (swept)
+    {
+        BatchDriver *driver = new BatchDriver(summary, jobs);
+        if (driver->addJob(NULL, config_path) || driver->init() ||
+            driver->run(log) || driver->writeSummary())
+        {
+            fprintf(stderr, "Sweep failed, aborting.\n");
+            exit(1);
+        }
+        
+        driver->printStatistics();
+        delete driver;
+        return (0);
+    }
+    
+    // A machine with several cores runs them all together
+    if (MulticoreSystem::coresIn(config_path) > 1)
+    {
+        MulticoreSystem *system = new MulticoreSystem(config_path);
+        if (system->init())
+        {
+            fprintf(stderr, "Multicore init failed, aborting.\n");
+            exit(1);
+        }
+        
+        if (system->run())
+        {
+            fprintf(stderr, "Multicore run failed, aborting.\n");
+            exit(1);
+        }
+        
+        system->printStatistics();
+        delete system;
+        return (0);
+    }
+    
     // Now that we've intialized our environment, start the machine
     VirtualMachine *vm = new VirtualMachine() ;
     
@@ -79,6 +175,14 @@ int main(int argc, char *argv[])
         exit(1);
     }
     
+    // Only measure the ALU, if that's all that was asked for
+    if (bench)
+    {
+        bool err = vm->benchmarkALU(bench);
+        delete vm;
+        return (err ? 1 : 0);
+    }
+    
     // Run the VM
     vm->run();
     
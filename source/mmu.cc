@@ -6,7 +6,10 @@
 #include "includes/alu.h"
 #include "includes/util.h"
 #include "includes/pipeline.h"
+#include "includes/atomic.h"
 #include "includes/cache.h"
+#include "includes/coherence.h"
+#include "includes/devices.h"
 
 #define BREAK_INTERRUPT     0xEF000000
 
@@ -14,60 +17,112 @@ MMU::MMU(VirtualMachine *vm, reg_t size, cycle_t rtime, cycle_t wtime) :
     _vm(vm), _memory_size(size), _read_time(rtime), _write_time(wtime)
 {
     _cache = NULL;
+    _bus = NULL;
+    _memory = NULL;
+    _first = NULL;
+    _coherence = NULL;
+    _core = 0;
+    _linked = false;
+    _link = 0;
+    _prefetch_next = 0;
+    _prefetches = 0;
+    _contended = false;
+    _memory_busy = 0;
+    _contention = 0;
 }
 
 MMU::~MMU()
 {
     printf("Destroying MMU... ");
-    if (_memory)
+    if (_memory && !_first)
         free(_memory);
     if (_cache)
         delete [] _cache;
+    delete _bus;
     printf("Done.\n");
 }
 
-bool MMU::init(char caches, CacheDescription *desc)
+bool MMU::init(char caches, CacheDescription *desc, MMU *first,
+    bool shared_cache)
 {
     // Make sure we have a vm
     if (!_vm) return (true);
     
     printf("Initializing MMU: %ub RAM\n", _memory_size);
     
-    // Allocate real memory from system and zero its contents
-    printf("Allocating and zeroing memory... ");
-    _memory = (char *)calloc(_memory_size, sizeof(char));
-    
-    // Test to make sure memory was allocated
-    if (!_memory)
+    if (first)
     {
-        printf("Error.\n");
-        return (true);
-    } else {
+        // Every core sees the same memory
+        printf("Sharing memory with the first core... ");
+        if (first->_memory_size != _memory_size)
+        {
+            printf("Error.\n");
+            return (true);
+        }
+        
+        _first = first;
+        _memory = first->_memory;
+        printf("Done.\n");
+    } else if (_memory) {
+        // Memory another MMU gave up has the last run in it
+        printf("Zeroing memory kept from the last run... ");
+        memset(_memory, 0, _memory_size);
         printf("Done.\n");
+    } else {
+        // Allocate real memory from system and zero its contents
+        printf("Allocating and zeroing memory... ");
+        _memory = (char *)calloc(_memory_size, sizeof(char));
+        
+        // Test to make sure memory was allocated
+        if (!_memory)
+        {
+            printf("Error.\n");
+            return (true);
+        } else {
+            printf("Done.\n");
+        }
     }
     
+    // Nothing is on the bus until the machine puts it there
+    _bus = new DeviceBus(_vm);
+    
     // End if no caches to allocate
     _caches = caches;
+    _private = caches;
     if (!_caches) return (false);
     
     // If we want caches, we need to have them described
     if (!desc) return (true);
     
-    printf("Initializing %u caches:\n", caches);
-    _cache = new MemoryCache[_caches];
+    // The first core has the last level, and the others go through to it
+    MemoryCache *shared = NULL;
+    if (first && shared_cache)
+    {
+        if (_caches < 2 || first->_caches != _caches)
+        {
+            fprintf(stderr, "Warning: Only a last level that isn't the first "
+                "can be shared.\n");
+        } else {
+            shared = &first->_cache[_caches - 1];
+            _private = _caches - 1;
+        }
+    }
+    
+    printf("Initializing %u caches:\n", _private);
+    _cache = new MemoryCache[_private];
     if (!_cache)
     {
         fprintf(stderr, "Could not allocate cache array.\n");
         return (true);
     }
     
-    for (int i = 0; i < _caches; i++ )
+    for (int i = 0; i < _private; i++ )
     {
         desc[i].level = i;
         
-        if (i == _caches - 1)
+        if (i == _private - 1)
         {
-            if (_cache[i].init(this, desc[i], NULL))
+            if (_cache[i].init(this, desc[i], shared))
                 return (true);
         } else {
             if (_cache[i].init(this, desc[i], &_cache[i+1]))
@@ -82,6 +137,9 @@ bool MMU::init(char caches, CacheDescription *desc)
         }
     }
     
+    if (shared) printf("Level-%u cache shared with the first core.\n",
+        _private);
+    
     // Initialize cache accounting
     _evictions = 0;
     _misses = 0;
@@ -89,6 +147,30 @@ bool MMU::init(char caches, CacheDescription *desc)
     return (false);
 }
 
+char *MMU::giveUpMemory()
+{
+    // Other cores' memory is the first one's to give up
+    if (_first) return (NULL);
+    
+    char *memory = _memory;
+    _memory = NULL;
+    return (memory);
+}
+
+bool MMU::cohere(CoherenceBus *bus, reg_t core)
+{
+    if (!_caches)
+    {
+        fprintf(stderr, "Cores need a cache of their own to keep coherent.\n");
+        return (true);
+    }
+    
+    _coherence = bus;
+    _core = core;
+    _coherence->attach(core, _vm, &_cache[0]);
+    return (false);
+}
+
 reg_t MMU::loadProgramImageFile(const char *path, reg_t to, bool writeBreak)
 {
     if (to >= _memory_size )
@@ -165,7 +247,116 @@ bool MMU::writeOut(const char *path)
     return (false);
 }
 
-cycle_t MMU::cache(reg_t addr, bool write, bool word)
+// Raw memory, for checkpoints
+bool MMU::saveImage(FILE *f)
+{
+    return (fwrite(_memory, 1, _memory_size, f) != _memory_size);
+}
+
+bool MMU::restoreImage(FILE *f, reg_t size)
+{
+    if (size != _memory_size)
+    {
+        fprintf(stderr, "Memory image is %u bytes, memory is %u.\n", size,
+            _memory_size);
+        return (true);
+    }
+    
+    return (fread(_memory, 1, _memory_size, f) != _memory_size);
+}
+
+void MMU::cacheStatistics(char level, size_t &accesses, size_t &misses)
+{
+    if (level >= _caches)
+    {
+        accesses = 0;
+        misses = 0;
+        return;
+    }
+    
+    // A shared level counts what every core did
+    if (level >= _private)
+    {
+        _first->cacheStatistics(level, accesses, misses);
+        return;
+    }
+    
+    accesses = _cache[level].accesses();
+    misses = _cache[level].misses();
+}
+
+cycle_t MMU::cache(reg_t addr, bool write, bool word, bool own)
+{
+    // A line that's still on its way holds up whatever wants it
+    cycle_t wait = _prefetches ? prefetched(addr) : 0;
+    if (!_contended) return (wait + cacheAccess(addr, write, word, own));
+    
+    // Whatever else is using memory gets its turn too
+    size_t misses = _caches ? _cache[0].misses() : 0;
+    cycle_t ret = cacheAccess(addr, write, word, own);
+    return (wait + ret + contend(ret, misses));
+}
+
+cycle_t MMU::prefetched(reg_t addr)
+{
+    cycle_t now = _vm->cycleCount();
+    reg_t line = addr & ~(_cache[0].lineBytes() - 1);
+    cycle_t wait = 0;
+    
+    // Forget the ones that have arrived as we go
+    for (reg_t i = 0; i < kMaxPrefetches; i++)
+    {
+        PrefetchRecord &p = _prefetch[i];
+        if (!p.ready) continue;
+        
+        if (p.ready <= now)
+        {
+            p.ready = 0;
+            _prefetches--;
+        } else if (p.line == line && p.ready - now > wait) {
+            wait = p.ready - now;
+        }
+    }
+    
+    return (wait);
+}
+
+cycle_t MMU::prefetch(reg_t addr, char level)
+{
+    // The line goes into that level and the ones above it, and the time
+    // that takes is the prefetch's, not the instruction's
+    if (level >= _caches) level = _caches - 1;
+    
+    // Asking again for a line that's on its way doesn't wait for it
+    if (_prefetches && prefetched(addr)) return (_cache[0].accessTime());
+    
+    cycle_t timing;
+    if (!level)
+        timing = cache(addr);
+    else if (level < _private)
+        timing = _cache[level].read(addr);
+    else
+        timing = _first->_cache[level].read(addr);
+    
+    PrefetchRecord &p = _prefetch[_prefetch_next++ % kMaxPrefetches];
+    if (!p.ready) _prefetches++;
+    p.line = addr & ~(_cache[0].lineBytes() - 1);
+    p.ready = _vm->cycleCount() + timing;
+    
+    // Issuing it is a first level lookup
+    return (_cache[0].accessTime());
+}
+
+cycle_t MMU::maintain(reg_t addr, bool clean, bool drop)
+{
+    // Other cores' first level caches see it on the bus first
+    cycle_t timing = 0;
+    if (_coherence) timing = _coherence->maintain(_core, addr, clean, drop);
+    
+    return (timing + _cache[0].maintain(addr, clean, drop));
+}
+
+cycle_t MMU::cacheAccess(reg_t addr, bool write, bool word, bool own)
 {
     if (!_caches)
     {
@@ -184,21 +375,69 @@ cycle_t MMU::cache(reg_t addr, bool write, bool word)
         value <<= start * 8;
     }
     
+    // Each word a coherent access touches is a request on the bus, before
+    // the cache has it and after.  A read that is going to be written asks
+    // for the line the way a write does.
+    if (_coherence)
+    {
+        _coherence->lock();
+        reg_t first = addr & ~kIgnoredBitsMask;
+        reg_t last = (addr & kIgnoredBitsMask) ? first + kRegSize : first;
+        for (reg_t at = first; at <= last; at += kRegSize)
+        {
+            ret += _coherence->request(_core, at, write || own);
+            resolved_address = at;
+            if (write)
+                ret += _cache[0].write(at, value);
+            else
+                ret += _cache[0].read(resolved_address);
+            _coherence->granted(_core, at);
+        }
+        
+        _coherence->unlock();
+        return (ret);
+    }
+    
     // Just look at level zero cache
     if (write) return (_cache[0].write(resolved_address, value));
     
     return (_cache[0].read(resolved_address));
 }
 
+cycle_t MMU::claimMemory(cycle_t duration)
+{
+    cycle_t start = _vm->cycleCount();
+    if (_memory_busy > start) start = _memory_busy;
+    
+    _memory_busy = start + duration;
+    return (start);
+}
+
+cycle_t MMU::contend(cycle_t timing, size_t misses)
+{
+    // Hits never leave the first level, so they don't wait for memory
+    if (_caches && _cache[0].misses() == misses) return (0);
+    
+    cycle_t wait = claimMemory(timing) - _vm->cycleCount();
+    _contention += wait;
+    return (wait);
+}
+
 cycle_t MMU::writeByte(reg_t addr, char valueToSave)
 {
     if (addr >= _memory_size)
         return (0);
     
-    _memory[addr] = valueToSave;
+    // Other cores lose their copies, and their reservations, before the
+    // store lands, so an STC can't go in after it and undo it
+    if (_coherence) _coherence->lock();
     
     // The amount of time this takes is simulated by our caches
-    return (cache(addr, true, false));
+    cycle_t timing = cache(addr, true, false);
+    _memory[addr] = valueToSave;
+    
+    if (_coherence) _coherence->unlock();
+    return (timing);
 }
 
 cycle_t MMU::writeWord(reg_t addr, reg_t valueToSave)
@@ -206,11 +445,16 @@ cycle_t MMU::writeWord(reg_t addr, reg_t valueToSave)
     if (addr >= _memory_size)
         return (0);
     
+    // Ownership first, as for bytes
+    if (_coherence) _coherence->lock();
+    
+    // The amount of time this takes is simulated by our caches
+    cycle_t timing = cache(addr, true);
     reg_t *temp = (reg_t *) &(_memory[addr]);
     *temp = valueToSave;
     
-    // The amount of time this takes is simulated by our caches
-    return (cache(addr, true));
+    if (_coherence) _coherence->unlock();
+    return (timing);
 }
 
 cycle_t MMU::writeBlock(reg_t addr, reg_t *data, reg_t size)
@@ -218,6 +462,14 @@ cycle_t MMU::writeBlock(reg_t addr, reg_t *data, reg_t size)
     if ((addr + size) >= _memory_size)
         return 0;
     
+    // Ownership of every line first, as for bytes
+    if (_coherence) _coherence->lock();
+    
+    // Simulate a cache
+    cycle_t ret = 0;
+    for (int i = 0; i < size; i += 4)
+        ret += cache(addr + i, true, false);
+    
     // Get initial location in memory to write to
     reg_t *temp = (reg_t *) &(_memory[addr]);
     
@@ -226,15 +478,27 @@ cycle_t MMU::writeBlock(reg_t addr, reg_t *data, reg_t size)
     for (int i = 0; i < (size >> 2); i++)
         temp[i] = data[i];
     
-    // Simulate a cache
-    cycle_t ret = 0;
-    for (int i = 0; i < size; i += 4)
-        ret += cache(addr + i, true, false);
+    if (_coherence) _coherence->unlock();
     
     // The amount of time this takes is simulated by our caches
     return (ret);
 }
 
+cycle_t MMU::touchBlock(reg_t addr, reg_t len, bool write)
+{
+    if (!len) return (0);
+    
+    // The first level fills and writes back whole lines, so one access per
+    // line leaves it just as a loop over the words would.  Without caches
+    // memory moves a word at a time.
+    reg_t step = _caches ? _cache[0].lineBytes() : kRegSize;
+    cycle_t ret = 0;
+    for (reg_t at = addr & ~(step - 1); at < addr + len; at += step)
+        ret += cache(at, write);
+    
+    return (ret);
+}
+
 cycle_t MMU::readWord(reg_t addr, reg_t &valueToRet)
 {
     if ((addr + kRegSize) > _memory_size)
@@ -299,19 +563,23 @@ cycle_t MMU::singleTransfer(const STFlags &f, reg_t addr)
     // The dest register is where the value comes from
     reg_t dest = _vm->selectRegister(f.rd);
     
-    // Do the read/write
-    if (f.b)
+    // Anything past the end of memory is a device, or nothing
+    if (addr >= _memory_size)
     {
-        // Reading a byte only
-        if (addr >= _memory_size)
+        if (f.l)
         {
-            // Generate a MMU abort
-            abort(addr);
-            // Fail kindly to the application
-            _read_out = 0x0;
-            return (timing);
+            timing = _bus->read(addr, _read_out);
+            if (f.b) _read_out &= kByteMask;
+        } else {
+            timing = _bus->write(addr, f.b ? dest & kByteMask : dest);
         }
         
+        return (timing);
+    }
+    
+    // Do the read/write
+    if (f.b)
+    {
         // Do the operation
         if (f.l)
         {
@@ -338,8 +606,136 @@ cycle_t MMU::singleTransfer(const STFlags &f, reg_t addr)
         else
             // Store the word
             timing = writeWord(addr, dest);
+    
+    }
+    
+    return (timing);
+}
+
+cycle_t MMU::atomic(const AtomicFlags &f, reg_t addr, reg_t expected,
+    reg_t value)
+{
+    // Devices can't do it, and a word has to be all in one line
+    if ((addr & kIgnoredBitsMask) || addr + kRegSize > _memory_size)
+    {
+        abort(addr);
+        return (kMMUAbortCycles);
+    }
+    
+    // Other cores' accesses wait on the bus until this one is through.
+    // Without caches memory is all there is, and it takes a read and a
+    // write like anything else would.
+    if (_coherence) _coherence->lock();
+    
+    reg_t *word = (reg_t *) &(_memory[addr]);
+    cycle_t timing = 0;
+    switch (f.op)
+    {
+        case kSWP:
+        _read_out = __sync_lock_test_and_set(word, value);
+        timing = cache(addr, false, true, true) + cache(addr, true);
+        break;
+        
+        case kCAS:
+        // The line is taken for writing whether or not it gets written
+        _read_out = __sync_val_compare_and_swap(word, expected, value);
+        timing = cache(addr, false, true, true);
+        if (_read_out == expected) timing += cache(addr, true);
+        break;
+        
+        case kLDL:
+        _read_out = *word;
+        timing = cache(addr);
+        _linked = true;
+        _link = addr;
+        if (_caches) _cache[0].link(addr);
+        break;
+        
+        case kSTC:
+        // Whether or not it stores, the reservation is used up
+        _read_out = 1;
+        if (_linked && _link == addr && (!_caches || _cache[0].linked(addr)))
+        {
+            *word = value;
+            timing = cache(addr, true);
+            _read_out = 0;
+        } else if (_caches) {
+            timing = _cache[0].accessTime();
+        }
+        _linked = false;
+        if (_caches) _cache[0].unlink();
+        break;
+        
+        default:
+        break;
+    }
+    
+    if (_coherence) _coherence->unlock();
+    return (timing);
+}
+
+cycle_t MMU::cacheControl(const AtomicFlags &f, reg_t addr, reg_t value)
+{
+    // Prefetches are only hints, so they never abort
+    if (f.op == kPLD)
+    {
+        if (!_caches || addr >= _memory_size) return (0);
+        
+        if (_coherence) _coherence->lock();
+        cycle_t timing = prefetch(addr & ~kIgnoredBitsMask, f.rm);
+        if (_coherence) _coherence->unlock();
+        return (timing);
+    }
+    
+    if ((addr & kIgnoredBitsMask) || addr + kRegSize > _memory_size)
+    {
+        abort(addr);
+        return (kMMUAbortCycles);
+    }
+    
+    // Without caches there's nothing to maintain, and every store already
+    // goes to memory
+    if (!_caches)
+    {
+        if (f.op == kSTNT) return (writeWord(addr, value));
+        return (0);
+    }
+    
+    if (_coherence) _coherence->lock();
+    
+    cycle_t timing = 0, wait = 0;
+    switch (f.op)
+    {
+        case kSTNT:
+        // The line can't be left anywhere it would be out of date
+        *((reg_t *) &(_memory[addr])) = value;
+        timing = maintain(addr, true, true) + _write_time;
+        
+        // and the store waits its turn for memory like a miss would
+        if (_contended)
+        {
+            wait = claimMemory(_write_time) - _vm->cycleCount();
+            _contention += wait;
+            timing += wait;
+        }
+        break;
+        
+        case kCLEAN:
+        timing = maintain(addr, true, false);
+        break;
+        
+        case kINVAL:
+        timing = maintain(addr, false, true);
+        break;
+        
+        case kFLUSH:
+        timing = maintain(addr, true, true);
+        break;
         
+        default:
+        break;
     }
     
+    if (_coherence) _coherence->unlock();
     return (timing);
 }
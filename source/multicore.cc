@@ -0,0 +1,369 @@
+#include <sys/time.h>
+
+#include "includes/multicore.h"
+#include "includes/virtualmachine.h"
+#include "includes/luavm.h"
+#include "includes/util.h"
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec + tv.tv_usec / 1000000.0);
+}
+
+MulticoreSystem::MulticoreSystem(const char *config) : _config(config)
+{
+    _cores = 1;
+    _shared_cache = false;
+    _timing.snoop = kDefaultSnoopCycles;
+    _timing.transfer = kDefaultTransferCycles;
+    _timing.invalidate = kDefaultInvalidateCycles;
+    _core = NULL;
+    _bus = NULL;
+    _quanta[0] = 0;
+    _quantum_count = 1;
+    _threads = 0;
+    _waiting = 0;
+    _generation = 0;
+    _quantum = 0;
+    _horizon = 0;
+    _done = false;
+    
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_turn, NULL);
+}
+
+MulticoreSystem::~MulticoreSystem()
+{
+    release();
+    pthread_mutex_destroy(&_lock);
+    pthread_cond_destroy(&_turn);
+}
+
+reg_t MulticoreSystem::coresIn(const char *config)
+{
+    LuaVM *lua = new LuaVM();
+    lua->init();
+    
+    reg_t cores = 1;
+    if (!lua->exec(config, 0))
+        lua->getGlobalField("cores", kLUInt, &cores);
+    
+    delete lua;
+    return (cores ? cores : 1);
+}
+
+bool MulticoreSystem::configure()
+{
+    LuaVM *lua = new LuaVM();
+    lua->init();
+    if (lua->exec(_config, 0))
+    {
+        fprintf(stderr, "Could not read '%s' for its cores.\n", _config);
+        delete lua;
+        return (true);
+    }
+    
+    lua->getGlobalField("cores", kLUInt, &_cores);
+    lua->getGlobalField("shared_cache", kLBool, &_shared_cache);
+    
+    if (lua->openGlobalTable("coherence") != kLuaUnexpectedType)
+    {
+        lua->getTableField("snoop", kLUInt, &_timing.snoop);
+        lua->getTableField("transfer", kLUInt, &_timing.transfer);
+        lua->getTableField("invalidate", kLUInt, &_timing.invalidate);
+        lua->closeTable();
+    }
+    
+    // A list of quanta takes precedence over just one
+    reg_t quantum = 0;
+    lua->getGlobalField("quantum", kLUInt, &quantum);
+    _quanta[0] = quantum;
+    
+    if (lua->openGlobalTable("quanta") != kLuaUnexpectedType)
+    {
+        size_t len = lua->lengthOfCurrentObject();
+        if (len > kMaxQuanta)
+        {
+            printf("Warning: Only the first %i quanta are run.\n", kMaxQuanta);
+            len = kMaxQuanta;
+        }
+        
+        // Remember lua lists are ONE-INDEXED
+        for (reg_t i = 1; i < len + 1; i++)
+        {
+            quantum = 0;
+            lua->getTableField(i, kLUInt, &quantum);
+            _quanta[i - 1] = quantum;
+        }
+        
+        if (len) _quantum_count = len;
+        lua->closeTable();
+    }
+    
+    delete lua;
+    
+    if (!_cores || _cores > kMaxCores)
+    {
+        fprintf(stderr, "A machine has 1 to %i cores, not %u.\n", kMaxCores,
+            _cores);
+        return (true);
+    }
+    
+    return (false);
+}
+
+bool MulticoreSystem::init()
+{
+    if (configure()) return (true);
+    return (build());
+}
+
+bool MulticoreSystem::build()
+{
+    // Every run starts from a machine that has never run
+    release();
+    printf("Initializing %u core machine:\n", _cores);
+    
+    _bus = new CoherenceBus(_cores, _timing);
+    if (_bus->init()) return (true);
+    
+    _core = (VirtualMachine **)calloc(_cores, sizeof(VirtualMachine *));
+    if (!_core) return (true);
+    
+    // Nobody can talk to a core, and only the first owns memory
+    for (reg_t i = 0; i < _cores; i++)
+    {
+        printf("Core %u:\n", i);
+        _core[i] = new VirtualMachine(false);
+        _core[i]->joinSystem(i, _cores, i ? _core[0] : NULL, _bus,
+            _shared_cache);
+        
+        if (_core[i]->init(_config))
+        {
+            fprintf(stderr, "Core %u failed to initialize.\n", i);
+            return (true);
+        }
+    }
+    
+    return (false);
+}
+
+void MulticoreSystem::release()
+{
+    // The others use the first core's memory, so it goes last
+    if (_core)
+    {
+        for (reg_t i = _cores; i > 0; i--)
+            delete _core[i - 1];
+        free(_core);
+    }
+    
+    delete _bus;
+    _core = NULL;
+    _bus = NULL;
+}
+
+bool MulticoreSystem::run()
+{
+    for (reg_t q = 0; q < _quantum_count; q++)
+    {
+        if (q && build()) return (true);
+        
+        _quantum = _quanta[q];
+        if (_quantum)
+        {
+            printf("Starting execution on %u cores, %lu cycles at a time\n",
+                _cores, _quantum);
+        } else {
+            printf("Starting execution on %u cores in lockstep\n", _cores);
+        }
+        
+        QuantumResult &r = _results[q];
+        r.quantum = _quantum;
+        
+        double start = now();
+        if (!_quantum)
+            runLockstep();
+        else if (runThreads())
+            return (true);
+        r.seconds = now() - start;
+        
+        printRun(r);
+        if (terminate)
+        {
+            _quantum_count = q + 1;
+            break;
+        }
+    }
+    
+    return (false);
+}
+
+void MulticoreSystem::runLockstep()
+{
+    reg_t running = _cores;
+    while (running && !terminate)
+    {
+        // The core furthest behind goes next
+        VirtualMachine *next = NULL;
+        for (reg_t i = 0; i < _cores; i++)
+        {
+            if (!_core[i]->fex) continue;
+            if (!next || _core[i]->cycleCount() < next->cycleCount())
+                next = _core[i];
+        }
+        
+        if (next->cycle()) running--;
+    }
+}
+
+bool MulticoreSystem::runThreads()
+{
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * _cores);
+    CoreThread *cores = (CoreThread *)malloc(sizeof(CoreThread) * _cores);
+    if (!threads || !cores)
+    {
+        if (threads) free(threads);
+        if (cores) free(cores);
+        return (true);
+    }
+    
+    // Nobody starts until everyone has, and if that can't happen they
+    // all stop at once
+    pthread_mutex_lock(&_lock);
+    _waiting = 0;
+    _horizon = 0;
+    _done = false;
+    
+    reg_t started = 0;
+    for (; started < _cores; started++)
+    {
+        cores[started].system = this;
+        cores[started].index = started;
+        if (pthread_create(&threads[started], NULL, work,
+            (void *)&cores[started]))
+            break;
+    }
+    
+    _threads = started;
+    _done = (started < _cores);
+    pthread_mutex_unlock(&_lock);
+    
+    for (reg_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(cores);
+    
+    if (started < _cores)
+    {
+        fprintf(stderr, "Could only start %u of %u core threads.\n",
+            started, _cores);
+        return (true);
+    }
+    
+    return (false);
+}
+
+bool MulticoreSystem::sync(cycle_t &horizon)
+{
+    pthread_mutex_lock(&_lock);
+    
+    if (++_waiting == _threads)
+    {
+        // The last one here decides whether there is another quantum
+        bool running = false;
+        for (reg_t i = 0; i < _cores && !_done; i++)
+            running |= _core[i]->fex;
+        
+        _done |= !running || terminate;
+        _horizon += _quantum;
+        _waiting = 0;
+        _generation++;
+        pthread_cond_broadcast(&_turn);
+    } else {
+        size_t generation = _generation;
+        while (generation == _generation)
+            pthread_cond_wait(&_turn, &_lock);
+    }
+    
+    horizon = _horizon;
+    bool more = !_done;
+    pthread_mutex_unlock(&_lock);
+    return (more);
+}
+
+void *MulticoreSystem::work(void *core)
+{
+    CoreThread *t = (CoreThread *)core;
+    MulticoreSystem *s = t->system;
+    VirtualMachine *vm = s->_core[t->index];
+    
+    // Guest cores are spread over the host's, one thread each
+    _pin_thread(t->index);
+    
+    cycle_t horizon;
+    while (s->sync(horizon))
+    {
+        while (vm->fex && vm->cycleCount() < horizon && !terminate)
+            vm->cycle();
+    }
+    
+    return (NULL);
+}
+
+void MulticoreSystem::printRun(QuantumResult &r)
+{
+    r.cycles = 0;
+    r.instructions = 0;
+    r.transactions = _bus->transactions();
+    
+    for (reg_t i = 0; i < _cores; i++)
+    {
+        printf("Core %u:\n", i);
+        _core[i]->finish();
+        
+        IntervalResult m;
+        _core[i]->measurement(m);
+        r.instructions += m.instructions;
+        if (_core[i]->cycleCount() > r.cycles)
+            r.cycles = _core[i]->cycleCount();
+    }
+    
+    printf("Machine halted after %lu cycles.\n", r.cycles);
+    printf("%u cores retired %lu instructions (IPC %.3f).\n", _cores,
+        r.instructions, r.cycles ? (double)r.instructions / r.cycles : 0.0);
+    
+    for (reg_t i = 0; i < _cores; i++)
+    {
+        IntervalResult m;
+        _core[i]->measurement(m);
+        printf("Core %u: %lu cycles, %lu instructions, level-0 cache "
+            "%lu/%lu misses\n", i, m.cycles, m.instructions,
+            m.caches ? m.misses[0] : 0, m.caches ? m.accesses[0] : 0);
+    }
+    
+    _bus->printStatistics();
+}
+
+void MulticoreSystem::printStatistics()
+{
+    // The smallest quantum is the closest to what the machine would do
+    reg_t best = 0;
+    for (reg_t q = 1; q < _quantum_count; q++)
+        if (_results[q].quantum < _results[best].quantum) best = q;
+    
+    QuantumResult &ref = _results[best];
+    for (reg_t q = 0; q < _quantum_count; q++)
+    {
+        QuantumResult &r = _results[q];
+        double error = ref.cycles ?
+            100.0 * ((double)r.cycles - ref.cycles) / ref.cycles : 0.0;
+        
+        printf("Quantum %lu: %.3f seconds (%.2fx), %lu cycles (%+.2f%%), "
+            "%.0f cycles a second, %lu bus transactions\n", r.quantum,
+            r.seconds, r.seconds ? ref.seconds / r.seconds : 0.0, r.cycles,
+            error, r.seconds ? r.cycles / r.seconds : 0.0, r.transactions);
+    }
+}
@@ -0,0 +1,308 @@
+#include <string.h>
+
+#include "includes/ooo.h"
+#include "includes/atomic.h"
+
+OutOfOrderCore::OutOfOrderCore(const OOODescription &desc,
+    const IssueDescription &issue)
+{
+    for (int i = 0; i < kOOOParameterCount; i++)
+        _p[i] = desc.value[i];
+    for (int i = 0; i < kIssueUnitCount; i++)
+        _units[i] = issue.units[i];
+    
+    _rob = NULL;
+    _lsq = NULL;
+    _rename = NULL;
+}
+
+OutOfOrderCore::~OutOfOrderCore()
+{
+    if (_rob) free(_rob);
+    if (_lsq) free(_lsq);
+    if (_rename) free(_rename);
+}
+
+bool OutOfOrderCore::init()
+{
+    printf("Initializing out of order core model... ");
+    
+    for (int i = 0; i < kOOOParameterCount; i++)
+        if (!_p[i]) _p[i] = OOOParameterDefaults[i];
+    
+    // Same defaults as the wide in-order pipe
+    if (!_units[kIssueALU]) _units[kIssueALU] = _p[kOOOWidth];
+    for (int i = 0; i < kIssueUnitCount; i++)
+        if (!_units[i]) _units[i] = 1;
+    
+    _rob = (cycle_t *)calloc(_p[kOOOROB], sizeof(cycle_t));
+    _lsq = (cycle_t *)calloc(_p[kOOOLSQ], sizeof(cycle_t));
+    _rename = (cycle_t *)calloc(_p[kOOORename], sizeof(cycle_t));
+    
+    if (!_rob || !_lsq || !_rename)
+    {
+        printf("memory allocation error.\n");
+        return (true);
+    }
+    
+    for (int i = 0; i < kVMRegisterMax; i++)
+        _ready[i] = 0;
+    
+    _rob_count = 0;
+    _lsq_count = 0;
+    _rename_count = 0;
+    _fetch_cycle = 0;
+    _dispatch_cycle = 0;
+    _commit_cycle = 0;
+    _redirect = 0;
+    _fetched = 0;
+    _dispatched = 0;
+    _committed = 0;
+    
+    // Accounting
+    _instructions = 0;
+    _mispredictions = 0;
+    _forwarded_loads = 0;
+    _rob_max = 0;
+    _rob_occupancy = 0;
+    for (int i = 0; i < kDispatchStallCount; i++)
+        _stalls[i] = 0;
+    
+    printf("(%u wide, %u ROB, %u LSQ, %u rename) Done.\n", _p[kOOOWidth],
+        _p[kOOOROB], _p[kOOOLSQ], _p[kOOORename]);
+    return (false);
+}
+
+void OutOfOrderCore::commit(PipelineData *d, bool mispredicted)
+{
+    char unit = InstructionPipeline::issueUnit(d);
+    bool memory = (unit == kIssueMemory);
+    char kind = d->instruction_class;
+    bool load = memory && kind == kSingleTransfer && d->flags.st.l;
+    
+    // Prefetches don't wait for anything or hold anything up, the rest of
+    // the cache ops are ordered with stores the way atomics are
+    bool hint = (kind == kCacheControl && d->flags.a.op == kPLD);
+    bool atomic = (kind == kAtomic || (kind == kCacheControl && !hint));
+    
+    // Instructions that don't execute don't write anything
+    reg_t dests = d->executes ? d->writes : 0x0;
+    
+    cycle_t t = dispatch(unit, dests, memory, frontEnd(d));
+    
+    // Renaming leaves only true dependencies to wait on
+    cycle_t ready = t + 1;
+    for (int r = 0; r < kVMRegisterMax; r++)
+        if ((d->reads & (1 << r)) && _ready[r] > ready) ready = _ready[r];
+    
+    // Serializing ops don't use a station, they just wait their turn
+    cycle_t start = ready;
+    if (unit != kIssueUnitCount)
+    {
+        start = issue(unit, ready);
+        _stations[unit].insert(start);
+    }
+    
+    cycle_t done = start + (d->latency ? d->latency : 1);
+    reg_t word = d->address & ~(kRegSize - 1);
+    
+    // Loads get younger stores' data out of the queue, everything else has
+    // to go to memory.  Stores write to memory after they commit.
+    if (load && d->executes)
+    {
+        std::map<reg_t, StoreRecord>::iterator it = _stores.find(word);
+        if (it != _stores.end() && it->second.commit > start)
+        {
+            if (it->second.complete > start) start = it->second.complete;
+            done = start + 1;
+            _forwarded_loads++;
+        } else {
+            done += d->memory_latency;
+        }
+    }
+    
+    // Atomics can't take a value from the queue, they read and write memory
+    // once the stores to their word ahead of them have committed
+    if (atomic && d->executes)
+    {
+        std::map<reg_t, StoreRecord>::iterator it = _stores.find(word);
+        if (it != _stores.end() && it->second.commit > start)
+            start = it->second.commit;
+        done = start + (d->latency ? d->latency : 1) + d->memory_latency;
+    }
+    
+    for (int r = 0; r < kVMRegisterMax; r++)
+        if (dests & (1 << r)) _ready[r] = done;
+    
+    cycle_t c = retire(done + 1);
+    
+    // Free up window entries when this commits
+    _rob[_rob_count++ % _p[kOOOROB]] = c;
+    if (memory) _lsq[_lsq_count++ % _p[kOOOLSQ]] = c;
+    for (int r = 0; r < kVMRegisterMax; r++)
+        if (dests & (1 << r)) _rename[_rename_count++ % _p[kOOORename]] = c;
+    
+    if (memory && !load && !hint && d->executes)
+    {
+        StoreRecord &s = _stores[word];
+        s.word = word;
+        s.complete = done;
+        s.commit = c;
+        _store_order.push_back(s);
+    }
+    
+    // Fetch starts over once a mispredicted branch resolves, and after
+    // serializing ops have left the machine
+    if (mispredicted)
+    {
+        _mispredictions++;
+        if (done + 1 > _redirect) _redirect = done + 1;
+    }
+    if (unit == kIssueUnitCount && c + 1 > _redirect) _redirect = c + 1;
+    
+    // Accounting
+    _instructions++;
+    _rob_occupancy += c - t;
+}
+
+cycle_t OutOfOrderCore::frontEnd(PipelineData *d)
+{
+    // Fetch delivers up to width instructions a cycle, in program order
+    cycle_t t = _fetch_cycle;
+    if (_fetched == _p[kOOOWidth]) t++;
+    if (_redirect > t) t = _redirect;
+    
+    // Instruction cache misses hold up everything behind them
+    if (d->fetch_latency > 1) t += d->fetch_latency - 1;
+    
+    if (t == _fetch_cycle)
+    {
+        _fetched++;
+    } else {
+        _fetch_cycle = t;
+        _fetched = 1;
+    }
+    
+    // Ready to dispatch once it has made it through decode and rename
+    return (t + _p[kOOODepth]);
+}
+
+void OutOfOrderCore::stall(char reason, cycle_t &t, cycle_t until)
+{
+    if (until <= t) return;
+    _stalls[reason] += until - t;
+    t = until;
+}
+
+cycle_t OutOfOrderCore::dispatch(char unit, reg_t dests, bool memory,
+    cycle_t t)
+{
+    // Dispatch is in order and up to width instructions a cycle
+    cycle_t slot = _dispatch_cycle;
+    if (_dispatched == _p[kOOOWidth]) slot++;
+    if (t < slot)
+        t = slot;
+    else
+        _stalls[kDispatchFrontEnd] += t - slot;
+    
+    if (unit == kIssueUnitCount)
+        stall(kDispatchSerialize, t, _commit_cycle);
+    
+    // The entry this needs is free once whatever had it last commits
+    stall(kDispatchROB, t, _rob[_rob_count % _p[kOOOROB]]);
+    if (memory)
+        stall(kDispatchLSQ, t, _lsq[_lsq_count % _p[kOOOLSQ]]);
+    
+    size_t n = _rename_count;
+    for (int r = 0; r < kVMRegisterMax; r++)
+        if (dests & (1 << r))
+            stall(kDispatchRename, t, _rename[n++ % _p[kOOORename]]);
+    
+    // Reservation stations free up out of order, as their ops issue
+    if (unit != kIssueUnitCount)
+    {
+        std::multiset<cycle_t> &rs = _stations[unit];
+        reg_t size = _p[kOOOALUStations + unit];
+        
+        rs.erase(rs.begin(), rs.upper_bound(t));
+        if (rs.size() >= size)
+        {
+            std::multiset<cycle_t>::iterator it = rs.begin();
+            for (reg_t i = 0; i < rs.size() - size; i++) it++;
+            stall(kDispatchStations, t, *it);
+            rs.erase(rs.begin(), rs.upper_bound(t));
+        }
+    }
+    
+    if (t == _dispatch_cycle)
+    {
+        _dispatched++;
+    } else {
+        _dispatch_cycle = t;
+        _dispatched = 1;
+    }
+    
+    // Nothing can issue before it's dispatched, so forget older unit usage,
+    // and stores that have committed by then, which can't forward to it
+    for (int i = 0; i < kIssueUnitCount; i++)
+        _busy[i].erase(_busy[i].begin(), _busy[i].lower_bound(t));
+    while (!_store_order.empty() && _store_order.front().commit <= t)
+    {
+        std::map<reg_t, StoreRecord>::iterator it =
+            _stores.find(_store_order.front().word);
+        if (it != _stores.end() && it->second.commit <= t) _stores.erase(it);
+        _store_order.pop_front();
+    }
+    
+    // How full the ROB is now
+    size_t occupied = 1;
+    size_t entries = _rob_count < _p[kOOOROB] ? _rob_count : _p[kOOOROB];
+    for (size_t i = 0; i < entries; i++)
+        if (_rob[i] > t) occupied++;
+    if (occupied > _rob_max) _rob_max = occupied;
+    
+    return (t);
+}
+
+cycle_t OutOfOrderCore::issue(char unit, cycle_t t)
+{
+    // Units are pipelined, so each can start one op a cycle
+    std::map<cycle_t, reg_t> &busy = _busy[unit];
+    while (busy[t] >= _units[unit]) t++;
+    busy[t]++;
+    return (t);
+}
+
+cycle_t OutOfOrderCore::retire(cycle_t t)
+{
+    // Commit is in order and up to width instructions a cycle
+    if (t < _commit_cycle) t = _commit_cycle;
+    if (t == _commit_cycle && _committed == _p[kOOOWidth]) t++;
+    
+    if (t == _commit_cycle)
+    {
+        _committed++;
+    } else {
+        _commit_cycle = t;
+        _committed = 1;
+    }
+    
+    return (t);
+}
+
+void OutOfOrderCore::printStatistics()
+{
+    cycle_t cycles = _commit_cycle ? _commit_cycle : 1;
+    
+    printf("Out of order core (%u wide, %u ROB): %lu instructions in %lu ",
+        _p[kOOOWidth], _p[kOOOROB], _instructions, _commit_cycle);
+    printf("cycles (IPC %.3f)\n", (double)_instructions / cycles);
+    printf("\tROB occupancy: %.1f average, %lu max\n",
+        (double)_rob_occupancy / cycles, _rob_max);
+    printf("\t%lu mispredictions, %lu loads forwarded from stores\n",
+        _mispredictions, _forwarded_loads);
+    
+    printf("\tDispatch stall cycles:\n");
+    for (int i = 0; i < kDispatchStallCount; i++)
+        printf("\t\t%s: %lu\n", DispatchStallNames[i], _stalls[i]);
+}
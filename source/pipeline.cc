@@ -3,9 +3,13 @@
 #include "includes/pipeline.h"
 #include "includes/virtualmachine.h"
 
-InstructionPipeline::InstructionPipeline(char stages, VirtualMachine *vm) :
-    _stages(stages), _vm(vm)
+InstructionPipeline::InstructionPipeline(char stages,
+    const IssueDescription &issue, VirtualMachine *vm) :
+    _stages(stages), _width(issue.width), _vm(vm)
 {
+    for (int i = 0; i < kIssueUnitCount; i++)
+        _units[i] = issue.units[i];
+    
     _inst = NULL;
     _data = NULL;
     _flags = NULL;
@@ -17,7 +21,7 @@ InstructionPipeline::~InstructionPipeline()
     if (_inst) free(_inst);
     // Free all PipelineData objects
     int i = 0;
-    for (; i < _stages_in_use; i++)
+    for (; i < _positions; i++)
         if (_data[i]) delete _data[i];
     printf("(%i datum) ", i);
     if (_data) free(_data);
@@ -27,7 +31,22 @@ InstructionPipeline::~InstructionPipeline()
 // setup
 bool InstructionPipeline::init()
 {
-    printf("Initializing %u stage instruction pipeline... ", _stages);
+    // A single stage can't overlap anything, so it can't issue wide either
+    if (_stages == 1 || _width < 1) _width = 1;
+    if (_width > kMaxIssueWidth) _width = kMaxIssueWidth;
+    
+    printf("Initializing %u stage instruction pipeline", _stages);
+    if (_width > 1)
+    {
+        // Every group needs at least one of each unit or it could never issue
+        if (!_units[kIssueALU]) _units[kIssueALU] = _width;
+        for (int i = 0; i < kIssueUnitCount; i++)
+            if (!_units[i]) _units[i] = 1;
+        
+        printf(" (%u wide: %u ALU, %u FPU, %u memory)", _width,
+            _units[kIssueALU], _units[kIssueFPU], _units[kIssueMemory]);
+    }
+    printf("... ");
     
     // Error check (stages cannot = zero)
     if (!_stages || !_vm)
@@ -38,8 +57,8 @@ bool InstructionPipeline::init()
     
     // Dynamic memory allocation
     _inst = (pipeFunc *)calloc(_stages, sizeof(pipeFunc));
-    _data = (PipelineData **)calloc(_stages, sizeof(PipelineData *));
-    _flags = (PipelineFlags *)calloc(_stages, sizeof(PipelineFlags));
+    _data = (PipelineData **)calloc(_stages * _width, sizeof(PipelineData *));
+    _flags = (PipelineFlags *)calloc(_stages * _width, sizeof(PipelineFlags));
     
     // Error check
     if (!_inst || !_data || !_flags)
@@ -48,11 +67,30 @@ bool InstructionPipeline::init()
         return (true);
     }
     
+    for (int i = 0; i < kVMRegisterMax; i++)
+    {
+        _in_flight[i] = 0;
+        _pending[i] = 0;
+    }
     _registers_in_use = 0x0;
+    _registers_pending = 0x0;
+    _issue_stage = 1;
+    _current_stage = 0;
+    _draining = false;
     _stages_in_use = 0;
+    _positions = 0;
+    _retired = 0;
+    _group_dependencies = 0;
+    for (int i = 0; i < kMaxIssueWidth + 1; i++)
+        _issued[i] = 0;
+    for (int i = 0; i < kIssueUnitCount; i++)
+        _structural[i] = 0;
+    _accounting = true;
     _bubbles = 0;
     _invalidations = 0;
     _instructions_invalidated = 0;
+    for (int i = 0; i < kStallCauseCount; i++)
+        _stalls[i] = 0;
     
     printf("Done.\n");
     return (false);
@@ -63,7 +101,8 @@ char *InstructionPipeline::stateString()
     // This is a magic number that should be bigger than any line will get
     size_t line = 60;
     size_t index = 0;
-    char *out = (char *)malloc(sizeof(char) * line * _stages_in_use + 1);
+    char *out = (char *)malloc(sizeof(char) * line *
+        (_positions + kStallCauseCount + 4) + 1);
     
     sprintf(out, "Registers in use: %#x\n", _registers_in_use);
     index = strlen(out);
@@ -73,10 +112,16 @@ char *InstructionPipeline::stateString()
     index = strlen(out);
     sprintf(out+index, "Bubbles created: %lu\n", _bubbles);
     index = strlen(out);
+    for (int i = 0; i < kStallCauseCount; i++)
+    {
+        sprintf(out+index, "\t%s: %lu\n", StallCauseNames[i], _stalls[i]);
+        index = strlen(out);
+    }
     
-    for (int i = 0; i < _stages_in_use; i++)
+    for (int i = 0; i < _positions; i++)
     {
-        sprintf(out + index, "\t%i %c ", i, (i==_current_stage?'>':'-'));
+        sprintf(out + index, "\t%i %c ", i / _width,
+            (i==_current_stage?'>':'-'));
         index = strlen(out);
         
         if (_flags[i].bubble)
@@ -111,8 +156,8 @@ char *InstructionPipeline::stateString()
             index = strlen(out);
         }
         
-        if (_flags[i].lock != 0x0) {
-            sprintf(out + index, " (lock: %#x)", _flags[i].lock);
+        if (_flags[i].issued && _flags[i].writes != 0x0) {
+            sprintf(out + index, " (lock: %#x)", _flags[i].writes);
             index = strlen(out);
         }
         
@@ -129,6 +174,31 @@ void InstructionPipeline::printState()
     free(out);
 }
 
+void InstructionPipeline::printStatistics()
+{
+    printf("Pipeline: %lu invalidations (%lu stages), %lu stall cycles\n",
+        _invalidations, _instructions_invalidated, _bubbles);
+    for (int i = 0; i < kStallCauseCount; i++)
+        printf("\t%s: %lu\n", StallCauseNames[i], _stalls[i]);
+    
+    if (_width == 1) return;
+    
+    // How full the issue groups were, and what cut them short
+    size_t cycles = 0;
+    for (int i = 0; i <= _width; i++)
+        cycles += _issued[i];
+    
+    printf("Issue (%u wide): %lu cycles in decode\n", _width, cycles);
+    for (int i = 0; i <= _width; i++)
+    {
+        printf("\t%i issued: %lu (%.1f%%)\n", i, _issued[i],
+            cycles ? 100.0 * _issued[i] / cycles : 0.0);
+    }
+    printf("\tsplit on dependency: %lu\n", _group_dependencies);
+    for (int i = 0; i < kIssueUnitCount; i++)
+        printf("\tsplit on %s: %lu\n", IssueUnitNames[i], _structural[i]);
+}
+
 bool InstructionPipeline::registerStage(pipeFunc func)
 {
     // Error check
@@ -147,6 +217,28 @@ bool InstructionPipeline::registerStage(pipeFunc func)
     // Register the function to be called at stage index
     _inst[_stages_in_use] = func;
     
+    // Wide pipes just keep a datum in every position, and swap them around
+    if (_width > 1)
+    {
+        for (int k = 0; k < _width; k++)
+        {
+            int p = slot(_stages_in_use, k);
+            _flags[p].clear();
+            _flags[p].bubble = 1;
+            _data[p] = new PipelineData();
+            if (!_data[p])
+            {
+                fprintf(stderr, "Allocation error.\n");
+                return (true);
+            }
+            _data[p]->clear();
+        }
+        
+        _stages_in_use++;
+        _positions = _stages_in_use * _width;
+        return (false);
+    }
+    
     // Initialize the stage to "bubble" state
     _flags[_stages_in_use].bubble = 1;
     
@@ -169,6 +261,7 @@ bool InstructionPipeline::registerStage(pipeFunc func)
     
     // Increase the count
     _stages_in_use++;
+    _positions = _stages_in_use;
     
     // No error
     return (false);
@@ -183,6 +276,9 @@ bool InstructionPipeline::cycle()
         return (true);
     }
     
+    if (_width > 1)
+        return (cycleWide());
+    
     // Reset state of pipe stage zero
     _flags[0].clear();
     
@@ -192,6 +288,7 @@ bool InstructionPipeline::cycle()
         (_vm->*_inst[0])(_data[0]);
         _vm->incCycleCount(1);
         _current_stage = 0;
+        _retired++;
         return (false);
     }
     
@@ -209,12 +306,25 @@ bool InstructionPipeline::cycle()
             _flags[i].bubble = 1;
         }
         
+        // Nothing new comes in while the pipe drains
+        if (i == 0 && _draining)
+            _flags[i].bubble = 1;
+        
         // Call the function with data only if it's not a bubble
         if (!_flags[i].bubble)
+        {
             (_vm->*_inst[i])(_data[i]);
+            
+            // Anything still held once it leaves the pipe is let go
+            if (i == _stages_in_use - 1)
+            {
+                unlock();
+                _retired++;
+            }
+        }
         
-        // if this stage has dependancy on locked registers
-        if (_flags[i].wait & _registers_in_use)
+        // if this stage has dependancy on registers that can't be forwarded
+        if (_flags[i].wait & _registers_pending)
         {
             // Make sure the final stage never stalls
             if (i == _stages_in_use - 1)
@@ -229,6 +339,7 @@ bool InstructionPipeline::cycle()
             
             // Accounting
             _bubbles++;
+            _stalls[stallCause(i)]++;
             
             // halt the rest of the pipe
             break;
@@ -236,6 +347,10 @@ bool InstructionPipeline::cycle()
             _flags[i].wait = 0x0;
         }
         
+        // Everything this op will write is on the scoreboard once it issues
+        if (i == _issue_stage && !_flags[i].bubble)
+            claim(i);
+        
         // If we're not the last stage or the first
         if (i < _stages_in_use - 1)
         {
@@ -290,15 +405,258 @@ bool InstructionPipeline::cycle()
     return (false);
 }
 
+// Wide pipe manipulation.  Every stage is a group of up to _width
+// instructions that move together, except out of decode, where only the
+// oldest instructions that are free of hazards issue.
+bool InstructionPipeline::cycleWide()
+{
+    // Fetch only ever holds what it gets this cycle
+    for (int k = 0; k < _width; k++)
+        _flags[slot(0, k)].clear();
+    
+    for (int s = _stages_in_use - 1; s > -1; s--)
+    {
+        if (s == 0)
+        {
+            fetchGroup();
+            break;
+        }
+        
+        // Oldest first, so that branches squash younger ops in the group
+        startGroup();
+        for (int k = 0; k < _width; k++)
+        {
+            _current_stage = slot(s, k);
+            PipelineFlags &f = _flags[_current_stage];
+            
+            if (f.squash)
+            {
+                unlock();
+                f.clear();
+                f.bubble = 1;
+            }
+            
+            if (!f.bubble)
+                (_vm->*_inst[s])(_data[_current_stage]);
+            
+            endSlot();
+        }
+        endGroup();
+        
+        if (s == _stages_in_use - 1)
+            retireGroup(s);
+        else if (s == _issue_stage)
+            issueGroup();
+        else if (s > _issue_stage || groupIsEmpty(s + 1))
+            moveGroup(s);
+    }
+    
+    // Doing this takes one machine cycle.
+    _vm->incCycleCount(1);
+    
+    // Reset current stage
+    _current_stage = 0;
+    
+    return (false);
+}
+
+void InstructionPipeline::fetchGroup()
+{
+    // The next stage has to be able to take the whole group
+    if (_draining || !groupIsEmpty(1))
+    {
+        for (int k = 0; k < _width; k++)
+            _flags[slot(0, k)].bubble = 1;
+        return;
+    }
+    
+    bool fetching = true;
+    startGroup();
+    for (int k = 0; k < _width; k++)
+    {
+        _current_stage = slot(0, k);
+        PipelineFlags &f = _flags[_current_stage];
+        PipelineData *d = _data[_current_stage];
+        
+        // A squash here means fetch is being redirected this cycle
+        if (f.squash || !fetching)
+        {
+            f.clear();
+            f.bubble = 1;
+            fetching = false;
+            continue;
+        }
+        
+        (_vm->*_inst[0])(d);
+        endSlot();
+        
+        // Nothing after a predicted taken branch is in this fetch block
+        if (d->predicted_pc != d->location + kRegSize)
+            fetching = false;
+    }
+    endGroup();
+    
+    moveGroup(0);
+}
+
+// The slots of a group work in parallel, so the whole group only takes as
+// long as its slowest member
+void InstructionPipeline::startGroup()
+{
+    _group_start = _vm->cycleCount();
+    _group_cycles = 0;
+}
+
+void InstructionPipeline::endSlot()
+{
+    cycle_t spent = _vm->cycleCount() - _group_start;
+    if (spent > _group_cycles) _group_cycles = spent;
+    _vm->setCycleCount(_group_start);
+}
+
+void InstructionPipeline::endGroup()
+{
+    _vm->setCycleCount(_group_start + _group_cycles);
+}
+
+void InstructionPipeline::issueGroup()
+{
+    reg_t writes = 0x0;
+    char used[kIssueUnitCount] = {0};
+    int issued = 0;
+    
+    for (int k = 0; k < _width; k++)
+    {
+        int p = slot(_issue_stage, k);
+        if (_flags[p].bubble) continue;
+        
+        // Waiting on something older that is still in flight
+        if (_flags[p].wait & _registers_pending)
+        {
+            if (!issued)
+            {
+                _bubbles++;
+                _stalls[stallCause(p)]++;
+            }
+            break;
+        }
+        
+        // Waiting on something older in this same group
+        if (_flags[p].wait & writes)
+        {
+            _group_dependencies++;
+            break;
+        }
+        
+        // Interrupts go through the pipe on their own
+        char unit = issueUnit(_data[p]);
+        if (unit == kIssueUnitCount)
+        {
+            if (issued) break;
+        } else if (used[unit] == _units[unit]) {
+            _structural[unit]++;
+            break;
+        }
+        
+        writes |= _flags[p].writes;
+        _flags[p].wait = 0x0;
+        claim(p);
+        movePosition(p, slot(_issue_stage + 1, issued));
+        issued++;
+        
+        if (unit == kIssueUnitCount) break;
+        used[unit]++;
+    }
+    
+    _issued[issued]++;
+    
+    // Whatever is left becomes the oldest part of the decode group
+    int next = 0;
+    for (int k = 0; k < _width; k++)
+    {
+        int p = slot(_issue_stage, k);
+        if (_flags[p].bubble) continue;
+        if (k != next) movePosition(p, slot(_issue_stage, next));
+        next++;
+    }
+}
+
+void InstructionPipeline::moveGroup(int stage)
+{
+    // Everything after decode has already moved on, so the next group is
+    // always empty by the time this one gets to move into it.  Stages in
+    // front of decode only move when it is.
+    for (int k = 0; k < _width; k++)
+    {
+        int p = slot(stage, k);
+        if (!_flags[p].bubble)
+            movePosition(p, slot(stage + 1, k));
+    }
+}
+
+void InstructionPipeline::retireGroup(int stage)
+{
+    for (int k = 0; k < _width; k++)
+    {
+        int p = slot(stage, k);
+        if (!_flags[p].bubble) _retired++;
+        
+        _current_stage = p;
+        unlock();
+        
+        _data[p]->clear();
+        _flags[p].clear();
+        _flags[p].bubble = 1;
+    }
+}
+
+void InstructionPipeline::movePosition(int from, int to)
+{
+    // Trade datum so every position always owns one
+    PipelineData *temp = _data[to];
+    _data[to] = _data[from];
+    _data[from] = temp;
+    
+    _flags[to] = _flags[from];
+    _flags[from].clear();
+    _flags[from].bubble = 1;
+}
+
+bool InstructionPipeline::groupIsEmpty(int stage)
+{
+    for (int k = 0; k < _width; k++)
+        if (!_flags[slot(stage, k)].bubble) return (false);
+    return (true);
+}
+
+char InstructionPipeline::issueUnit(PipelineData *d)
+{
+    switch (d->instruction_class)
+    {
+        case kSingleTransfer:
+        case kAtomic:
+        case kCacheControl:
+        return (kIssueMemory);
+        
+        case kFloatingPoint:
+        return (kIssueFPU);
+        
+        case kInterrupt:
+        return (kIssueUnitCount);
+        
+        default:
+        return (kIssueALU);
+    }
+}
+
 void InstructionPipeline::invalidate()
 {
     // Squash all instruction after the current one
     for (int i = 0; i < _current_stage; i++)
-    {
         _flags[i].squash = 1;
-        _instructions_invalidated++;
-    }
     
+    if (!_accounting) return;
+    _instructions_invalidated += _current_stage;
     _invalidations++;
 }
 
@@ -306,47 +664,158 @@ bool InstructionPipeline::waitOnRegister(char reg)
 {
     if (reg >= kVMRegisterMax)
     {
-        fprintf(stderr, "Attempt to wait on out of bounds register\n.");
+        fprintf(stderr, "Attempt to wait on out of bounds register.\n");
         return (true);
     }
     
     // Set registers to wait on
     _flags[_current_stage].wait |= (1 << reg);
+    if (_data[_current_stage]) _data[_current_stage]->reads |= (1 << reg);
+    return (false);
 }
 
-bool InstructionPipeline::lock(char reg)
+bool InstructionPipeline::reserveRegister(char reg)
 {
-    // Lock the registers
-    _registers_in_use |= (1 << reg);
-    _flags[_current_stage].lock |= (1 << reg);
+    if (reg >= kVMRegisterMax)
+    {
+        fprintf(stderr, "Attempt to reserve out of bounds register.\n");
+        return (true);
+    }
     
-    // We might want to do this for debugging many instructions at once
-    // printf("In use: %#x\n", _registers_in_use);
+    _flags[_current_stage].writes |= (1 << reg);
+    if (_data[_current_stage]) _data[_current_stage]->writes |= (1 << reg);
+    return (false);
+}
+
+void InstructionPipeline::drain(bool draining)
+{
+    // Stop fetching so that everything in flight can finish
+    _draining = draining;
+}
+
+bool InstructionPipeline::isEmpty()
+{
+    // A single stage is done with each instruction in one cycle
+    if (_stages_in_use == 1) return (true);
     
+    for (int i = 0; i < _positions; i++)
+        if (!_flags[i].bubble) return (false);
     return (true);
 }
 
+void InstructionPipeline::setIssueStage(char stage)
+{
+    // Hazards are checked, and registers claimed, on the way out of here
+    _issue_stage = stage;
+}
+
+void InstructionPipeline::claim(int position)
+{
+    PipelineFlags &f = _flags[position];
+    
+    for (reg_t regs = f.writes; regs; regs &= regs - 1)
+    {
+        int reg = __builtin_ctz(regs);
+        if (!_in_flight[reg]++) _registers_in_use |= (1 << reg);
+        if (!_pending[reg]++) _registers_pending |= (1 << reg);
+    }
+    f.issued = 1;
+    
+    // Remember loads so stalls behind them can be told apart.  Atomics
+    // don't have their result until the memory stage either.
+    PipelineData *d = _data[position];
+    if (d && d->instruction_class == kSingleTransfer && d->flags.st.l)
+        f.load = 1;
+    if (d && d->instruction_class == kAtomic)
+        f.load = 1;
+}
+
 void InstructionPipeline::unlock()
 {
-    if (!_flags[_current_stage].lock)
+    PipelineFlags &f = _flags[_current_stage];
+    if (!f.issued)
         return;
     
-    // Unlock this stages registers
-    _flags[_current_stage].lock = 0x0;
+    // Give back this stage's registers, including any it never computed
+    for (reg_t regs = f.writes; regs; regs &= regs - 1)
+    {
+        int reg = __builtin_ctz(regs);
+        if (!--_in_flight[reg]) _registers_in_use &= ~(1 << reg);
+        if (!(f.ready & (1 << reg)) && !--_pending[reg])
+            _registers_pending &= ~(1 << reg);
+    }
     
-    // Reconstruct _registers_in_use
-    _registers_in_use = 0x0;
-    for (int i = 0; i < _stages_in_use; i++)
-        _registers_in_use |= _flags[i].lock;
+    f.issued = 0;
+    f.writes = 0x0;
+    f.ready = 0x0;
+}
+
+void InstructionPipeline::produce(char reg, reg_t val)
+{
+    PipelineFlags &f = _flags[_current_stage];
+    if (!f.issued || !(f.writes & (1 << reg)))
+        return;
     
+    // An instruction writes at most three registers (MULS), in any order
+    int slot = 0;
+    if (f.ready & (1 << reg))
+        while (f.result_reg[slot] != reg) slot++;
+    else
+        slot = __builtin_popcount(f.ready);
+    f.result_reg[slot] = reg;
+    f.result[slot] = val;
     
-    // printf("  In use: %#x\n", _registers_in_use);
+    // Once it's computed, nothing has to wait for this op to write it back
+    if (!(f.ready & (1 << reg)) && !--_pending[reg])
+        _registers_pending &= ~(1 << reg);
+    f.ready |= (1 << reg);
+}
+
+bool InstructionPipeline::forward(char reg, reg_t &val)
+{
+    // Stages behind this one have already advanced this cycle, so the
+    // first one found holding reg is the youngest older producer
+    for (int i = _current_stage + 1; i < _positions; i++)
+    {
+        if (_flags[i].bubble || _flags[i].squash) continue;
+        if (!(_flags[i].ready & (1 << reg))) continue;
+        
+        int slot = 0;
+        while (_flags[i].result_reg[slot] != reg) slot++;
+        
+        val = _flags[i].result[slot];
+        return (true);
+    }
+    
+    return (false);
+}
+
+char InstructionPipeline::stallCause(int stage)
+{
+    reg_t blocked = _flags[stage].wait & _registers_pending;
+    reg_t pq = (1 << kPQ0Code) | (1 << kPQ1Code);
+    
+    // Blame the youngest older instruction that is holding us up
+    for (int i = stage + 1; i < _positions; i++)
+    {
+        if (!_flags[i].issued) continue;
+        
+        reg_t regs = blocked & _flags[i].writes & ~_flags[i].ready;
+        if (!regs) continue;
+        
+        if (regs & pq) return (kStallPQ);
+        if (regs >> kFPR0Code) return (kStallFP);
+        if (_flags[i].load) return (kStallLoadUse);
+        return (kStallRAW);
+    }
+    
+    return (kStallRAW);
 }
 
 // Debugging
 bool InstructionPipeline::step()
 {
-    
+    return (false);
 }
 
 void InstructionPipeline::squash()
@@ -361,14 +830,18 @@ bool InstructionPipeline::isSquashed()
 
 reg_t InstructionPipeline::locationToExecute()
 {
-    
+
     if (_stages_in_use < 4 && _data[0])
     {
         return (_data[0]->location);
     }
     
-    if (!_flags[2].bubble && !_flags[2].squash && _data[2])
+    // The oldest instruction past decode
+    int p = slot(_issue_stage + 1, 0);
+    if (!_flags[p].bubble && !_flags[p].squash && _data[p])
     {
-        return (_data[2]->location);
+        return (_data[p]->location);
     }
+    
+    return (0x0);
 }
@@ -0,0 +1,287 @@
+#include <string.h>
+
+#include "includes/predictor.h"
+#include "includes/pipeline.h"
+#include "includes/util.h"
+
+BranchPredictor::BranchPredictor(char type, reg_t bits, reg_t btb_entries,
+    reg_t ras_depth) : _type(type), _bits(bits), _btb_entries(btb_entries),
+    _ras_depth(ras_depth)
+{
+    _bimodal = NULL;
+    _gshare = NULL;
+    _chooser = NULL;
+    _btb = NULL;
+    _ras = NULL;
+}
+
+BranchPredictor::~BranchPredictor()
+{
+    if (_bimodal) free(_bimodal);
+    if (_gshare) free(_gshare);
+    if (_chooser) free(_chooser);
+    if (_btb) free(_btb);
+    if (_ras) free(_ras);
+}
+
+bool BranchPredictor::init()
+{
+    if (_type < kPredictNone || _type >= kPredictorTypeCount)
+    {
+        fprintf(stderr, "Warning: Unknown branch predictor %i.\n", _type);
+        _type = kPredictNone;
+    }
+    
+    printf("Initializing %s branch predictor... ", PredictorNames[_type]);
+    
+    // Accounting
+    _accounting = true;
+    _branches = 0;
+    _mispredictions = 0;
+    _btb_hits = 0;
+    _history = 0;
+    _ras_top = 0;
+    
+    // Without prediction fetch just falls through, so allocate nothing
+    if (_type == kPredictNone)
+    {
+        printf("Done.\n");
+        return (false);
+    }
+    
+    if (!_bits || _bits > kMaxPredictorBits) _bits = kDefaultPredictorBits;
+    _mask = (1 << _bits) - 1;
+    
+    // The BTB is direct mapped, so keep it a power of two
+    if (!_btb_entries) _btb_entries = kDefaultBTBEntries;
+    _btb_entries = _nearest_power_of_two(_btb_entries);
+    if (!_ras_depth) _ras_depth = kDefaultRASDepth;
+    
+    _btb = (BTBEntry *)calloc(_btb_entries, sizeof(BTBEntry));
+    _ras = (reg_t *)calloc(_ras_depth, sizeof(reg_t));
+    
+    if (_type == kPredictBimodal || _type == kPredictTournament)
+    {
+        _bimodal = (char *)malloc(sizeof(char) * (_mask + 1));
+        if (_bimodal) memset(_bimodal, kWeaklyNotTaken, _mask + 1);
+    }
+    
+    if (_type == kPredictGShare || _type == kPredictTournament)
+    {
+        _gshare = (char *)malloc(sizeof(char) * (_mask + 1));
+        if (_gshare) memset(_gshare, kWeaklyNotTaken, _mask + 1);
+    }
+    
+    if (_type == kPredictTournament)
+    {
+        // Start out trusting the bimodal table, it warms up faster
+        _chooser = (char *)malloc(sizeof(char) * (_mask + 1));
+        if (_chooser) memset(_chooser, kWeaklyNotTaken, _mask + 1);
+    }
+    
+    if (!_btb || !_ras || (_type == kPredictTournament && !_chooser) ||
+        ((_type == kPredictBimodal || _type == kPredictTournament) && !_bimodal)
+        || ((_type == kPredictGShare || _type == kPredictTournament) && !_gshare))
+    {
+        printf("memory allocation error.\n");
+        return (true);
+    }
+    
+    printf("(%u bit, %u BTB, %u RAS) Done.\n", _bits, _btb_entries, _ras_depth);
+    return (false);
+}
+
+BranchPredictor::BTBEntry *BranchPredictor::lookup(reg_t pc)
+{
+    BTBEntry *e = &_btb[(pc / kRegSize) & (_btb_entries - 1)];
+    if (e->valid && e->tag == pc)
+        return (e);
+    return (NULL);
+}
+
+void BranchPredictor::push(reg_t addr)
+{
+    _ras_top = (_ras_top + 1) % _ras_depth;
+    _ras[_ras_top] = addr;
+}
+
+reg_t BranchPredictor::pop()
+{
+    // An empty stack just wraps around and gives a bad guess
+    reg_t ret = _ras[_ras_top];
+    _ras_top = (_ras_top + _ras_depth - 1) % _ras_depth;
+    return (ret);
+}
+
+void BranchPredictor::repair(PipelineData *d)
+{
+    if (!_ras) return;
+    
+    // A wrong path's calls only write above the top, unless it returned
+    // first.  Putting the top entry back undoes a return followed by a
+    // call, which is how that usually goes.
+    _ras_top = d->ras_top;
+    _ras[_ras_top] = d->ras_entry;
+}
+
+bool BranchPredictor::direction(reg_t pc, reg_t target, reg_t history)
+{
+    reg_t b = (pc / kRegSize) & _mask;
+    reg_t g = ((pc / kRegSize) ^ history) & _mask;
+    
+    switch (_type)
+    {
+        case kPredictStatic:
+        // Backward taken, forward not taken
+        return (target <= pc);
+        
+        case kPredictBimodal:
+        return (_bimodal[b] >= kWeaklyTaken);
+        
+        case kPredictGShare:
+        return (_gshare[g] >= kWeaklyTaken);
+        
+        case kPredictTournament:
+        if (_chooser[b] >= kWeaklyTaken)
+            return (_gshare[g] >= kWeaklyTaken);
+        return (_bimodal[b] >= kWeaklyTaken);
+        
+        case kPredictNone:
+        default:
+        return (false);
+    }
+}
+
+void BranchPredictor::train(reg_t pc, reg_t history, bool taken)
+{
+    reg_t b = (pc / kRegSize) & _mask;
+    reg_t g = ((pc / kRegSize) ^ history) & _mask;
+    
+    // The chooser only learns when the two components disagree
+    if (_chooser)
+    {
+        bool bp = _bimodal[b] >= kWeaklyTaken;
+        bool gp = _gshare[g] >= kWeaklyTaken;
+        if (bp != gp)
+            count(_chooser[b], gp == taken);
+    }
+    
+    if (_bimodal) count(_bimodal[b], taken);
+    if (_gshare) count(_gshare[g], taken);
+}
+
+reg_t BranchPredictor::predict(PipelineData *d)
+{
+    reg_t next = d->location + kRegSize;
+    
+    // Checkpoint speculative state so a misprediction can be repaired
+    d->predicted_pc = next;
+    d->history = _history;
+    
+    if (_type == kPredictNone) return (next);
+    d->ras_top = _ras_top;
+    d->ras_entry = _ras[_ras_top];
+    
+    // Only instructions that have branched before are in the BTB
+    BTBEntry *e = lookup(d->location);
+    if (!e) return (next);
+    if (_accounting) _btb_hits++;
+    
+    // Static prediction always follows calls, returns and computed jumps.
+    // The dynamic predictors learn that they're taken like anything else.
+    bool taken = (_type == kPredictStatic && e->kind != kBranchDirect);
+    if (!taken && !direction(d->location, e->target, _history))
+        return (next);
+    
+    // A return's entry holds how far past the link register it goes
+    reg_t target = e->target;
+    if (e->kind == kBranchReturn)
+        target = pop() + e->target;
+    else if (e->kind == kBranchCall)
+        push(d->location);
+    
+    d->predicted_pc = target;
+    return (target);
+}
+
+bool BranchPredictor::resolve(PipelineData *d, reg_t target, char kind)
+{
+    reg_t next = d->location + kRegSize;
+    bool wrong = (target != d->predicted_pc);
+    bool taken = (target != next);
+    
+    if (kind == kNotBranch)
+    {
+        // Only a stale BTB entry sends fetch off the sequential path here
+        if (wrong)
+        {
+            BTBEntry *e = lookup(d->location);
+            if (e) e->valid = false;
+            repair(d);
+        }
+        return (wrong);
+    }
+    
+    // Accounting
+    if (_accounting)
+    {
+        BranchRecord &r = _records[d->location];
+        r.executed++;
+        _branches++;
+        if (taken) r.taken++;
+        if (wrong)
+        {
+            r.mispredicted++;
+            _mispredictions++;
+        }
+    }
+    
+    if (_type == kPredictNone) return (wrong);
+    
+    // History is only updated non-speculatively, so train with the
+    // history that was used to make the prediction
+    train(d->location, d->history, taken);
+    _history = ((_history << 1) | (taken ? 1 : 0)) & _mask;
+    
+    // Remember where taken branches go
+    if (taken)
+    {
+        BTBEntry *e = &_btb[(d->location / kRegSize) & (_btb_entries - 1)];
+        e->valid = true;
+        e->tag = d->location;
+        e->target = target;
+        e->kind = kind;
+        if (kind == kBranchReturn) e->target = target - d->ras_entry;
+    }
+    
+    if (wrong)
+    {
+        // Throw away whatever the wrong path did to the return stack and
+        // replay this instruction's effect on it
+        repair(d);
+        if (taken && kind == kBranchCall) push(d->location);
+        if (taken && kind == kBranchReturn) pop();
+    }
+    
+    return (wrong);
+}
+
+void BranchPredictor::printStatistics()
+{
+    double accuracy = 100.0;
+    if (_branches)
+        accuracy = 100.0 * (_branches - _mispredictions) / _branches;
+    
+    printf("Branch prediction (%s): %lu branches, %lu mispredicted ",
+        PredictorNames[_type], _branches, _mispredictions);
+    printf("(%.2f%% accurate), %lu BTB hits\n", accuracy, _btb_hits);
+    
+    std::map<reg_t, BranchRecord>::iterator it = _records.begin();
+    for (; it != _records.end(); it++)
+    {
+        BranchRecord &r = it->second;
+        printf("\t%#010x: %lu executed, %.1f%% taken, %.2f%% accurate\n",
+            it->first, r.executed, 100.0 * r.taken / r.executed,
+            100.0 * (r.executed - r.mispredicted) / r.executed);
+    }
+}
@@ -26,6 +26,14 @@ solution "vm"
             defines { "NDEBUG" }
             flags { "Optimize" }
         
+    -- Runs a manifest of jobs on a pool of machines in one process
+    project "batch"
+        kind "ConsoleApp"
+        language "C++"
+        files { "*.cc", "batch/*.cc" }
+        excludes { "main.cc" }
+        flags { "Optimize" }
+        
     project "test"
             kind "ConsoleApp"
             language "C++"
@@ -0,0 +1,180 @@
+#include "includes/profiler.h"
+#include "includes/pipeline.h"
+
+Profiler::Profiler(reg_t interval, reg_t warmup, bool all,
+    const char *bbv_path, const char *points_path) :
+    _interval(interval), _warmup(warmup), _bbv_path(bbv_path),
+    _points_path(points_path), _all(all)
+{
+    _bbv = NULL;
+}
+
+Profiler::~Profiler()
+{
+    if (_bbv) fclose(_bbv);
+}
+
+bool Profiler::init()
+{
+    printf("Initializing profiler... ");
+    
+    if (!_interval) _interval = kDefaultProfileInterval;
+    
+    // Checkpoints have to be taken in order
+    if (_warmup >= _interval)
+    {
+        printf("(warmup too long) ");
+        _warmup = _interval - 1;
+    }
+    
+    if (_bbv_path)
+    {
+        _bbv = fopen(_bbv_path, "w");
+        if (!_bbv)
+        {
+            printf("could not open '%s'.\n", _bbv_path);
+            return (true);
+        }
+    }
+    
+    // Simulation points are "<interval> <cluster>" a line
+    if (_points_path)
+    {
+        FILE *points = fopen(_points_path, "r");
+        if (!points)
+        {
+            printf("could not open '%s'.\n", _points_path);
+            return (true);
+        }
+        
+        unsigned long interval, cluster;
+        while (fscanf(points, "%lu %lu", &interval, &cluster) == 2)
+            _points.insert(interval);
+        
+        fclose(points);
+    }
+    
+    _block_start = 0;
+    _block_length = 0;
+    _interval_length = 0;
+    _blocks.clear();
+    _counts.clear();
+    
+    // Accounting
+    _intervals = 0;
+    _instructions = 0;
+    
+    // The first interval starts right away
+    _checkpoint_due = false;
+    scheduleCheckpoint();
+    
+    if (_all)
+        printf("(%u instruction intervals, all checkpointed) Done.\n",
+            _interval);
+    else
+        printf("(%u instruction intervals, %lu simulation points) Done.\n",
+            _interval, _points.size());
+    return (false);
+}
+
+void Profiler::retire(PipelineData *d)
+{
+    if (!_block_length) _block_start = d->location;
+    _block_length++;
+    _interval_length++;
+    _instructions++;
+    
+    // Blocks end at anything that can change the flow of control, whether
+    // or not it did this time
+    if (d->instruction_class == kBranch || d->instruction_class == kInterrupt
+        || (d->writes & (1 << kPCCode)))
+        endBlock();
+    
+    if (_interval_length == _interval)
+    {
+        endBlock();
+        endInterval();
+    }
+    
+    scheduleCheckpoint();
+}
+
+void Profiler::scheduleCheckpoint()
+{
+    // Interval i is checkpointed warmup instructions before it starts
+    size_t interval = 0;
+    if (_instructions)
+    {
+        if ((_instructions + _warmup) % _interval) return;
+        interval = (_instructions + _warmup) / _interval;
+    }
+    
+    if (!_all && !_points.count(interval)) return;
+    
+    _checkpoint_due = true;
+    _checkpoint_interval = interval;
+}
+
+void Profiler::endBlock()
+{
+    if (!_block_length) return;
+    
+    std::map<reg_t, reg_t>::iterator it = _blocks.find(_block_start);
+    reg_t id;
+    if (it == _blocks.end())
+    {
+        id = _blocks.size() + 1;
+        _blocks[_block_start] = id;
+    } else {
+        id = it->second;
+    }
+    
+    _counts[id] += _block_length;
+    _block_length = 0;
+}
+
+void Profiler::endInterval()
+{
+    if (_bbv)
+    {
+        fprintf(_bbv, "T");
+        std::map<reg_t, size_t>::iterator it;
+        for (it = _counts.begin(); it != _counts.end(); it++)
+            fprintf(_bbv, ":%u:%lu ", it->first, it->second);
+        fprintf(_bbv, "\n");
+    }
+    
+    _counts.clear();
+    _interval_length = 0;
+    _intervals++;
+}
+
+bool Profiler::checkpointDue(size_t &interval)
+{
+    if (!_checkpoint_due) return (false);
+    
+    _checkpoint_due = false;
+    interval = _checkpoint_interval;
+    return (true);
+}
+
+void Profiler::finish()
+{
+    // A short last interval still counts, it just weighs less
+    endBlock();
+    if (_interval_length) endInterval();
+    
+    if (_bbv)
+    {
+        fclose(_bbv);
+        _bbv = NULL;
+    }
+}
+
+void Profiler::printStatistics()
+{
+    printf("Profile: %lu instructions in %lu intervals of %u, ", _instructions,
+        _intervals, _interval);
+    printf("%lu basic blocks\n", _blocks.size());
+    if (_bbv_path) printf("\tBasic block vectors written to '%s'\n", _bbv_path);
+}
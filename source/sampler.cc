@@ -0,0 +1,172 @@
+#include <math.h>
+
+#include "includes/sampler.h"
+#include "includes/mmu.h"
+
+double SampleStatistic::interval()
+{
+    if (count < 2) return (0.0);
+    
+    // 1.96 standard errors either side of the mean
+    double variance = (sum_squares - sum * sum / count) / (count - 1);
+    if (variance < 0.0) variance = 0.0;
+    return (1.96 * sqrt(variance / count));
+}
+
+Sampler::Sampler(const SampleDescription &desc, char caches) :
+    _caches(caches)
+{
+    for (int i = 0; i < kSampleParameterCount; i++)
+        _p[i] = desc.value[i];
+    
+    _accesses = NULL;
+    _misses = NULL;
+    _miss_rate = NULL;
+}
+
+Sampler::~Sampler()
+{
+    if (_accesses) free(_accesses);
+    if (_misses) free(_misses);
+    if (_miss_rate) free(_miss_rate);
+}
+
+bool Sampler::init()
+{
+    printf("Initializing sampler... ");
+    
+    if (!_p[kSamplePeriod])
+        _p[kSamplePeriod] = SampleParameterDefaults[kSamplePeriod];
+    if (!_p[kSampleLength]) _p[kSampleLength] = 1;
+    
+    // Leave at least one instruction a period to fast forward
+    if (_p[kSampleWarmup] + _p[kSampleLength] >= _p[kSamplePeriod])
+    {
+        printf("(period too short) ");
+        _p[kSamplePeriod] = _p[kSampleWarmup] + _p[kSampleLength] + 1;
+    }
+    
+    if (_caches)
+    {
+        _accesses = (size_t *)calloc(_caches, sizeof(size_t));
+        _misses = (size_t *)calloc(_caches, sizeof(size_t));
+        _miss_rate = (SampleStatistic *)calloc(_caches,
+            sizeof(SampleStatistic));
+        
+        if (!_accesses || !_misses || !_miss_rate)
+        {
+            printf("memory allocation error.\n");
+            return (true);
+        }
+    }
+    
+    _phase = kSampleFastForward;
+    _fast_forwarded = 0;
+    _skipped = 0;
+    _retired_start = 0;
+    _cycle_start = 0;
+    
+    // Accounting
+    _detailed = 0;
+    _cpi.clear();
+    for (int i = 0; i < _caches; i++)
+        _miss_rate[i].clear();
+    
+    printf("(%u of every %u instructions, %u warmup) Done.\n",
+        _p[kSampleLength], _p[kSamplePeriod], _p[kSampleWarmup]);
+    return (false);
+}
+
+void Sampler::fastForward(size_t retired)
+{
+    _fast_forwarded++;
+    
+    // The detailed pipe takes the rest of the period
+    reg_t detailed = _p[kSampleWarmup] + _p[kSampleLength];
+    if (++_skipped < _p[kSamplePeriod] - detailed)
+        return;
+    
+    _phase = kSampleWarming;
+    _retired_start = retired;
+}
+
+void Sampler::cycle(size_t retired, cycle_t cycles, MMU *mmu)
+{
+    size_t done = retired - _retired_start;
+    
+    switch (_phase)
+    {
+        case kSampleWarming:
+        if (done < _p[kSampleWarmup]) break;
+        
+        // Everything is in flight now, so start measuring
+        _phase = kSampleMeasuring;
+        _retired_start = retired;
+        _cycle_start = cycles;
+        snapshot(mmu);
+        break;
+        
+        case kSampleMeasuring:
+        if (done < _p[kSampleLength]) break;
+        
+        _cpi.add((double)(cycles - _cycle_start) / done);
+        for (int i = 0; i < _caches; i++)
+        {
+            size_t accesses, misses;
+            mmu->cacheStatistics(i, accesses, misses);
+            
+            // Levels this sample never got to don't say anything
+            if (accesses == _accesses[i]) continue;
+            _miss_rate[i].add((double)(misses - _misses[i]) /
+                (accesses - _accesses[i]));
+        }
+        
+        _detailed += done;
+        _phase = kSampleDraining;
+        break;
+        
+        default:
+        break;
+    }
+}
+
+void Sampler::drained()
+{
+    _phase = kSampleFastForward;
+    _skipped = 0;
+}
+
+void Sampler::snapshot(MMU *mmu)
+{
+    for (int i = 0; i < _caches; i++)
+        mmu->cacheStatistics(i, _accesses[i], _misses[i]);
+}
+
+void Sampler::printStatistics(size_t retired)
+{
+    size_t instructions = _fast_forwarded + retired;
+    double cpi = _cpi.mean();
+    
+    printf("Sampling: %lu samples of %u instructions every %u ", _cpi.count,
+        _p[kSampleLength], _p[kSamplePeriod]);
+    printf("(%u warmup)\n", _p[kSampleWarmup]);
+    printf("\t%lu instructions fast forwarded, %lu in detail, %lu measured\n",
+        _fast_forwarded, retired, _detailed);
+    
+    if (!_cpi.count)
+    {
+        printf("\tNo complete samples, the period is too long.\n");
+        return;
+    }
+    
+    printf("\tEstimated CPI: %.3f +/- %.3f (95%% confidence)\n", cpi,
+        _cpi.interval());
+    printf("\tEstimated cycles: %.0f +/- %.0f\n", cpi * instructions,
+        _cpi.interval() * instructions);
+    
+    for (int i = 0; i < _caches; i++)
+    {
+        printf("\tLevel-%i miss rate: %.2f%% +/- %.2f%%\n", i,
+            100.0 * _miss_rate[i].mean(), 100.0 * _miss_rate[i].interval());
+    }
+}
@@ -14,35 +14,24 @@
 
 #include "includes/server.h"
 
-// The following should only ever be changed to true by the serve thread.
-// It is used to tell the VM thread that all init has occured properly and
-// the server has aquired the work lock.  This mechanism is here in case
-// the VM finishes doing all of it's work before the thread even gets to lock.
-// Remember that from starting the thread and doing all the socket work, the
-// server thread is making a ton of really slow syscalls.
-bool _ready = false;
-
-// Define this here so we don't have to put #include <pthread.h> in the server
-// header file
-pthread_t _listener;
-
-// Have to forward declare the function to be passed to pthread_create
-void *serve( void *ptr );
-
-MonitorServer::MonitorServer(VirtualMachine *vm) : _vm(vm)
-{ }
+MonitorServer::MonitorServer(VirtualMachine *vm, reg_t port) : _vm(vm)
+{
+    snprintf(_port, sizeof(_port), "%u", port);
+    _ready = false;
+    _stop = false;
+}
 
 MonitorServer::~MonitorServer()
 {
     printf("Waiting for listener thread to terminate... ");
-    terminate = 1;
+    _stop = true;
     pthread_join(_listener, NULL);
     printf("Done.\n");
 }
 
 bool MonitorServer::init()
 {
-    printf("Initializing server... ");
+    printf("Initializing server on port %s... ", _port);
     if (!_vm)
     {
         printf("invalid arguments.\n");
@@ -50,6 +39,7 @@ bool MonitorServer::init()
     }
     
     _ready = false;
+    _stop = false;
     
     printf("Done.\n");
     return (false);
@@ -75,7 +65,7 @@ int MonitorServer::run()
     pthread_attr_t attr;
     int ret = pthread_attr_init(&attr);
     ret = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-    ret = pthread_create(&_listener, &attr, serve, (void *)_vm);
+    ret = pthread_create(&_listener, &attr, serve, (void *)this);
     
     if (ret)
         printf("failed: %i\n", ret);
@@ -91,7 +81,7 @@ void *get_in_addr(struct sockaddr *sa)
     if (sa->sa_family == AF_INET) {
         return &(((struct sockaddr_in*)sa)->sin_addr);
     }
-
+    
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
@@ -207,8 +197,8 @@ bool _demux_op(char *op, size_t size, VirtualMachine *vm, int fd)
             vm->fex = true;
             // This is the incantation to stop waiting for destructive
             // user input
-            pthread_mutex_unlock(&server_mutex);
-            pthread_mutex_lock(&server_mutex);
+            pthread_mutex_unlock(&vm->server_mutex);
+            pthread_mutex_lock(&vm->server_mutex);
         } else {
             char buf[] = "Execution in progress.\n";
             send(fd, buf, strlen(buf), 0);
@@ -231,13 +221,15 @@ bool _demux_op(char *op, size_t size, VirtualMachine *vm, int fd)
         return (true);
     }
     
-    // Tokenize commands that require args
-    char *pch = strtok(op, " ");
+    // Tokenize commands that require args.  Other machines' servers may be
+    // doing the same, so it has to be the reentrant one.
+    char *save;
+    char *pch = strtok_r(op, " ", &save);
     if (strcmp(pch, kReadCommand) == 0) {
         // read
         reg_t addr;
         reg_t val;
-        pch = strtok(NULL, " ");
+        pch = strtok_r(NULL, " ", &save);
         if (pch)
             addr = (reg_t)atoi(pch);
         else
@@ -257,13 +249,13 @@ bool _demux_op(char *op, size_t size, VirtualMachine *vm, int fd)
     } else if (strcmp(pch, kRangeCommand) == 0) {
         // range
         int addr, val;
-        pch = strtok(NULL, " ");
+        pch = strtok_r(NULL, " ", &save);
         if (pch)
             addr = atoi(pch);
         else
             addr = 0;
         
-        pch = strtok(NULL, " ");
+        pch = strtok_r(NULL, " ", &save);
         if (pch)
             val = atoi(pch);
         else
@@ -281,12 +273,19 @@ bool _demux_op(char *op, size_t size, VirtualMachine *vm, int fd)
     return (false);
 }
 
-void *serve( void *ptr )
+// _ready should only ever be changed to true by this thread.
+// It is used to tell the VM thread that all init has occured properly and
+// the server has aquired the work lock.  This mechanism is here in case
+// the VM finishes doing all of it's work before the thread even gets to lock.
+// Remember that from starting the thread and doing all the socket work, the
+// server thread is making a ton of really slow syscalls.
+void *MonitorServer::serve(void *ptr)
 {
     printf("Monitor connection listener thread started.\n");
     
     // Find out what machine we're dealing with
-    VirtualMachine *vm = (VirtualMachine *)ptr;
+    MonitorServer *ms = (MonitorServer *)ptr;
+    VirtualMachine *vm = ms->_vm;
     if (!vm)
     {
         fprintf(stderr, "No virtual machine instance.  Aborting.\n");
@@ -327,7 +326,7 @@ void *serve( void *ptr )
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE; // Use current IP
     
-    if ((rv = getaddrinfo(NULL, PORT, &hints, &serverinfo)) != 0)
+    if ((rv = getaddrinfo(NULL, ms->_port, &hints, &serverinfo)) != 0)
     {
         fprintf(stderr, "Error getting addrinfo: %s\n", gai_strerror(rv));
         return (NULL);
@@ -381,7 +380,7 @@ void *serve( void *ptr )
     // We must have the lock, otherwise it'll cause VM thread to deadlock
     // HOWEVER, nothing should have the lock at this point so if there is
     // contention, make sure to fail hard to avoid race conditions.
-    int err = pthread_mutex_trylock(&server_mutex);
+    int err = pthread_mutex_trylock(&vm->server_mutex);
     if (err)
     {
         // Something has the mutex, die.
@@ -394,16 +393,16 @@ void *serve( void *ptr )
     
     // Tell VM thread that we're ready.  This basically tells them we've
     // aquired the mutex and blocking on it wont cause a race condition.
-    _ready = true;
+    ms->_ready = true;
     
-    while(!terminate)
+    while(!terminate && !ms->_stop)
     {
         // copy master fds
         read_fds = master;
         if (select(fdmax+1, &read_fds, NULL, NULL, &tv) == -1)
         {
             perror("select");
-            pthread_mutex_unlock(&server_mutex);
+            pthread_mutex_unlock(&vm->server_mutex);
             return (NULL);
         }
         
@@ -436,7 +435,7 @@ void *serve( void *ptr )
                             get_in_addr((struct sockaddr *)&remoteaddr),
                             remoteIP, INET6_ADDRSTRLEN),
                             newfd);
-                        
+                    
                     }
                 } else {
                     // handle data from client
@@ -505,10 +504,10 @@ void *serve( void *ptr )
                         vm->operation = buf;
                         vm->opsize = sizeof(buf);
                         // give the vm a chance to work
-                        pthread_mutex_unlock(&server_mutex);
+                        pthread_mutex_unlock(&vm->server_mutex);
                         // try to get it back by waiting again
                         // (enter the queue)
-                        pthread_mutex_lock(&server_mutex);
+                        pthread_mutex_lock(&vm->server_mutex);
                         // Now we expect response and respsize to be allocated
                         // and set, respectively.  We also remember to clean up
                         if (vm->respsize > 0)
@@ -530,7 +529,7 @@ void *serve( void *ptr )
     }
     
     printf("Shutting down listener.\n");
-    pthread_mutex_unlock(&server_mutex);
+    pthread_mutex_unlock(&vm->server_mutex);
     return (NULL);
 }
 
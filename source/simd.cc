@@ -0,0 +1,227 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "includes/virtualmachine.h"
+#include "includes/pipeline.h"
+#include "includes/simd.h"
+
+SIMDUnit::SIMDUnit(VirtualMachine *vm) : _vm(vm)
+{}
+
+SIMDUnit::~SIMDUnit()
+{
+    _vm = NULL;
+}
+
+bool SIMDUnit::init(SIMDTimings &timing)
+{
+    // Return true if instantiation failed
+    if (!_vm) return (true);
+    
+    // Copy the supplied timing struct
+    _timing.copy(timing);
+    
+    _output = 0x0;
+    return (false);
+}
+
+reg_t SIMDUnit::packed(char op, bool halfwords, reg_t n, reg_t m)
+{
+#ifdef __SSE2__
+    // The word goes in the bottom of an xmm register and the rest of it is
+    // zero, which no op carries into our lanes
+    __m128i a = _mm_cvtsi32_si128((int)n);
+    __m128i b = _mm_cvtsi32_si128((int)m);
+    __m128i r;
+    
+    // SSE2 only has min and max for signed halfwords and unsigned bytes, and
+    // only signed compares, so the others flip the sign bits on the way in
+    // and out
+    __m128i bias = halfwords ? _mm_set1_epi16((short)0x8000) :
+        _mm_set1_epi8((char)0x80);
+    
+    switch (op)
+    {
+        case kPADD:
+        r = halfwords ? _mm_add_epi16(a, b) : _mm_add_epi8(a, b);
+        break;
+        
+        case kPSUB:
+        r = halfwords ? _mm_sub_epi16(a, b) : _mm_sub_epi8(a, b);
+        break;
+        
+        case kPADDS:
+        r = halfwords ? _mm_adds_epi16(a, b) : _mm_adds_epi8(a, b);
+        break;
+        
+        case kPSUBS:
+        r = halfwords ? _mm_subs_epi16(a, b) : _mm_subs_epi8(a, b);
+        break;
+        
+        case kPADDUS:
+        r = halfwords ? _mm_adds_epu16(a, b) : _mm_adds_epu8(a, b);
+        break;
+        
+        case kPSUBUS:
+        r = halfwords ? _mm_subs_epu16(a, b) : _mm_subs_epu8(a, b);
+        break;
+        
+        case kPMIN:
+        if (halfwords)
+            r = _mm_min_epi16(a, b);
+        else
+            r = _mm_xor_si128(_mm_min_epu8(_mm_xor_si128(a, bias),
+                _mm_xor_si128(b, bias)), bias);
+        break;
+        
+        case kPMAX:
+        if (halfwords)
+            r = _mm_max_epi16(a, b);
+        else
+            r = _mm_xor_si128(_mm_max_epu8(_mm_xor_si128(a, bias),
+                _mm_xor_si128(b, bias)), bias);
+        break;
+        
+        case kPMINU:
+        if (halfwords)
+            r = _mm_xor_si128(_mm_min_epi16(_mm_xor_si128(a, bias),
+                _mm_xor_si128(b, bias)), bias);
+        else
+            r = _mm_min_epu8(a, b);
+        break;
+        
+        case kPMAXU:
+        if (halfwords)
+            r = _mm_xor_si128(_mm_max_epi16(_mm_xor_si128(a, bias),
+                _mm_xor_si128(b, bias)), bias);
+        else
+            r = _mm_max_epu8(a, b);
+        break;
+        
+        case kPCMPEQ:
+        r = halfwords ? _mm_cmpeq_epi16(a, b) : _mm_cmpeq_epi8(a, b);
+        break;
+        
+        case kPCMPGT:
+        r = halfwords ? _mm_cmpgt_epi16(a, b) : _mm_cmpgt_epi8(a, b);
+        break;
+        
+        case kPCMPGTU:
+        a = _mm_xor_si128(a, bias);
+        b = _mm_xor_si128(b, bias);
+        r = halfwords ? _mm_cmpgt_epi16(a, b) : _mm_cmpgt_epi8(a, b);
+        break;
+        
+        case kPAVGU:
+        r = halfwords ? _mm_avg_epu16(a, b) : _mm_avg_epu8(a, b);
+        break;
+        
+        default:
+        return (0x0);
+    }
+    
+    return ((reg_t)_mm_cvtsi128_si32(r));
+#else
+    return (lanes(op, halfwords, n, m));
+#endif
+}
+
+reg_t SIMDUnit::lanes(char op, bool halfwords, reg_t n, reg_t m)
+{
+    int bits = halfwords ? 16 : 8;
+    reg_t mask = (kOne << bits) - 1;
+    int sign = 1 << (bits - 1);
+    int smin = -sign, smax = sign - 1;
+    reg_t out = 0x0;
+    
+    for (int shift = 0; shift < (int)kRegBits; shift += bits)
+    {
+        int un = (n >> shift) & mask;
+        int um = (m >> shift) & mask;
+        
+        // Sign extended, for the signed ops
+        int sn = (un ^ sign) - sign;
+        int sm = (um ^ sign) - sign;
+        int r;
+        
+        switch (op)
+        {
+            case kPADD:
+            r = un + um;
+            break;
+            
+            case kPSUB:
+            r = un - um;
+            break;
+            
+            case kPADDS:
+            r = sn + sm;
+            r = r < smin ? smin : (r > smax ? smax : r);
+            break;
+            
+            case kPSUBS:
+            r = sn - sm;
+            r = r < smin ? smin : (r > smax ? smax : r);
+            break;
+            
+            case kPADDUS:
+            r = un + um;
+            if (r > (int)mask) r = mask;
+            break;
+            
+            case kPSUBUS:
+            r = un - um;
+            if (r < 0) r = 0;
+            break;
+            
+            case kPMIN:
+            r = sn < sm ? sn : sm;
+            break;
+            
+            case kPMAX:
+            r = sn > sm ? sn : sm;
+            break;
+            
+            case kPMINU:
+            r = un < um ? un : um;
+            break;
+            
+            case kPMAXU:
+            r = un > um ? un : um;
+            break;
+            
+            case kPCMPEQ:
+            r = un == um ? mask : 0;
+            break;
+            
+            case kPCMPGT:
+            r = sn > sm ? mask : 0;
+            break;
+            
+            case kPCMPGTU:
+            r = un > um ? mask : 0;
+            break;
+            
+            case kPAVGU:
+            r = (un + um + 1) >> 1;
+            break;
+            
+            default:
+            return (0x0);
+        }
+        
+        out |= ((reg_t)r & mask) << shift;
+    }
+    
+    return (out);
+}
+
+cycle_t SIMDUnit::execute(const SIMDFlags &flags)
+{
+    reg_t n = _vm->selectRegister(flags.rs);
+    reg_t m = _vm->selectRegister(flags.rm);
+    
+    _output = packed(flags.op, flags.h, n, m);
+    return (_timing.op[flags.op]);
+}
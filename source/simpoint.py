@@ -0,0 +1,194 @@
+#!/usr/bin/python
+import sys
+import math
+import random
+
+"""
+Picks simulation points for YAAA out of the basic block vectors the VM
+writes when profiling (bbv_file in config.lua).
+
+    simpoint.py <bbv file> <output prefix> [max clusters]
+
+Intervals are clustered on what code they run, the way SimPoint does it:
+every vector is normalized, randomly projected down to a few dimensions,
+and clustered with k-means for every k up to max clusters.  The smallest k
+that scores nearly as well as the best one (by the Bayesian information
+criterion) wins.  The interval closest to the middle of each cluster stands
+in for all of it.
+
+Writes <prefix>.simpoints, "<interval> <cluster>" a line, which goes back to
+the VM as simpoints to checkpoint those intervals, and <prefix>.weights,
+"<weight> <cluster>" a line, the share of the program each one stands for.
+"""
+
+class SimPoint:
+
+    """
+    Clusters basic block vectors and picks one interval from each cluster.
+    """
+
+    # Dimensions to project down to, and how hard to look for clusters
+    dimensions = 15
+    seeds = 5
+    iterations = 100
+
+    # How close to the best score the chosen clustering has to be
+    threshold = 0.9
+
+    def __init__(self, max_k):
+        self.max_k = max_k
+        self.vectors = []
+        random.seed(493575226)
+
+    def read(self, path):
+        """
+        Reads "T:<block>:<count> :<block>:<count> ..." lines.
+        """
+        for line in open(path):
+            line = line.strip()
+            if not line.startswith("T"):
+                continue
+
+            v = {}
+            for pair in line[1:].split():
+                fields = pair.strip(":").split(":")
+                v[int(fields[0])] = float(fields[1])
+
+            # Normalize, so that short intervals look like long ones
+            total = sum(v.values())
+            if total:
+                for b in v:
+                    v[b] /= total
+            self.vectors.append(v)
+
+    def project(self):
+        """
+        Random projection: each block gets a random direction.
+        """
+        directions = {}
+        points = []
+        for v in self.vectors:
+            p = [0.0] * self.dimensions
+            for b in v:
+                if b not in directions:
+                    directions[b] = [random.uniform(-1.0, 1.0)
+                        for i in range(self.dimensions)]
+                d = directions[b]
+                for i in range(self.dimensions):
+                    p[i] += v[b] * d[i]
+            points.append(p)
+        return points
+
+    def distance(self, a, b):
+        return sum([(a[i] - b[i]) ** 2 for i in range(len(a))])
+
+    def kmeans(self, points, k):
+        """
+        Lloyd's algorithm from k distinct random points.
+        """
+        centers = [list(p) for p in random.sample(points, k)]
+        assign = [-1] * len(points)
+
+        for it in range(self.iterations):
+            changed = False
+            for n in range(len(points)):
+                best = min(range(k),
+                    key=lambda j: self.distance(points[n], centers[j]))
+                if best != assign[n]:
+                    assign[n] = best
+                    changed = True
+
+            if not changed:
+                break
+
+            # Empty clusters keep their old center
+            for j in range(k):
+                members = [points[n] for n in range(len(points))
+                    if assign[n] == j]
+                if members:
+                    centers[j] = [sum(c) / len(members) for c in zip(*members)]
+
+        sse = sum([self.distance(points[n], centers[assign[n]])
+            for n in range(len(points))])
+        return centers, assign, sse
+
+    def bic(self, points, assign, sse, k):
+        """
+        Bayesian information criterion of a spherical Gaussian mixture.
+        """
+        R = len(points)
+        M = self.dimensions
+        if R <= k:
+            return 0.0
+
+        variance = sse / (M * (R - k))
+        if variance <= 0.0:
+            variance = 1e-12
+
+        likelihood = -R * M / 2.0 * math.log(2 * math.pi * variance)
+        likelihood -= M * (R - k) / 2.0
+        for j in range(k):
+            size = assign.count(j)
+            if size:
+                likelihood += size * math.log(float(size) / R)
+
+        parameters = (k - 1) + M * k + 1
+        return likelihood - parameters / 2.0 * math.log(R)
+
+    def cluster(self):
+        points = self.project()
+        runs = []
+        for k in range(1, min(self.max_k, len(points)) + 1):
+            best = None
+            for s in range(self.seeds):
+                run = self.kmeans(points, k)
+                if best is None or run[2] < best[2]:
+                    best = run
+            centers, assign, sse = best
+            score = self.bic(points, assign, sse, k)
+            runs.append((score, k, centers, assign))
+            sys.stderr.write("k = %d: BIC %.1f\n" % (k, score))
+
+        # The smallest k that does nearly as well as the best
+        low = min([r[0] for r in runs])
+        high = max([r[0] for r in runs])
+        for score, k, centers, assign in runs:
+            if score >= low + self.threshold * (high - low):
+                break
+
+        # Closest interval to each center, and how much it stands for
+        picks = []
+        for j in range(k):
+            members = [n for n in range(len(points)) if assign[n] == j]
+            if not members:
+                continue
+            rep = min(members,
+                key=lambda n: self.distance(points[n], centers[j]))
+            picks.append((rep, j, float(len(members)) / len(points)))
+        picks.sort()
+        return picks
+
+    def write(self, prefix, picks):
+        points = open(prefix + ".simpoints", "w")
+        weights = open(prefix + ".weights", "w")
+        for interval, cluster, weight in picks:
+            points.write("%d %d\n" % (interval, cluster))
+            weights.write("%f %d\n" % (weight, cluster))
+        points.close()
+        weights.close()
+
+if __name__ == "__main__":
+    if len(sys.argv) < 3:
+        sys.stderr.write("usage: simpoint.py <bbv file> <prefix> [max k]\n")
+        sys.exit(1)
+
+    s = SimPoint(len(sys.argv) > 3 and int(sys.argv[3]) or 10)
+    s.read(sys.argv[1])
+    if not s.vectors:
+        sys.stderr.write("No basic block vectors in %s\n" % sys.argv[1])
+        sys.exit(1)
+
+    picks = s.cluster()
+    s.write(sys.argv[2], picks)
+    sys.stderr.write("%d simulation points out of %d intervals\n" %
+        (len(picks), len(s.vectors)))
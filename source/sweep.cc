@@ -0,0 +1,151 @@
+#include <string.h>
+
+#include "includes/sweep.h"
+#include "includes/luavm.h"
+
+static int compareNames(const void *a, const void *b)
+{
+    return (strcmp((const char *)a, (const char *)b));
+}
+
+Sweep::Sweep(const char *config) : _config(config)
+{
+    _program = NULL;
+    _dimensions = 0;
+    for (int i = 0; i < kMaxSweepDimensions; i++)
+    {
+        _sizes[i] = 0;
+        _values[i] = NULL;
+    }
+}
+
+Sweep::~Sweep()
+{
+    if (_program) free(_program);
+    for (int i = 0; i < kMaxSweepDimensions; i++)
+        if (_values[i]) free(_values[i]);
+}
+
+bool Sweep::init()
+{
+    LuaVM *lua = new LuaVM();
+    lua->init();
+    if (lua->exec(_config, 0))
+    {
+        fprintf(stderr, "Could not read '%s' for its sweep.\n", _config);
+        delete lua;
+        return (true);
+    }
+    
+    const char *program = NULL;
+    lua->getGlobalField("program", kLString, &program);
+    if (program)
+    {
+        _program = (char *)malloc(sizeof(char) * strlen(program) + 1);
+        strcpy(_program, program);
+    }
+    
+    // Nothing to sweep over is just one point
+    if (lua->openGlobalTable("sweep") == kLuaUnexpectedType)
+    {
+        delete lua;
+        return (false);
+    }
+    
+    size_t count = lua->keysOfCurrentTable(&_names[0][0], kMaxSweepName,
+        kMaxSweepDimensions);
+    if (count > kMaxSweepDimensions)
+    {
+        fprintf(stderr, "'%s' sweeps over %lu settings, at most %i can be.\n",
+            _config, count, kMaxSweepDimensions);
+        delete lua;
+        return (true);
+    }
+    
+    _dimensions = count;
+    qsort(_names, _dimensions, kMaxSweepName, compareNames);
+    
+    bool err = false;
+    for (reg_t d = 0; d < _dimensions; d++)
+    {
+        if (lua->openTableAtTableKey(_names[d]) != kLuaNoError)
+        {
+            fprintf(stderr, "Sweep of '%s' in '%s' isn't a list.\n",
+                _names[d], _config);
+            err = true;
+            break;
+        }
+        
+        _sizes[d] = lua->lengthOfCurrentObject();
+        _values[d] = (char *)malloc(sizeof(char) * kMaxSweepValue *
+            (_sizes[d] ? _sizes[d] : 1));
+        if (!_sizes[d] || !_values[d])
+        {
+            fprintf(stderr, "Sweep of '%s' in '%s' has no values.\n",
+                _names[d], _config);
+            err = true;
+            break;
+        }
+        
+        for (reg_t i = 0; i < _sizes[d]; i++)
+        {
+            lua->describeTableIndex(i + 1, &_values[d][i * kMaxSweepValue],
+                kMaxSweepValue);
+        }
+        
+        lua->closeTable();
+    }
+    
+    delete lua;
+    return (err);
+}
+
+size_t Sweep::points()
+{
+    size_t n = 1;
+    for (reg_t d = 0; d < _dimensions; d++)
+        n *= _sizes[d];
+    return (n);
+}
+
+void Sweep::point(size_t n, SweepPoint &p)
+{
+    // The last dimension changes fastest
+    p.dimensions = _dimensions;
+    for (int d = _dimensions - 1; d >= 0; d--)
+    {
+        reg_t i = n % _sizes[d];
+        n /= _sizes[d];
+        
+        strcpy(p.names[d], _names[d]);
+        strcpy(p.values[d], &_values[d][i * kMaxSweepValue]);
+        p.index[d] = i + 1;
+    }
+}
+
+bool Sweep::apply(LuaVM *lua, const SweepPoint &p)
+{
+    if (!p.dimensions) return (false);
+    
+    if (lua->openGlobalTable("sweep") != kLuaNoError)
+    {
+        fprintf(stderr, "Config has no sweep to take a point from.\n");
+        return (true);
+    }
+    
+    bool err = false;
+    for (reg_t d = 0; d < p.dimensions && !err; d++)
+    {
+        err = (lua->openTableAtTableKey(p.names[d]) != kLuaNoError ||
+            lua->setGlobalFromTableIndex(p.names[d], p.index[d]) !=
+            kLuaNoError);
+        lua->closeTable();
+        
+        if (err)
+            fprintf(stderr, "Sweep has no value %u for '%s'.\n", p.index[d],
+                p.names[d]);
+    }
+    
+    lua->closeTable();
+    return (err);
+}
@@ -7,7 +7,58 @@
     #endif
 #endif
 
+#include <stdio.h>
+
+#include "../includes/predictor.h"
+#include "../includes/pipeline.h"
+
+// Runs one control transfer through the predictor the way fetch and execute
+// do, and returns true if fetch would have gone the wrong way
+static bool branch(BranchPredictor &p, reg_t location, reg_t target, char kind)
+{
+    PipelineData d;
+    d.clear();
+    d.location = location;
+    p.predict(&d);
+    return (p.resolve(&d, target, kind));
+}
+
+// A loop calls f, which calls g and then h.  BL leaves its own address in
+// r15, and h and f return past the call with ADD pc, r15, #4.  g has a word
+// of arguments after its call and returns past that with ADD pc, r15, #8.
+// After a few trips around the loop, enough for gshare's history to fill
+// and train, none of the returns should be mispredicted.
+static bool testReturnStack(char type)
+{
+    BranchPredictor p(type, 0, 0, 0);
+    if (p.init()) return (true);
+    
+    size_t missed = 0;
+    for (int i = 0; i < 10; i++)
+    {
+        bool warm = (i > 2);
+        branch(p, 0x10, 0x40, kBranchCall);
+        branch(p, 0x44, 0x80, kBranchCall);
+        if (branch(p, 0x84, 0x4c, kBranchReturn) && warm) missed++;
+        branch(p, 0x4c, 0xc0, kBranchCall);
+        if (branch(p, 0xc4, 0x50, kBranchReturn) && warm) missed++;
+        if (branch(p, 0x50, 0x14, kBranchReturn) && warm) missed++;
+        branch(p, 0x14, 0x10, kBranchDirect);
+    }
+    
+    if (missed)
+    {
+        fprintf(stderr, "%s: %lu returns mispredicted.\n",
+            PredictorNames[type], missed);
+        return (true);
+    }
+    return (false);
+}
+
 int main(int argc, char *argv[])
 {
-    return 0;
-}
\ No newline at end of file
+    bool failed = false;
+    for (char t = kPredictStatic; t < kPredictorTypeCount; t++)
+        failed |= testReturnStack(t);
+    return (failed ? 1 : 0);
+}
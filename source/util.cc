@@ -1,4 +1,6 @@
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "includes/util.h"
 
@@ -44,7 +46,7 @@ unsigned int _hex_to_int(const char *str)
         } else if (index[i] > 64 && index[i] < 91) {
             // [A-Z]
             charval = index[i] - 65 + 10;
-            
+        
         } else if (index[i] > 96 && index[i] < 123) {
             // [a-z]
             charval = index[i] - 97 + 10;
@@ -95,3 +97,16 @@ unsigned int _nearest_power_of_two(unsigned int val)
     
     return (ret + 1);
 }
+
+void _pin_thread(reg_t index)
+{
+#ifdef __linux__
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) return;
+    
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % cores, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
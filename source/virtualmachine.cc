@@ -3,6 +3,7 @@
 #include <errno.h>>
 #include <signal.h>
 #include <string.h>
+#include <unistd.h>
 #include <iostream>
 
 #include "includes/server.h"
@@ -10,10 +11,17 @@
 #include "includes/mmu.h"
 #include "includes/alu.h"
 #include "includes/fpu.h"
+#include "includes/simd.h"
+#include "includes/atomic.h"
+#include "includes/ooo.h"
+#include "includes/sampler.h"
+#include "includes/profiler.h"
+#include "includes/checkpoint.h"
 #include "includes/util.h"
 #include "includes/luavm.h"
 #include "includes/pipeline.h"
 #include "includes/cache.h"
+#include "includes/predictor.h"
 
 // Macros for checking the PSR
 #define N_SET     (_psr & kPSRNBit)
@@ -35,9 +43,6 @@ extern "C" {
     volatile sig_atomic_t terminate;
 }
 
-// Init static mutex
-pthread_mutex_t server_mutex;
-
 reg_t *VirtualMachine::demuxRegID(const char id)
 {
     if (id >= kVMRegisterMax)
@@ -79,6 +84,76 @@ reg_t *VirtualMachine::demuxRegID(const char id)
     }
 }
 
+char *VirtualMachine::hostMemory(reg_t addr, reg_t len)
+{
+    return (mmu->hostMemory(addr, len));
+}
+
+reg_t VirtualMachine::scheduleEvent(cycle_t when, EventCallback callback,
+    void *data)
+{
+    reg_t id = events->schedule(when, callback, data);
+    _next_event = events->next();
+    return (id);
+}
+
+bool VirtualMachine::cancelEvent(reg_t id)
+{
+    bool err = events->cancel(id);
+    _next_event = events->next();
+    return (err);
+}
+
+void VirtualMachine::runEvents()
+{
+    events->run(_cycle_count);
+    _next_event = events->next();
+}
+
+void VirtualMachine::cycleTrapEvent(VirtualMachine *vm, void *data)
+{
+    // Set this up to break out of possible infinite loops
+    vm->trap("Cycle count unlikely to be this large.");
+}
+
+void VirtualMachine::raiseInterrupt(reg_t n)
+{
+    _irq = n;
+    _irq_pending = true;
+}
+
+void VirtualMachine::setTimer(cycle_t delay, reg_t n)
+{
+    if (_timer_event) cancelEvent(_timer_event);
+    _timer_event = 0;
+    
+    if (!delay) return;
+    
+    _timer_irq = n;
+    _timer_event = scheduleEvent(_cycle_count + delay, timerEvent, NULL);
+}
+
+void VirtualMachine::timerEvent(VirtualMachine *vm, void *data)
+{
+    vm->_timer_event = 0;
+    vm->raiseInterrupt(vm->_timer_irq);
+}
+
+void VirtualMachine::takeInterrupt(reg_t next)
+{
+    // Routines aren't reentrant, so wait for them to return
+    if (!_irq_pending || supervisor || !fex) return;
+    
+    _irq_pending = false;
+    incCycleCount(icu->raise(_irq, next));
+    pipe->invalidate();
+}
+
+cycle_t VirtualMachine::touchMemory(reg_t addr, reg_t len, bool write)
+{
+    return (mmu->touchBlock(addr, len, write));
+}
+
 const char *VirtualMachine::readOnlyMemory(reg_t &size)
 {
     return (mmu->readOnlyMemory(size));
@@ -148,7 +223,7 @@ void VirtualMachine::evaluateConditional(PipelineData *d)
         
         case kCondLE:           // Less than or equal
         // Z set, or N set and V clear, or N clear and V set
-        if (Z_CLEAR || (N_SET && V_CLEAR) || (N_CLEAR && V_SET)) return;
+        if (Z_SET || (N_SET && V_CLEAR) || (N_CLEAR && V_SET)) return;
         break;
         
         case kCondNV:           // Never
@@ -159,7 +234,7 @@ void VirtualMachine::evaluateConditional(PipelineData *d)
     d->executes = false;
 }
 
-VirtualMachine::VirtualMachine()
+VirtualMachine::VirtualMachine(bool interactive) : _interactive(interactive)
 {
     // Set dynamically allocated variables to NULL so that
     // we don't accidentally free them when destroying this class
@@ -169,6 +244,48 @@ VirtualMachine::VirtualMachine()
     _dump_file = NULL;
     _breakpoints = NULL;
     _cache_desc = NULL;
+    _int_desc = NULL;
+    _int_count = 0;
+    _int_table_file = NULL;
+    ms = NULL;
+    ooo = NULL;
+    sampler = NULL;
+    profiler = NULL;
+    _functional = NULL;
+    _bbv_file = NULL;
+    _simpoints_file = NULL;
+    _checkpoint_prefix = NULL;
+    _checkpoint_file = NULL;
+    events = NULL;
+    uart = NULL;
+    counter = NULL;
+    disk = NULL;
+    dma = NULL;
+    _disk_image = NULL;
+    mmu = NULL;
+    alu = NULL;
+    fpu = NULL;
+    simd = NULL;
+    icu = NULL;
+    pipe = NULL;
+    predictor = NULL;
+    operation = NULL;
+    response = NULL;
+    opsize = 0;
+    respsize = 0;
+    
+    _spare_memory = NULL;
+    _spare_size = 0;
+    
+    // A machine is its only core unless it joins a system
+    _core = 0;
+    _cores = 1;
+    _first = NULL;
+    _coherence = NULL;
+    _shared_cache = false;
+    
+    // Each machine has its own, so that many can run in one process
+    pthread_mutex_init(&server_mutex, NULL);
 }
 
 VirtualMachine::~VirtualMachine()
@@ -176,37 +293,99 @@ VirtualMachine::~VirtualMachine()
     // Do this first, just in case
     delete ms;
     printf("Destroying virtual machine...\n");
-    mmu->writeOut(_dump_file);
     
+    // Nobody is around to look at memory after a batch run
+    if (_interactive && mmu) mmu->writeOut(_dump_file);
+    
+    release();
+    if (_spare_memory) free(_spare_memory);
+    pthread_mutex_destroy(&server_mutex);
+}
+
+void VirtualMachine::release()
+{
+    // Everything init() makes, so that it can be called again, except
+    // memory, which the next build can have if it's the same size
+    if (mmu && !_spare_memory)
+    {
+        _spare_memory = mmu->giveUpMemory();
+        _spare_size = mmu->memorySize();
+    }
     delete mmu;
     delete alu;
     delete fpu;
+    delete simd;
     delete icu;
     delete pipe;
+    delete predictor;
+    delete ooo;
+    delete sampler;
+    delete profiler;
+    delete _functional;
+    delete events;
+    delete uart;
+    delete counter;
+    delete disk;
+    delete dma;
+    mmu = NULL;
+    alu = NULL;
+    fpu = NULL;
+    simd = NULL;
+    icu = NULL;
+    pipe = NULL;
+    predictor = NULL;
+    ooo = NULL;
+    sampler = NULL;
+    profiler = NULL;
+    _functional = NULL;
+    events = NULL;
+    uart = NULL;
+    counter = NULL;
+    disk = NULL;
+    dma = NULL;
+    
+    if (_breakpoints) free(_breakpoints);
+    if (_dump_file) free(_dump_file);
+    if (_program_file) free(_program_file);
+    if (_cache_desc) free(_cache_desc);
+    _breakpoints = NULL;
+    _dump_file = NULL;
+    _program_file = NULL;
+    _cache_desc = NULL;
     
-    if (_breakpoints)
-        free(_breakpoints);
-    
-    if (_dump_file)
-        free(_dump_file);
-    
-    if (_program_file)
-        free(_program_file);
-    
-    if (_cache_desc)
-        free(_cache_desc);
+    freeInterruptDescription();
+    if (_int_table_file) free(_int_table_file);
+    if (_disk_image) free(_disk_image);
+    _int_table_file = NULL;
+    _disk_image = NULL;
+    
+    if (_bbv_file) free(_bbv_file);
+    if (_simpoints_file) free(_simpoints_file);
+    if (_checkpoint_prefix) free(_checkpoint_prefix);
+    if (_checkpoint_file) free(_checkpoint_file);
+    _bbv_file = NULL;
+    _simpoints_file = NULL;
+    _checkpoint_prefix = NULL;
+    _checkpoint_file = NULL;
 }
 
 bool VirtualMachine::loadProgramImage(const char *path, reg_t addr)
 {
     // Copy command line arguments onto the stack
     
-    // Allocate stack space before code
-    _ss = addr + (_stack_size << 2);
+    // A program that isn't there would run as an empty one
+    if (path && access(path, R_OK))
+    {
+        fprintf(stderr, "Could not read program image '%s'.\n", path);
+        return (true);
+    }
+    
+    // Allocate stack space before code, a stack for each core
+    _ss = addr + ((_core + 1) * _stack_size << 2);
     printf("Program stack: %u words allocated at %#x\n", _stack_size, _ss);
     
-    // Code segment starts right after it
-    _cs = _ss + kRegSize;
+    // Code segment starts right after the last one, and every core runs it
+    _cs = addr + (_cores * _stack_size << 2) + kRegSize;
     printf("Code segment: %#x\n", _cs);
     
     // Load file into memory at _cs
@@ -223,9 +402,13 @@ bool VirtualMachine::loadProgramImage(const char *path, reg_t addr)
     _psr = kPSRDefault;
     _fpsr = 0;
     
+    // Which core this is starts out in r0
+    _r[0] = _core;
+    
     // Jump to _main
     // TODO: Make this jump to the main label, not the top
     _pc = _cs;
+    return (false);
 }
 
 void VirtualMachine::resetSegmentRegisters()
@@ -263,9 +446,11 @@ void VirtualMachine::relocateBreakpoints()
     printf("Done.\n");
 }
 
-bool VirtualMachine::configure(const char *c_path, ALUTimings &at)
+bool VirtualMachine::configure(const char *c_path, ALUTimings &at,
+    FPUTimings &ft, SIMDTimings &st, IssueDescription &issue,
+    OOODescription &ooo_desc, SampleDescription &sample_desc)
 {
-    
+
     // Parse the config file
     LuaVM *lua = new LuaVM();
     lua->init();
@@ -279,6 +464,13 @@ bool VirtualMachine::configure(const char *c_path, ALUTimings &at)
         return (true);
     }
     
+    // A point of the config's sweep replaces the values it sweeps over
+    if (_sweep_point && Sweep::apply(lua, *_sweep_point))
+    {
+        delete lua;
+        return (true);
+    }
+    
     // Count the errors for values that must be specified
     int err = 0;
     
@@ -316,14 +508,148 @@ bool VirtualMachine::configure(const char *c_path, ALUTimings &at)
     lua->getGlobalField("print_branch_offset", kLBool, &_print_branch_offset);
     lua->getGlobalField("program_length_trap", kLUInt, &_length_trap);
     lua->getGlobalField("machine_cycle_trap", kLUInt, &_cycle_trap);
-    lua->getGlobalField("stages", kLUInt, &_pipe_stages);
     lua->getGlobalField("debug_cache", kLBool, &_debug_cache);
+    lua->getGlobalField("monitor_port", kLUInt, &_monitor_port);
+    lua->getGlobalField("bypass_ex", kLBool, &_bypass_ex);
+    lua->getGlobalField("bypass_mem", kLBool, &_bypass_mem);
+    
+    // Branch prediction
+    const char *predictor_temp = NULL;
+    lua->getGlobalField("branch_predictor", kLString, &predictor_temp);
+    lua->getGlobalField("predictor_bits", kLUInt, &_predictor_bits);
+    lua->getGlobalField("btb_entries", kLUInt, &_btb_entries);
+    lua->getGlobalField("ras_depth", kLUInt, &_ras_depth);
+    
+    if (predictor_temp)
+    {
+        int i = 0;
+        for (; i < kPredictorTypeCount; i++)
+            if (!strcmp(predictor_temp, PredictorNames[i])) break;
+        
+        if (i == kPredictorTypeCount)
+            printf("Warning: Unknown branch predictor '%s'.\n", predictor_temp);
+        else
+            _predictor_type = i;
+    }
+    
+    // A list of stages takes precedence over just a number of them
+    reg_t stages = kDefaultPipelineStages;
+    lua->getGlobalField("stages", kLUInt, &stages);
+    
+    bool listed = false;
+    if (lua->openGlobalTable("pipeline") != kLuaUnexpectedType)
+    {
+        reg_t len = lua->lengthOfCurrentObject();
+        bool valid = (len <= kMaxPipelineStages);
+        
+        // Remember lua lists are ONE-INDEXED
+        for (int i = 1; valid && i < len + 1; i++)
+        {
+            const char *name = NULL;
+            lua->getTableField(i, kLString, &name);
+            
+            int k = 0;
+            for (; name && k < kStageKindCount; k++)
+                if (!strcmp(name, PipelineStageNames[k])) break;
+            
+            if (!name || k == kStageKindCount)
+            {
+                printf("Warning: Unknown pipeline stage '%s'.\n",
+                    name ? name : "");
+                valid = false;
+            } else {
+                _pipe_layout[i - 1] = k;
+            }
+        }
+        
+        lua->closeTable();
+        
+        if (valid && !checkPipelineLayout(_pipe_layout, len))
+        {
+            stages = len;
+            listed = true;
+        } else {
+            printf("Warning: Unsupported pipeline layout.\n");
+        }
+    }
+    
+    // Otherwise only the classic pipes are supported
+    if (!listed)
+    {
+        if (stages != 1 && stages != 4 && stages != 5)
+        {
+            printf("Warning: Unsupported pipeline length %u.\n", stages);
+            stages = kDefaultPipelineStages;
+        }
+        
+        // Fetch, decode, execute, memory and maybe writeback
+        for (int i = 0; i < stages; i++)
+            _pipe_layout[i] = i;
+    }
+    _pipe_stages = stages;
+    
+    // Superscalar issue, which defaults to one of each unit per slot
+    issue.width = 1;
+    lua->getGlobalField("issue_width", kLUInt, &issue.width);
+    if (issue.width > kMaxIssueWidth)
+    {
+        printf("Warning: Unsupported issue width %u.\n", issue.width);
+        issue.width = kMaxIssueWidth;
+    }
     
-    // Error check pipe stages
-    if (_pipe_stages != 1 && _pipe_stages != 4 && _pipe_stages != 5)
+    for (int i = 0; i < kIssueUnitCount; i++)
+        issue.units[i] = 0;
+    
+    if (lua->openGlobalTable("issue_units") != kLuaUnexpectedType)
+    {
+        for (int i = 0; i < kIssueUnitCount; i++)
+            lua->getTableField(IssueUnitNames[i], kLUInt, &issue.units[i]);
+        
+        lua->closeTable();
+    }
+    
+    // Out of order timing model
+    lua->getGlobalField("ooo_model", kLBool, &_ooo_model);
+    if (lua->openGlobalTable("ooo_core") != kLuaUnexpectedType)
+    {
+        for (int i = 0; i < kOOOParameterCount; i++)
+        {
+            lua->getTableField(OOOParameterNames[i], kLUInt,
+                &ooo_desc.value[i]);
+        }
+        
+        lua->closeTable();
+    }
+    
+    // Sampled simulation
+    lua->getGlobalField("sampling", kLBool, &_sampling);
+    if (lua->openGlobalTable("sample") != kLuaUnexpectedType)
+    {
+        for (int i = 0; i < kSampleParameterCount; i++)
+        {
+            lua->getTableField(SampleParameterNames[i], kLUInt,
+                &sample_desc.value[i]);
+        }
+        
+        lua->closeTable();
+    }
+    
+    // Profiling, and checkpoints of what it picked
+    const char *bbv_temp = NULL, *points_temp = NULL, *prefix_temp = NULL;
+    const char *ckpt_temp = NULL;
+    lua->getGlobalField("bbv_file", kLString, &bbv_temp);
+    lua->getGlobalField("bbv_interval", kLUInt, &_bbv_interval);
+    lua->getGlobalField("simpoints", kLString, &points_temp);
+    lua->getGlobalField("checkpoint_intervals", kLBool, &_checkpoint_all);
+    lua->getGlobalField("interval_warmup", kLUInt, &_interval_warmup);
+    lua->getGlobalField("checkpoint_prefix", kLString, &prefix_temp);
+    lua->getGlobalField("checkpoint", kLString, &ckpt_temp);
+    lua->getGlobalField("instruction_limit", kLUInt, &_instruction_limit);
+    
+    if ((bbv_temp || points_temp || _checkpoint_all) && _sampling)
     {
-        printf("Warning: Unsupported pipeline length %u.\n", _pipe_stages);
-        _pipe_stages = kDefaultPipelineStages;
+        printf("Warning: Sampling is turned off while profiling.\n");
+        _sampling = false;
     }
     
     // Deal with ALU timings
@@ -332,21 +658,193 @@ bool VirtualMachine::configure(const char *c_path, ALUTimings &at)
         // User defined the table, so pull all the ops out of it
         for (int i = 0; i < kDPOpcodeCount; i++)
             lua->getTableField(DPOpMnumonics[i], kLUInt, (void *) &at.op[i]);
+        for (int i = kDPOpcodeCount; i < kALUTimingCount; i++)
+            lua->getTableField(MultiplyTimingNames[i - kDPOpcodeCount],
+                kLUInt, (void *) &at.op[i]);
         
         // Clean up
         lua->closeTable();
     }
     
+    // FPU timings, by mnemonic as well
+    if (lua->openGlobalTable("fpu_timings") != kLuaUnexpectedType)
+    {
+        for (int i = 0; i < kFPOpcodeCount; i++)
+            if (FPOpMnemonics[i])
+                lua->getTableField(FPOpMnemonics[i], kLUInt, &ft.op[i]);
+        
+        lua->closeTable();
+    }
+    
+    if (lua->openGlobalTable("fpu_pipelined") != kLuaUnexpectedType)
+    {
+        for (int i = 0; i < kFPOpcodeCount; i++)
+            if (FPOpMnemonics[i])
+                lua->getTableField(FPOpMnemonics[i], kLBool,
+                    &ft.pipelined[i]);
+        
+        lua->closeTable();
+    }
+    
+    // Packed op timings, by mnemonic without the lane size
+    if (lua->openGlobalTable("simd_timings") != kLuaUnexpectedType)
+    {
+        for (int i = 0; i < kSIMDOpcodeCount; i++)
+            if (SIMDOpMnemonics[i])
+                lua->getTableField(SIMDOpMnemonics[i], kLUInt, &st.op[i]);
+        
+        lua->closeTable();
+    }
+    
+    // Host handlers cost what they're given here, by name
+    if (lua->openGlobalTable("interrupt_costs") != kLuaUnexpectedType)
+    {
+        for (int i = 0; i < kHostInterruptCount; i++)
+            lua->getTableField(HostInterruptNames[i], kLUInt, &_int_costs[i]);
+        
+        lua->closeTable();
+    }
+    
+    // A binary interrupt table wins over one described here
+    const char *int_temp = NULL;
+    lua->getGlobalField("interrupt_table", kLString, &int_temp);
+    if (int_temp)
+    {
+        _int_table_file = (char *)malloc(sizeof(char) * strlen(int_temp) + 1);
+        strcpy(_int_table_file, int_temp);
+    } else if (lua->openGlobalTable("interrupts") != kLuaUnexpectedType) {
+        // Each entry is the name of a host handler or a list of words
+        _int_count = lua->lengthOfCurrentObject();
+        _int_desc = (InterruptDescription *) calloc(_int_count,
+            sizeof(InterruptDescription));
+        
+        for (int i = 1; i < _int_count + 1 && _int_desc; i++)
+        {
+            const char *name = NULL;
+            if (lua->getTableField(i, kLString, &name) == kLuaNoError)
+            {
+                strncpy(_int_desc[i-1].handler, name, kMaxHandlerName - 1);
+                continue;
+            }
+            
+            if (lua->openTableAtTableIndex(i) == kLuaUnexpectedType)
+            {
+                fprintf(stderr, "Improper interrupt table format.\n");
+                freeInterruptDescription();
+                break;
+            }
+            
+            reg_t len = lua->lengthOfCurrentObject();
+            _int_desc[i-1].code = (reg_t *)malloc(sizeof(reg_t) * len);
+            _int_desc[i-1].length = len;
+            
+            int err = kLuaNoError;
+            for (int j = 1; j < len + 1; j++)
+                err += lua->getTableField(j, kLUInt, &_int_desc[i-1].code[j-1]);
+            
+            lua->closeTable();
+            
+            if (err != kLuaNoError)
+            {
+                fprintf(stderr, "Interrupt %i value error.\n", i - 1);
+                freeInterruptDescription();
+                break;
+            }
+        }
+        
+        lua->closeTable();
+    }
+    
+    // Memory mapped devices, each {kind, base address, cycles per access}
+    if (lua->openGlobalTable("devices") != kLuaUnexpectedType)
+    {
+        size_t len = lua->lengthOfCurrentObject();
+        for (int i = 1; i < len + 1; i++)
+        {
+            if (lua->openTableAtTableIndex(i) == kLuaUnexpectedType)
+            {
+                fprintf(stderr, "Improper device table format.\n");
+                break;
+            }
+            
+            const char *kind = NULL;
+            reg_t base = 0;
+            cycle_t latency = 0;
+            lua->getTableField(1, kLString, &kind);
+            lua->getTableField(2, kLUInt, &base);
+            lua->getTableField(3, kLUInt, &latency);
+            
+            int k = 0;
+            while (k < kDeviceKindCount &&
+                (!kind || strcmp(kind, DeviceKindNames[k])))
+                k++;
+            
+            lua->closeTable();
+            
+            // They have to be past the end of memory
+            if (k == kDeviceKindCount || base < _mem_size)
+            {
+                fprintf(stderr, "Device %i is unknown or inside memory.\n", i);
+                continue;
+            }
+            
+            _device_base[k] = base;
+            _device_latency[k] = latency;
+        }
+        
+        lua->closeTable();
+    }
+    
+    // What the disk is, and how fast
+    const char *disk_temp = NULL;
+    lua->getGlobalField("disk_image", kLString, &disk_temp);
+    lua->getGlobalField("disk_seek_cycles", kLUInt, &_disk_seek);
+    lua->getGlobalField("disk_bandwidth", kLUInt, &_disk_bandwidth);
+    lua->getGlobalField("disk_interrupt", kLUInt, &_disk_interrupt);
+    lua->getGlobalField("dma_interrupt", kLUInt, &_dma_interrupt);
+    if (disk_temp)
+    {
+        _disk_image = (char *)malloc(sizeof(char) * strlen(disk_temp) + 1);
+        strcpy(_disk_image, disk_temp);
+    } else if (_device_base[kDeviceDisk]) {
+        fprintf(stderr, "The disk needs a disk_image.\n");
+        _device_base[kDeviceDisk] = 0;
+    }
+    
     // Copy strings, because they wont exist after we free the lua VM
     _program_file = (char *)malloc(sizeof(char) * strlen(prog_temp) + 1);
     strcpy(_program_file, prog_temp);
     _dump_file = (char *)malloc(sizeof(char) * strlen(dump_temp) + 1);
     strcpy(_dump_file, dump_temp);
     
+    if (bbv_temp)
+    {
+        _bbv_file = (char *)malloc(sizeof(char) * strlen(bbv_temp) + 1);
+        strcpy(_bbv_file, bbv_temp);
+    }
+    
+    if (points_temp)
+    {
+        _simpoints_file = (char *)malloc(sizeof(char) *
+            strlen(points_temp) + 1);
+        strcpy(_simpoints_file, points_temp);
+    }
+    
+    // Checkpoints are named after the program unless told otherwise
+    if (!prefix_temp) prefix_temp = prog_temp;
+    _checkpoint_prefix = (char *)malloc(sizeof(char) * strlen(prefix_temp) + 1);
+    strcpy(_checkpoint_prefix, prefix_temp);
+    
+    if (ckpt_temp)
+    {
+        _checkpoint_file = (char *)malloc(sizeof(char) * strlen(ckpt_temp) + 1);
+        strcpy(_checkpoint_file, ckpt_temp);
+    }
+    
     // Get breakpoint count
     lua->getGlobalField("break_count", kLUInt, &_breakpoint_count);
-    // Allocate memory to hold them all
-    _breakpoints = (reg_t *)malloc(sizeof(reg_t) * _breakpoint_count);
+    // Allocate memory to hold them all, empty ones are 0
+    _breakpoints = (reg_t *)calloc(_breakpoint_count, sizeof(reg_t));
     if (lua->openGlobalTable("breakpoints") != kLuaUnexpectedType)
     {
         // Pull all the values out of it
@@ -369,8 +867,9 @@ bool VirtualMachine::configure(const char *c_path, ALUTimings &at)
         size_t len = lua->lengthOfCurrentObject();
         if (len)
         {
-            _cache_desc = (CacheDescription *) malloc(
-                sizeof(CacheDescription) * len);
+            // Zeroed, since the times are wider than what lua fills in
+            _cache_desc = (CacheDescription *) calloc(len,
+                sizeof(CacheDescription));
             
             for (int i = 1; i < len+1; i++)
             {
@@ -426,35 +925,80 @@ bool VirtualMachine::configure(const char *c_path, ALUTimings &at)
     return (false);
 }
 
+void VirtualMachine::freeInterruptDescription()
+{
+    if (!_int_desc) return;
+    
+    for (reg_t i = 0; i < _int_count; i++)
+        if (_int_desc[i].code) free(_int_desc[i].code);
+    
+    free(_int_desc);
+    _int_desc = NULL;
+    _int_count = 0;
+}
+
 void VirtualMachine::setMachineDefaults()
 {
     // Most stuff gets set to zero
     _print_instruction = false;
     _print_branch_offset = false;
     _cycle_count = 0;
+    _skipped_cycles = 0;
     _pc = 0;
+    _ir = 0;
     _fpsr = 0;
+    supervisor = false;
     _length_trap = 0;
     _cycle_trap = 0;
+    _next_event = kNoEvent;
+    _irq_pending = false;
+    _irq = 0;
+    _timer_irq = 0;
+    _timer_event = 0;
+    _swint_cycles = 0;
+    for (int i = 0; i < kHostInterruptCount; i++)
+        _int_costs[i] = 0;
+    for (int i = 0; i < kDeviceKindCount; i++)
+    {
+        _device_base[i] = 0;
+        _device_latency[i] = 0;
+    }
+    _disk_seek = 0;
+    _disk_bandwidth = 0;
+    _disk_interrupt = kNoDeviceInterrupt;
+    _dma_interrupt = kNoDeviceInterrupt;
     _debug_cache = false;
+    _predictor_type = kPredictNone;
+    _bypass_ex = false;
+    _bypass_mem = false;
+    _bypassing = false;
+    _ooo_model = false;
+    _sampling = false;
+    _bbv_interval = 0;
+    _interval_warmup = 0;
+    _instruction_limit = 0;
+    _checkpoint_all = false;
+    _measuring = false;
+    _fast_forwarding = false;
+    _instructions = 0;
+    _warmup_instructions = 0;
+    _predictor_bits = 0;
+    _btb_entries = 0;
+    _ras_depth = 0;
     
     // Others have "hardcoded" defaults
     _breakpoint_count = kDefaultBreakCount;
+    _monitor_port = DEFAULT_PORT;
+    _sweep_point = NULL;
     _branch_cycles = kDefaultBranchCycles;
     _psr = kPSRDefault;
 }
 
-bool VirtualMachine::init(const char *config)
+bool VirtualMachine::init(const char *config, const char *checkpoint,
+    const char *program, const SweepPoint *point)
 {
-    // Initialize server_mutex for MonitorServer
-    pthread_mutex_init(&server_mutex, NULL);
-    
-    // Initialize command and status server
-    ms = new MonitorServer(this);
-    if (ms->init())
-        return (true);
-    if (ms->run())
-        return (true);
+    // A machine can be used again for another run
+    release();
     
     // Initialize actual machine
     printf("Initializing virtual machine: ");
@@ -464,33 +1008,176 @@ bool VirtualMachine::init(const char *config)
     setMachineDefaults();
     
     // Configure the VM using the config file
+    _sweep_point = point;
     ALUTimings _aluTiming;
-    if (configure(config, _aluTiming))
+    FPUTimings _fpuTiming;
+    SIMDTimings _simdTiming;
+    IssueDescription _issue;
+    OOODescription _oooDesc;
+    SampleDescription _sampleDesc;
+    if (configure(config, _aluTiming, _fpuTiming, _simdTiming, _issue,
+        _oooDesc, _sampleDesc))
     {
         fprintf(stderr, "VM configuration failed.\n");
         return (true);
     }
     
+    // Initialize command and status server, unless nobody is going to use it
+    if (_interactive && _monitor_port && !ms)
+    {
+        ms = new MonitorServer(this, _monitor_port);
+        if (ms->init())
+            return (true);
+        if (ms->run())
+            return (true);
+    }
+    
+    // The same config can be run over many programs
+    if (program)
+    {
+        if (_program_file) free(_program_file);
+        _program_file = (char *)malloc(sizeof(char) * strlen(program) + 1);
+        strcpy(_program_file, program);
+    }
+    
+    // A checkpoint given here is an interval to simulate in detail, so it
+    // replaces the config's and there's no profiling
+    if (checkpoint)
+    {
+        if (_checkpoint_file) free(_checkpoint_file);
+        _checkpoint_file = (char *)malloc(sizeof(char) * strlen(checkpoint)
+            + 1);
+        strcpy(_checkpoint_file, checkpoint);
+        
+        if (_bbv_file) free(_bbv_file);
+        if (_simpoints_file) free(_simpoints_file);
+        _bbv_file = NULL;
+        _simpoints_file = NULL;
+        _checkpoint_all = false;
+    }
+    
+    // Anything that happens at a given cycle goes through here, including
+    // giving up on a program that runs too long
+    events = new EventQueue(this);
+    if (events->init()) return (true);
+    if (_cycle_trap) scheduleEvent(_cycle_trap + 1, cycleTrapEvent, NULL);
+    
     // Start up ALU
     alu = new ALU(this);
     if (alu->init(_aluTiming)) return (true);
     
     // Start up FPU
     fpu = new FPU(this);
-    if (fpu->init()) return (true);
+    if (fpu->init(_fpuTiming)) return (true);
+    
+    // Start up the packed unit
+    simd = new SIMDUnit(this);
+    if (simd->init(_simdTiming)) return (true);
     
     // Init memory
     mmu = new MMU(this, _mem_size, _read_cycles, _write_cycles);
-    if (mmu->init(_caches, _cache_desc)) return (true);
+    if (_spare_memory && _spare_size == _mem_size && !_first)
+        mmu->reuse(_spare_memory);
+    else if (_spare_memory)
+        free(_spare_memory);
+    _spare_memory = NULL;
+    if (mmu->init(_caches, _cache_desc, _first ? _first->mmu : NULL,
+        _shared_cache))
+        return (true);
+    if (_coherence && mmu->cohere(_coherence, _core)) return (true);
+    
+    // Devices go on the bus above memory
+    if (_device_base[kDeviceUART] || _device_base[kDeviceCounter] ||
+        _device_base[kDeviceDisk] || _device_base[kDeviceDMA])
+    {
+        printf("Attaching devices... ");
+        bool err = false;
+        
+        if (_device_base[kDeviceUART])
+        {
+            uart = new UART();
+            err |= mmu->bus()->attach(DeviceKindNames[kDeviceUART],
+                _device_base[kDeviceUART], kUARTSize,
+                _device_latency[kDeviceUART], uart, UART::read, UART::write);
+        }
+        
+        if (_device_base[kDeviceCounter])
+        {
+            counter = new CycleCounter(this);
+            err |= mmu->bus()->attach(DeviceKindNames[kDeviceCounter],
+                _device_base[kDeviceCounter], kCounterSize,
+                _device_latency[kDeviceCounter], counter, CycleCounter::read,
+                CycleCounter::write);
+        }
+        
+        if (_device_base[kDeviceDisk])
+        {
+            disk = new BlockDevice(this, _disk_seek, _disk_bandwidth,
+                _disk_interrupt);
+            err |= disk->init(_disk_image);
+            err |= mmu->bus()->attach(DeviceKindNames[kDeviceDisk],
+                _device_base[kDeviceDisk], kDiskSize,
+                _device_latency[kDeviceDisk], disk, BlockDevice::read,
+                BlockDevice::write);
+        }
+        
+        if (_device_base[kDeviceDMA])
+        {
+            dma = new DMAEngine(this, mmu, _dma_interrupt);
+            err |= mmu->bus()->attach(DeviceKindNames[kDeviceDMA],
+                _device_base[kDeviceDMA], kDMASize,
+                _device_latency[kDeviceDMA], dma, DMAEngine::read,
+                DMAEngine::write);
+        }
+        
+        if (err) return (true);
+        printf("Done.\n");
+    }
     
     // Init instruction pipeline
-    pipe = new InstructionPipeline(_pipe_stages, this);
+    pipe = new InstructionPipeline(_pipe_stages, _issue, this);
     if (pipe->init()) return (true);
     if (configurePipeline()) return (true);
     
+    // Init branch prediction for fetch
+    predictor = new BranchPredictor(_predictor_type, _predictor_bits,
+        _btb_entries, _ras_depth);
+    if (predictor->init()) return (true);
+    
+    // The out of order model just watches what the pipeline retires
+    if (_ooo_model)
+    {
+        ooo = new OutOfOrderCore(_oooDesc, _issue);
+        if (ooo->init()) return (true);
+    }
+    
+    // Sampling fast forwards through most of the program one instruction at
+    // a time, outside the pipe
+    if (_sampling)
+    {
+        sampler = new Sampler(_sampleDesc, _caches);
+        if (sampler->init()) return (true);
+    }
+    
+    // So does profiling, all the way through
+    if (_bbv_file || _simpoints_file || _checkpoint_all)
+    {
+        profiler = new Profiler(_bbv_interval, _interval_warmup,
+            _checkpoint_all, _bbv_file, _simpoints_file);
+        if (profiler->init()) return (true);
+    }
+    
+    // and so does warming up from a checkpoint
+    if (sampler || profiler || _checkpoint_file)
+    {
+        _functional = new PipelineData();
+        _functional->clear();
+    }
+    
     // Load interrupt controller
     icu = new InterruptController(this, _swint_cycles);
-    icu->init();
+    if (icu->init(_int_desc, _int_count, _int_table_file, _int_costs))
+        return (true);
     
     // Create initial sane environment
     resetGeneralRegisters();
@@ -502,7 +1189,12 @@ bool VirtualMachine::init(const char *config)
     // TODO: Make the OS load the program image through an interrupt
     // run(true);
     // Load program right after function table
-    loadProgramImage(_program_file, _int_table_size + _int_function_size);
+    if (loadProgramImage(_program_file, _int_table_size + _int_function_size))
+        return (true);
+    
+    // A checkpoint picks up where the program was when it was taken
+    if (_checkpoint_file && restoreCheckpoint(_checkpoint_file))
+        return (true);
     
     // Relocate breakpoints now that we have our environment loaded
     relocateBreakpoints();
@@ -517,18 +1209,20 @@ bool VirtualMachine::init(const char *config)
 // Evaluate a destructive client operation, like write word
 void VirtualMachine::eval(char *op)
 {
-    // We need to parse arguments
-    char *pch = strtok(op, " ");
+    // We need to parse arguments, without strtok's state that every
+    // machine in the process would share
+    char *save;
+    char *pch = strtok_r(op, " ", &save);
     if (strcmp(pch, kWriteCommand) == 0)
     {
         int addr, val;
-        pch = strtok(NULL, " ");
+        pch = strtok_r(NULL, " ", &save);
         if (pch)
             addr = atoi(pch);
         else
             addr = 0;
         
-        pch = strtok(NULL, " ");
+        pch = strtok_r(NULL, " ", &save);
         if (pch)
             val = _hex_to_int(pch);
         else
@@ -543,7 +1237,7 @@ void VirtualMachine::eval(char *op)
         return;
     } else if (strcmp(pch, kExecCommand) == 0) {
         /*reg_t instruction;
-        pch = strtok(NULL, " ");
+        pch = strtok_r(NULL, " ", &save);
         
         if (pch)
             instruction = (reg_t) _hex_to_int(pch);
@@ -571,7 +1265,7 @@ void VirtualMachine::statusStruct(MachineStatus &s)
     // Populate status struct
     s.type = kStatusMessage;
     s.supervisor = supervisor ? 1 : 0;
-    s.cycles = _cycle_count;
+    s.cycles = detailedCycles();
     s.psr = _psr;
     s.pc = _pc;
     s.ir = _ir;
@@ -604,7 +1298,8 @@ char *VirtualMachine::statusString(size_t &len)
         sprintf(temp+strlen(temp), "Supervisor mode\n");
     else
         sprintf(temp+strlen(temp), "User mode\n");
-    sprintf(temp+strlen(temp),  "Cycle Count: %lu\n", _cycle_count);
+    sprintf(temp+strlen(temp),  "Cycle Count: %lu\n",
+        detailedCycles());
     sprintf(temp+strlen(temp),  "Program Status Register: %#x\n", _psr);
     sprintf(temp+strlen(temp),  "N: %s V: %s C: %s Z: %s\n", N_SET ? "1" : "0",
         V_SET ? "1" : "0", C_SET ? "1" : "0", Z_SET ? "1" : "0");
@@ -622,17 +1317,21 @@ char *VirtualMachine::statusString(size_t &len)
         "r8 - %u r9 - %u r10 - %u r11 - %u\n", _r[8], _r[9], _r[10], _r[11]);
     sprintf(temp+strlen(temp),  
         "r12 - %u r13 - %u r14 - %u r15 - %u\n", _r[12], _r[13], _r[14], _r[15]);
-    sprintf(temp+strlen(temp), "fpr0 - %f fpr1 - %f fpr2 - %f fpr3 - %f\n",
-        (float)_fpr[0], (float)_fpr[1], (float)_fpr[2], (float)_fpr[3]);
-    sprintf(temp+strlen(temp), "fpr4 - %f fpr5 - %f fpr6 - %f fpr7 - %f\n",
-        (float)_fpr[4], (float)_fpr[5], (float)_fpr[6], (float)_fpr[7]);
-
+    sprintf(temp+strlen(temp), "fpr0 - %g fpr1 - %g fpr2 - %g fpr3 - %g\n",
+        FPU::toFloat(_fpr[0]), FPU::toFloat(_fpr[1]), FPU::toFloat(_fpr[2]),
+        FPU::toFloat(_fpr[3]));
+    sprintf(temp+strlen(temp), "fpr4 - %g fpr5 - %g fpr6 - %g fpr7 - %g\n",
+        FPU::toFloat(_fpr[4]), FPU::toFloat(_fpr[5]), FPU::toFloat(_fpr[6]),
+        FPU::toFloat(_fpr[7]));
+    sprintf(temp+strlen(temp), "Floating Point Status Register: %#x\n", _fpsr);
+    
+    // Deep and wide pipes don't fit in temp, so size this one to the state
     char *pipeStatus = pipe->stateString();
-    sprintf(temp+strlen(temp),"Pipeline State:\n%s", pipeStatus);
+    char *ret = (char *)malloc(sizeof(char) * (strlen(temp) +
+        strlen(pipeStatus) + 32));
+    sprintf(ret, "%sPipeline State:\n%s", temp, pipeStatus);
     free(pipeStatus);
     
-    char *ret = (char *)malloc(sizeof(char) * strlen(temp) + 1);
-    strcpy(ret, temp);
     len = strlen(ret);
     return (ret);
 }
@@ -649,7 +1348,7 @@ void VirtualMachine::trap(const char *error)
 void VirtualMachine::waitForClientInput()
 {
     // Is the server even running?
-    if (!ms->isRunning()) return;
+    if (!ms || !ms->isRunning()) return;
     
     // Busy wait for the other thread to initialize and aquire the lock before
     // we go tosleep on it.  If we get this lock before the other thread starts
@@ -686,51 +1385,118 @@ void VirtualMachine::step()
     pipe->step();
 }
 
+bool VirtualMachine::checkPipelineLayout(char *layout, reg_t stages)
+{
+    // Every part of the pipe has to be there, in order, though writeback
+    // can be left to the stage that computes the result
+    if (stages < kStageWriteBack || layout[0] != kStageFetch)
+        return (true);
+    
+    for (int i = 1; i < stages; i++)
+        if (layout[i] < layout[i - 1] || layout[i] > layout[i - 1] + 1)
+            return (true);
+    
+    if (layout[stages - 1] < kStageMemory)
+        return (true);
+    
+    // Without writeback, loads would be written after younger ops that
+    // had already been written in execute
+    if (layout[stages - 1] == kStageMemory &&
+        layout[stages - 2] == kStageMemory)
+        return (true);
+    
+    return (false);
+}
+
 bool VirtualMachine::configurePipeline()
 {
     printf("Configuring ");
-    switch (_pipe_stages)
+    
+    if (_pipe_stages == 1)
     {
-        case 1:
         printf("single stage pipeline... ");
         if (pipe->registerStage(&VirtualMachine::doInstruction))
             return (true);
+        pipe->setIssueStage(0);
         _forwarding = true;
-        break;
+        _bypass_ex = false;
+        _bypass_mem = false;
+        printf("Done.\n");
+        return (false);
+    }
+    
+    // Without a writeback stage results are committed as soon as they are
+    // computed, so there's nothing for a bypass network to do
+    _forwarding = (_pipe_layout[_pipe_stages - 1] != kStageWriteBack);
+    if (_forwarding)
+    {
+        _bypass_ex = false;
+        _bypass_mem = false;
+    }
+    _bypassing = _bypass_ex || _bypass_mem;
+    
+    printf("%u stage pipeline", _pipe_stages);
+    if (_forwarding) printf(" (forwarding)");
+    if (_bypass_ex) printf(" (EX->EX bypass)");
+    if (_bypass_mem) printf(" (MEM->EX bypass)");
+    printf("... ");
+    
+    for (int i = 0; i < _pipe_stages; i++)
+    {
+        char kind = _pipe_layout[i];
+        bool first = (i == 0 || _pipe_layout[i - 1] != kind);
+        bool last = (i == _pipe_stages - 1 || _pipe_layout[i + 1] != kind);
+        
+        // A split stage does its work once and holds the instruction for
+        // the rest.  Fetch goes first so that redirects aren't delayed,
+        // everything else goes last so its results are as late as possible.
+        pipeFunc func = &VirtualMachine::delayInstruction;
+        switch (kind)
+        {
+            case kStageFetch:
+            if (first) func = &VirtualMachine::fetchInstruction;
+            break;
+            
+            case kStageDecode:
+            if (last) func = &VirtualMachine::decodeInstruction;
+            break;
+            
+            case kStageExecute:
+            if (last) func = &VirtualMachine::executeInstruction;
+            break;
+            
+            case kStageMemory:
+            if (last) func = &VirtualMachine::memoryAccess;
+            break;
+            
+            case kStageWriteBack:
+            default:
+            if (last) func = &VirtualMachine::writeBack;
+            break;
+        }
         
-        case 5:
-        printf("five stage pipeline... ");
-        if (pipe->registerStage(&VirtualMachine::fetchInstruction))
-            return (true);
-        if (pipe->registerStage(&VirtualMachine::decodeInstruction))
+        if (pipe->registerStage(func))
             return (true);
-        if (pipe->registerStage(&VirtualMachine::executeInstruction))
-            return (true);
-        if (pipe->registerStage(&VirtualMachine::memoryAccess))
-            return (true);
-        if (pipe->registerStage(&VirtualMachine::writeBack))
-            return (true);
-        _forwarding = false;
-        break;
         
-        case 4:
-        default:
-        printf("four stage pipeline (forwarding)... ");
-        if (pipe->registerStage(&VirtualMachine::fetchInstruction))
-            return (true);
-        if (pipe->registerStage(&VirtualMachine::decodeInstruction))
-            return (true);
-        if (pipe->registerStage(&VirtualMachine::executeInstruction))
-            return (true);
-        if (pipe->registerStage(&VirtualMachine::memoryAccess))
-            return (true);
-        _forwarding = true;
-        break;
+        // Instructions issue on their way out of decode
+        if (kind == kStageDecode && last)
+            pipe->setIssueStage(i);
     }
+    
     printf("Done.\n");
     return (false);
 }
 
+bool VirtualMachine::benchmarkALU(reg_t ops)
+{
+    // Operands for the ops to read, none of them zero
+    srand(1);
+    for (int i = 0; i < kGeneralRegisters; i++)
+        _r[i] = rand() | kOne;
+    
+    return (alu->benchmark(ops));
+}
+
 void VirtualMachine::run()
 {
     printf("Starting execution at %#x\n", _pc);
@@ -741,6 +1507,10 @@ void VirtualMachine::run()
         // Check breakpoints on the CURRENT instruction, that is, before
         // advancing the pipeline
         reg_t loc = pipe->locationToExecute();
+        bool fast = (sampler && sampler->phase() == kSampleFastForward);
+        if (profiler || _instructions < _warmup_instructions) fast = true;
+        if (!fast && !_measuring) startMeasuring();
+        if (fast) loc = _pc;
         for (int i = 0; i < _breakpoint_count; i++)
         {
             if (_breakpoints[i] == loc && loc != 0x0)
@@ -762,10 +1532,29 @@ void VirtualMachine::run()
             }
         }
         
+        // Sampled runs skip most of the program outside the pipe, and
+        // profiled ones all of it
+        if (fast)
+        {
+            size_t interval;
+            if (profiler && profiler->checkpointDue(interval))
+                saveCheckpoint(interval);
+            
+            fastForward();
+            continue;
+        }
+        
         if(pipe->cycle())
             trap("Pipeline exception.\n");
+        
+        if (sampler) sample();
     }
     
+    finish();
+    
+    // Batch runs, and machines nobody can talk to, are done here
+    if (!_interactive || !ms) return;
+    
     // Idle and only close server after SIGINT
     while (!terminate)
         waitForClientInput();
@@ -773,6 +1562,218 @@ void VirtualMachine::run()
     printf("Exiting...\n");
 }
 
+void VirtualMachine::joinSystem(reg_t core, reg_t cores,
+    VirtualMachine *first, CoherenceBus *bus, bool shared_cache)
+{
+    _core = core;
+    _cores = cores;
+    _first = first;
+    _coherence = bus;
+    _shared_cache = shared_cache;
+}
+
+bool VirtualMachine::cycle()
+{
+    if (!fex) return (true);
+    
+    // Cores are always simulated in detail
+    if (!_measuring) startMeasuring();
+    if (pipe->cycle())
+        trap("Pipeline exception.\n");
+    
+    return (!fex);
+}
+
+void VirtualMachine::finish()
+{
+    if (uart) uart->flush();
+    if (profiler) profiler->finish();
+    printStatistics();
+}
+
+void VirtualMachine::printStatistics()
+{
+    cycle_t cycles = detailedCycles();
+    printf("Execution halted after %lu cycles.\n", cycles);
+    printf("Retired %lu instructions (IPC %.3f).\n", pipe->retired(),
+        cycles ? (double)pipe->retired() / cycles : 0.0);
+    pipe->printStatistics();
+    predictor->printStatistics();
+    if (ooo) ooo->printStatistics();
+    if (sampler) sampler->printStatistics(pipe->retired());
+    if (profiler) profiler->printStatistics();
+    if (dma) dma->printStatistics();
+}
+
+void VirtualMachine::fastForward()
+{
+    // Run the next instruction functionally.  It still goes through the
+    // caches and the predictor, which keeps them warm, but none of it is
+    // measured, and what the predictor and the pipe count is only what the
+    // detailed windows did.  The clock still moves, by what the instruction
+    // took on its own, so events fire when they were due.
+    cycle_t start = _cycle_count;
+    _fast_forwarding = true;
+    predictor->account(false);
+    pipe->account(false);
+    
+    _functional->clear();
+    doInstruction(_functional);
+    if (!_forwarding) writeBack(_functional);
+    
+    predictor->account(true);
+    pipe->account(true);
+    _fast_forwarding = false;
+    _skipped_cycles += _cycle_count - start;
+    if (sampler) sampler->fastForward(pipe->retired());
+}
+
+void VirtualMachine::sample()
+{
+    sampler->cycle(pipe->retired(), detailedCycles(), mmu);
+    if (sampler->phase() != kSampleDraining) return;
+    
+    // Let everything in flight finish before fast forwarding again, so that
+    // it starts from exactly where the pipe left off
+    pipe->drain(true);
+    if (!pipe->isEmpty()) return;
+    
+    pipe->drain(false);
+    sampler->drained();
+}
+
+void VirtualMachine::retire(PipelineData *d, bool mispredicted)
+{
+    // The out of order model only times what the pipe ran in detail
+    if (ooo && !_fast_forwarding) ooo->commit(d, mispredicted);
+    if (profiler) profiler->retire(d);
+    
+    // Stop after a fixed number of instructions, say to run a single
+    // interval from a checkpoint
+    _instructions++;
+    if (_instruction_limit && _instructions >= _instruction_limit)
+        fex = false;
+}
+
+bool VirtualMachine::saveCheckpoint(size_t interval)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s.%lu.ckpt", _checkpoint_prefix, interval);
+    
+    FILE *f = fopen(path, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "Could not write checkpoint '%s'.\n", path);
+        return (true);
+    }
+    
+    printf("Writing checkpoint '%s'... ", path);
+    
+    CheckpointHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = kCheckpointMagic;
+    h.version = kCheckpointVersion;
+    memcpy(h.r, _r, sizeof(_r));
+    memcpy(h.pq, _pq, sizeof(_pq));
+    memcpy(h.fpr, _fpr, sizeof(_fpr));
+    h.pc = _pc; h.cs = _cs; h.ds = _ds; h.ss = _ss;
+    h.psr = _psr;
+    h.fpsr = _fpsr;
+    h.supervisor = supervisor;
+    h.memory_size = mmu->memorySize();
+    h.interval = interval;
+    h.interval_length = _bbv_interval;
+    h.instructions = _instructions;
+    
+    bool err = (fwrite(&h, sizeof(h), 1, f) != 1) || mmu->saveImage(f);
+    fclose(f);
+    
+    printf(err ? "write error.\n" : "Done.\n");
+    return (err);
+}
+
+bool VirtualMachine::restoreCheckpoint(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "Could not open checkpoint '%s'.\n", path);
+        return (true);
+    }
+    
+    printf("Restoring checkpoint '%s'... ", path);
+    
+    CheckpointHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != kCheckpointMagic ||
+        h.version != kCheckpointVersion)
+    {
+        printf("not a checkpoint.\n");
+        fclose(f);
+        return (true);
+    }
+    
+    if (mmu->restoreImage(f, h.memory_size))
+    {
+        printf("bad memory image.\n");
+        fclose(f);
+        return (true);
+    }
+    fclose(f);
+    
+    memcpy(_r, h.r, sizeof(_r));
+    memcpy(_pq, h.pq, sizeof(_pq));
+    memcpy(_fpr, h.fpr, sizeof(_fpr));
+    _pc = h.pc; _cs = h.cs; _ds = h.ds; _ss = h.ss;
+    _psr = h.psr;
+    _fpsr = h.fpsr;
+    supervisor = h.supervisor;
+    
+    // It was taken early enough to warm up before the interval, which is
+    // all that runs unless told otherwise
+    size_t start = (size_t)h.interval * h.interval_length;
+    if (start > h.instructions) _warmup_instructions = start - h.instructions;
+    if (!_instruction_limit && h.interval_length)
+        _instruction_limit = _warmup_instructions + h.interval_length;
+    
+    printf("(interval %u, %lu warmup instructions) Done.\n", h.interval,
+        _warmup_instructions);
+    return (false);
+}
+
+void VirtualMachine::startMeasuring()
+{
+    _measuring = true;
+    _measure_start.clear();
+    _measure_start.instructions = pipe->retired();
+    _measure_start.cycles = detailedCycles();
+    
+    _measure_start.caches = mmu->caches();
+    if (_measure_start.caches > kMaxIntervalCaches)
+        _measure_start.caches = kMaxIntervalCaches;
+    for (int i = 0; i < _measure_start.caches; i++)
+    {
+        mmu->cacheStatistics(i, _measure_start.accesses[i],
+            _measure_start.misses[i]);
+    }
+}
+
+void VirtualMachine::measurement(IntervalResult &r)
+{
+    // Everything since the warmup, in detail
+    r.clear();
+    if (!_measuring) return;
+    
+    r.instructions = pipe->retired() - _measure_start.instructions;
+    r.cycles = detailedCycles() - _measure_start.cycles;
+    r.caches = _measure_start.caches;
+    for (int i = 0; i < r.caches; i++)
+    {
+        mmu->cacheStatistics(i, r.accesses[i], r.misses[i]);
+        r.accesses[i] -= _measure_start.accesses[i];
+        r.misses[i] -= _measure_start.misses[i];
+    }
+}
+
 void VirtualMachine::installJumpTable(reg_t *data, reg_t size)
 {
     incCycleCount(mmu->writeBlock(0x0, data, size));
@@ -849,6 +1850,109 @@ reg_t VirtualMachine::deleteBreakpoint(reg_t index)
     return (ret);
 }
 
+char VirtualMachine::branchKind(PipelineData *d)
+{
+    switch (d->instruction_class)
+    {
+        case kBranch:
+        return (d->flags.b.link ? kBranchCall : kBranchDirect);
+        
+        case kDataProcessing:
+        // MUL's rd is the kind of multiply, which never writes the pc
+        if (d->flags.dp.rd != kPCCode || d->flags.dp.op == kMUL) break;
+        // Going back to the link register, usually with an ADD of
+        // kRegSize to step over the call, is a return
+        if (d->flags.dp.rs == kR15Code && (d->flags.dp.op == kADD ||
+            (d->flags.dp.op == kMOV && !d->flags.dp.i)))
+            return (kBranchReturn);
+        return (kBranchIndirect);
+        
+        case kSingleTransfer:
+        if (d->flags.st.l && d->flags.st.rs == kPCCode)
+            return (kBranchIndirect);
+        break;
+        
+        default:
+        break;
+    }
+    
+    return (kNotBranch);
+}
+
+bool VirtualMachine::resolveBranch(PipelineData *d, reg_t target)
+{
+    // Only squash the pipe if fetch didn't already go to target
+    if (!predictor->resolve(d, target, branchKind(d)))
+        return (false);
+    
+    _pc = target;
+    pipe->invalidate();
+    return (true);
+}
+
+void VirtualMachine::forwardResults(PipelineData *d)
+{
+    // Put everything writeback would commit on the bypass network
+    switch (d->instruction_class)
+    {
+        case kDataProcessing:
+        if (!d->record) break;
+        if (d->flags.dp.op == kMUL)
+        {
+            pipe->produce(kPQ0Code, d->output0);
+            pipe->produce(kPQ1Code, d->output1);
+        } else
+            pipe->produce(d->flags.dp.rd, d->output0);
+        break;
+        
+        case kSingleTransfer:
+        if (d->flags.st.l)
+        {
+            if (d->flags.st.w) pipe->produce(d->flags.st.rd, d->output0);
+            pipe->produce(d->flags.st.rs, d->output1);
+        } else if (d->flags.st.w)
+            pipe->produce(d->flags.st.rs, d->output0);
+        break;
+        
+        case kFloatingPoint:
+        if (d->record) pipe->produce(d->flags.fp.s + kFPR0Code, d->output0);
+        break;
+        
+        case kSIMD:
+        pipe->produce(d->flags.p.rd, d->output0);
+        break;
+        
+        case kAtomic:
+        pipe->produce(d->flags.a.rd, d->output0);
+        break;
+        
+        case kBranch:
+        if (d->flags.b.link) pipe->produce(kR15Code, d->location);
+        break;
+        
+        default:
+        break;
+    }
+}
+
+reg_t VirtualMachine::forwardRegister(char reg, reg_t val)
+{
+    // Take the value from an older instruction if it has computed reg but
+    // hasn't written it back yet
+    pipe->forward(reg, val);
+    return (val);
+}
+
+void VirtualMachine::commitRegister(char reg, reg_t val, reg_t &next)
+{
+    // Writes to the pc are jumps, which are resolved against the prediction
+    // instead of being written straight into the fetch address
+    if (reg == kPCCode)
+        next = val;
+    else
+        *(demuxRegID(reg)) = val;
+}
+
 // Five stage pipe (writeback)
 void VirtualMachine::writeBack(PipelineData *d)
 {
@@ -858,8 +1962,17 @@ void VirtualMachine::writeBack(PipelineData *d)
         return;
     }
     
-    // If execute decided not to, there's no unlocking to be done
-    if (!d->executes) return;
+    // Where control should go after this instruction
+    reg_t next = d->location + kRegSize;
+    
+    // If execute decided not to, there's no unlocking to be done, but fetch
+    // may have predicted that this instruction would branch
+    if (!d->executes)
+    {
+        bool wrong = resolveBranch(d, next);
+        retire(d, wrong);
+        return;
+    }
     
     switch (d->instruction_class)
     {
@@ -872,39 +1985,38 @@ void VirtualMachine::writeBack(PipelineData *d)
             _pq[1] = d->output1;
         } else {
             // Else we only have one place to write back to
-            *(demuxRegID(d->flags.dp.rd)) = d->output0;
+            commitRegister(d->flags.dp.rd, d->output0, next);
         }
-        
-        // Make sure to invalidate pipe if we're jumping
-        if (d->flags.dp.rd == kPCCode)
-            pipe->invalidate();
-        
         break;
         
         case kSingleTransfer:
         // writeback to dest register if a load
         if (d->flags.st.l)
         {
-            *(demuxRegID(d->flags.st.rs)) = d->output1;
+            commitRegister(d->flags.st.rs, d->output1, next);
             
             if (d->flags.st.w)
-                *(demuxRegID(d->flags.st.rd)) = d->output0;
+                commitRegister(d->flags.st.rd, d->output0, next);
         } else {
+            // write address back into rs if w == 1
             if (d->flags.st.w)
-                *(demuxRegID(d->flags.st.rs)) = d->output0;
+                commitRegister(d->flags.st.rs, d->output0, next);
         }
+        break;
         
-        // write address back into rs if w == 1
+        case kFloatingPoint:
+        if (d->record) _fpr[d->flags.fp.s] = d->output0;
         
-        // Make sure to invalidate pipe if we're jumping
-        if (d->flags.st.rd == kPCCode)
-            pipe->invalidate();
+        // Exception flags are sticky
+        _fpsr |= d->output1;
+        break;
         
+        case kSIMD:
+        commitRegister(d->flags.p.rd, d->output0, next);
         break;
         
-        case kFloatingPoint:
-        *(demuxRegID(d->flags.fp.s + kFPR0Code)) = d->output0;
-        *(demuxRegID(d->flags.fp.d + kFPR0Code)) = d->output1;
+        case kAtomic:
+        commitRegister(d->flags.a.rd, d->output0, next);
         break;
         
         case kBranch:
@@ -913,27 +2025,36 @@ void VirtualMachine::writeBack(PipelineData *d)
         // Don't jump to a negative offset
         if (_print_branch_offset) printf("BRANCH: %i\n", d->flags.b.offset);
         if (d->flags.b.offset < 0)
-            _pc = 0;
+            next = 0;
         else
-            _pc = d->flags.b.offset;
-        
-        // Invalidate the pipe
-        pipe->invalidate();
+            next = d->flags.b.offset;
         break;
         
         case kInterrupt:
-        // pc is always saved in r15 before branching 
-        _r[15] = d->location;
-        incCycleCount(icu->swint(d->flags.i));
+        // The controller saves the return address if it enters a routine
+        d->latency = icu->swint(d->flags.i, d->location);
+        incCycleCount(d->latency);
         
-        // Invalidate the pipe, we're branching
+        // Interrupts are never predicted, so always invalidate the pipe
         pipe->invalidate();
-        break;
+        retire(d, false);
+        
+        // If that was RETURN, anything raised meanwhile can go now
+        takeInterrupt(_pc);
+        pipe->unlock();
+        return;
         
         default:
         break;
     }
     
+    // Make sure to invalidate pipe if fetch didn't follow us
+    bool wrong = resolveBranch(d, next);
+    retire(d, wrong);
+    
+    // Raised interrupts are taken between instructions, as if an int had
+    // been right after this one
+    takeInterrupt(next);
     pipe->unlock();
 }
 
@@ -947,17 +2068,18 @@ void VirtualMachine::fetchInstruction(PipelineData *d)
     }
     
     // Fetch PC instruction into IR and increment the pc
-    incCycleCount(mmu->readWord(_pc, _ir));
+    d->fetch_latency = mmu->readWord(_pc, _ir);
+    incCycleCount(d->fetch_latency);
     
     // Set metadata
     d->instruction = _ir;
     d->location = _pc;
     
-    // Increment the program counter.
+    // Move the program counter to wherever the predictor thinks we're going.
     // NOTE: The effect of this action being taken here is that the PC
     // always points to the NEXT instruction to be executed, that is
     // the location of the instruction ONE AHEAD of the ir register
-    _pc += kRegSize;
+    _pc = predictor->predict(d);
     
     // Set this up to break out of possibly invalid jumps
     if (_length_trap)
@@ -973,11 +2095,24 @@ void VirtualMachine::decodeInstruction(PipelineData *d)
         return;
     }
     
+    // Decode from the datum, since a wide pipe fetches several at once
+    _ir = d->instruction;
+    
+    // Start over on what the timing models are told about this op
+    d->reads = 0x0;
+    d->writes = 0x0;
+    d->latency = 0;
+    d->memory_latency = 0;
+    
     // Parse the condition code
     // Get the most significant nybble of the instruction by masking
     // then move it from the MSN into the LSN 
     d->condition_code = (_ir & kConditionCodeMask) >> 28;
     
+    // Conditional ops depend on whoever last set the status bits
+    if (d->condition_code != kCondAL)
+        pipe->waitOnRegister(kPSRCode);
+    
     // Parse the Operation Code
     // Test to see if it has a 0 in the first place of the opcode
     if ((_ir & 0x08000000) == 0x0)
@@ -998,8 +2133,18 @@ void VirtualMachine::decodeInstruction(PipelineData *d)
             d->flags.st.rd = (_ir & kSTDestMask) >> 10;
             d->flags.st.offset = (_ir & kSTOffsetMask);
             
-            // wait on the source register
-            pipe->waitOnRegister(d->flags.st.rs);
+            // wait on the base register (rd for loads, rs for stores) and
+            // the register a store takes its value from
+            pipe->waitOnRegister(d->flags.st.l ? d->flags.st.rd : d->flags.st.rs);
+            if (!d->flags.st.l)
+                pipe->waitOnRegister(d->flags.st.rd);
+            
+            // and reserve what writeback will change
+            if (d->flags.st.l)
+                pipe->reserveRegister(d->flags.st.rs);
+            if (d->flags.st.w)
+                pipe->reserveRegister(d->flags.st.l ? d->flags.st.rd :
+                    d->flags.st.rs);
             
             // Check to see if we're doing fancy shifting, if so wait on source
             if (!d->flags.st.i)
@@ -1012,7 +2157,7 @@ void VirtualMachine::decodeInstruction(PipelineData *d)
                         (d->flags.st.offset & kShiftRsMask) >> 7);
                 }
             }
-            
+        
         } else {
             // Only other case is a data processing op
             // extract all operands and flags
@@ -1023,9 +2168,27 @@ void VirtualMachine::decodeInstruction(PipelineData *d)
             d->flags.dp.rs =  ( (_ir & kDPSourceMask) >> 15 );
             d->flags.dp.rd = ( (_ir & kDPDestMask) >> 10);
             d->flags.dp.offset = ( (_ir & kDPOperandTwoMask) );
+            d->flags.dp.kernel = ALU::kernelFor(d->flags.dp);
             
             pipe->waitOnRegister(d->flags.dp.rs);
             
+            // Reserve the destination, unless the op only sets status bits
+            if (d->flags.dp.op == kMUL)
+            {
+                // Accumulating multiplies read pq before writing it
+                if (ALU::accumulates(d->flags.dp.rd))
+                {
+                    pipe->waitOnRegister(kPQ0Code);
+                    pipe->waitOnRegister(kPQ1Code);
+                }
+                pipe->reserveRegister(kPQ0Code);
+                pipe->reserveRegister(kPQ1Code);
+            } else if ((d->flags.dp.op < kCMP || d->flags.dp.op > kTEQ) &&
+                d->flags.dp.op != kNOP) {
+                pipe->reserveRegister(d->flags.dp.rd);
+            }
+            if (d->flags.dp.s) pipe->reserveRegister(kPSRCode);
+            
             // we might be shifting by register vals
             if (!d->flags.dp.i)
             {
@@ -1052,16 +2215,34 @@ void VirtualMachine::decodeInstruction(PipelineData *d)
     
     // Are we a branch?
     if ((_ir & kBranchMask) == 0x0) {
-        // We could be trying to execute something in reserved space
-        if (_ir & kReservedSpaceMask == 0x0)
+        // We could be trying to execute something in reserved space, of
+        // which 1000 is the packed ops and 1001 the atomic ones
+        if ((_ir & kReservedSpaceMask) == 0x0)
         {
             d->instruction_class = kReserved;
+            if (_ir & kSIMDSpaceMask)
+            {
+                decodeAtomic(d);
+                return;
+            }
+            
+            d->flags.p.op = (_ir & kSIMDOpCodeMask) >> 20;
+            d->flags.p.h = (_ir & kSIMDHalfwordMask) ? 1 : 0;
+            d->flags.p.rs = (_ir & kSIMDSourceMask) >> 15;
+            d->flags.p.rd = (_ir & kSIMDDestMask) >> 10;
+            d->flags.p.rm = (_ir & kSIMDOperandMask) >> 5;
+            if (!SIMDOpMnemonics[d->flags.p.op]) return;
+            
+            d->instruction_class = kSIMD;
+            pipe->waitOnRegister(d->flags.p.rs);
+            pipe->waitOnRegister(d->flags.p.rm);
+            pipe->reserveRegister(d->flags.p.rd);
         } else {
             d->instruction_class = kBranch;
             // We're a branch
             
-            if ( _ir & kBranchLBitMask)
-                d->flags.b.link = true;
+            d->flags.b.link = (_ir & kBranchLBitMask) ? true : false;
+            if (d->flags.b.link) pipe->reserveRegister(kR15Code);
             
             // Left shift the address by two because instructions
             // are word-aligned
@@ -1087,9 +2268,27 @@ void VirtualMachine::decodeInstruction(PipelineData *d)
         d->flags.fp.n = ((_ir & kFPnMask) >> 11);
         d->flags.fp.m = ((_ir & kFPmMask) >> 8);
         
-        // TODO: Optimize this
+        // Encodings without an op are reserved
+        char op = d->flags.fp.op;
+        if (!FPOpMnemonics[op])
+        {
+            d->instruction_class = kReserved;
+            return;
+        }
+        
         pipe->waitOnRegister(d->flags.fp.n + kFPR0Code);
-        pipe->waitOnRegister(d->flags.fp.m + kFPR0Code);
+        if (op != kFSQ && op != kFLT && op != kFIX)
+            pipe->waitOnRegister(d->flags.fp.m + kFPR0Code);
+        if (op == kFMA)
+            pipe->waitOnRegister(d->flags.fp.d + kFPR0Code);
+        
+        // Compares set the status bits, everything else has a result, and
+        // all of them can raise exceptions
+        if (FPU::compares(op))
+            pipe->reserveRegister(kPSRCode);
+        else
+            pipe->reserveRegister(d->flags.fp.s + kFPR0Code);
+        pipe->reserveRegister(kFPSRCode);
         
         return;
     }
@@ -1099,6 +2298,37 @@ void VirtualMachine::decodeInstruction(PipelineData *d)
     d->flags.i.comment = (_ir & kSWIntCommentMask);
 }
 
+void VirtualMachine::decodeAtomic(PipelineData *d)
+{
+    d->flags.a.op = (_ir & kAtomicOpCodeMask) >> 20;
+    d->flags.a.rs = (_ir & kAtomicAddressMask) >> 15;
+    d->flags.a.rd = (_ir & kAtomicDestMask) >> 10;
+    d->flags.a.rm = (_ir & kAtomicValueMask) >> 5;
+    if (!AtomicOpMnemonics[d->flags.a.op]) return;
+    
+    pipe->waitOnRegister(d->flags.a.rs);
+    
+    // Cache ops don't have a result, and only STNT has a value.  PLD's rm
+    // is the level to prefetch to.
+    if (d->flags.a.op >= kPLD)
+    {
+        d->instruction_class = kCacheControl;
+        if (d->flags.a.op == kSTNT) pipe->waitOnRegister(d->flags.a.rm);
+        return;
+    }
+    
+    d->instruction_class = kAtomic;
+    
+    // Everything but LDL stores rm, and CAS compares with rd first
+    if (d->flags.a.op != kLDL) pipe->waitOnRegister(d->flags.a.rm);
+    if (d->flags.a.op == kCAS)
+    {
+        pipe->waitOnRegister(d->flags.a.rd);
+        pipe->reserveRegister(kPSRCode);
+    }
+    pipe->reserveRegister(d->flags.a.rd);
+}
+
 void VirtualMachine::executeInstruction(PipelineData *d)
 {
     if (!d)
@@ -1110,7 +2340,15 @@ void VirtualMachine::executeInstruction(PipelineData *d)
     // If the cond code precludes execution of the op, don't bother
     evaluateConditional(d);
     
-    if (!d->executes) return;
+    if (!d->executes)
+    {
+        // Nothing will be written, so don't hold up anything behind us
+        pipe->unlock();
+        
+        // Writeback still has to check what fetch predicted for this op
+        if (_forwarding) writeBack(d);
+        return;
+    }
     
     // Print instruction if requested
     if (_print_instruction)
@@ -1133,55 +2371,56 @@ void VirtualMachine::executeInstruction(PipelineData *d)
     {
         case kDataProcessing:
         
-        if (d->flags.dp.op == kMUL)
-        {
-            // lock PQ registers if it's a mul
-            pipe->lock(kPQ0Code);
-            pipe->lock(kPQ1Code);
-        } else {
-            // lock dest register
-            pipe->lock(d->flags.dp.rd);
-        }
-        
-        // Do the job
-        incCycleCount(alu->dataProcessing(d->flags.dp));
+        // Do the job, with the kernel decode picked
+        d->latency = alu->execute(d->flags.dp);
+        incCycleCount(d->latency);
         
         // Save emitted values
         d->record = alu->result();
         d->output0 = alu->output();
         d->output1 = alu->auxOut();
         
+        // The ALU sets the status bits as it goes, so they're already
+        // there for anything that is waiting on them
+        if (d->flags.dp.s) pipe->produce(kPSRCode, _psr);
+        
+        // The multiplier isn't done until the end of the memory stage, so
+        // only forward ordinary results from here
+        if (_bypass_ex && d->record && d->flags.dp.op != kMUL)
+            pipe->produce(d->flags.dp.rd, d->output0);
+        
         // release the register if there's no writeback stage
         if (_forwarding) writeBack(d);
         break;
         
         case kSingleTransfer:
         
-        // lock dest register if it's a load
-        if (d->flags.st.l)
-            pipe->lock(d->flags.st.rd);
-        
-        // lock source register if there will be writeback
-        if (d->flags.st.w)
-            pipe->lock(d->flags.st.rs);
-        
         // Here we use the alu to calculate the address we're going to be
         // transfering to or from.
-        incCycleCount(alu->singleTransfer(d->flags.st));
+        d->latency = alu->singleTransfer(d->flags.st);
+        incCycleCount(d->latency);
         
         // Save emitted values
         d->record = alu->result();
         d->output0 = alu->output(); // value, if any, to be written to base
         d->output1 = alu->auxOut(); // Computed source address for this op
+        d->address = d->output1;
+        
+        // The updated base is known now, but loaded values have to wait for
+        // the memory stage
+        if (_bypass_ex && d->flags.st.w)
+            pipe->produce(d->flags.st.l ? d->flags.st.rd : d->flags.st.rs,
+                d->output0);
         break;
         
         case kBranch:
-        // As far as I can see, there is no reason to lock a register here
-        // since once writeback occurs, everything will get invalidated
-        
         // Calculate offset based on location of the instruction
         d->flags.b.offset += ((signed int)d->location);
         
+        // The link register is just where we are
+        if (_bypass_ex && d->flags.b.link)
+            pipe->produce(kR15Code, d->location);
+        
         if (_forwarding) writeBack(d);
         break;
         
@@ -1193,21 +2432,44 @@ void VirtualMachine::executeInstruction(PipelineData *d)
         
         case kFloatingPoint:
         
-        // TODO: optimize this
-        pipe->lock(d->flags.fp.s + kFPR0Code);
-        pipe->lock(d->flags.fp.d + kFPR0Code);
-        
-        // Have the FPU do the operation
+        // Have the FPU do the operation.  It only holds us up until it can
+        // start, the rest of its latency is on its own scoreboard.
         incCycleCount(fpu->execute(d->flags.fp));
+        d->latency = fpu->latency();
         
-        // Save emitted values
-        d->record = alu->result();
-        d->output0 = alu->output();
-        d->output1 = alu->auxOut();
+        // Save emitted values: the result and the exceptions it raised
+        d->record = FPU::writesResult(d->flags.fp.op);
+        d->output0 = fpu->output();
+        d->output1 = fpu->exceptions();
+        
+        if (FPU::compares(d->flags.fp.op)) pipe->produce(kPSRCode, _psr);
+        if (_bypass_ex && d->record)
+            pipe->produce(d->flags.fp.s + kFPR0Code, d->output0);
+        
+        if (_forwarding) writeBack(d);
+        break;
+        
+        case kSIMD:
+        d->latency = simd->execute(d->flags.p);
+        incCycleCount(d->latency);
+        
+        d->record = true;
+        d->output0 = simd->output();
+        if (_bypass_ex) pipe->produce(d->flags.p.rd, d->output0);
         
         if (_forwarding) writeBack(d);
         break;
         
+        case kAtomic:
+        case kCacheControl:
+        // Only the operands are read here, the memory stage does the rest
+        d->latency = 0;
+        d->record = (d->instruction_class == kAtomic);
+        d->address = selectRegister(d->flags.a.rs);
+        d->output0 = selectRegister(d->flags.a.rd);
+        d->output1 = selectRegister(d->flags.a.rm);
+        break;
+        
         case kReserved:
         default:
         trap("Unknown or reserved opcode.\n");
@@ -1228,7 +2490,8 @@ void VirtualMachine::memoryAccess(PipelineData *d)
     switch (d->instruction_class)
     {
         case kSingleTransfer:
-        incCycleCount(mmu->singleTransfer(d->flags.st, d->output1));
+        d->memory_latency = mmu->singleTransfer(d->flags.st, d->output1);
+        incCycleCount(d->memory_latency);
         
         // Save values emitted by MMU;
         d->output1 = mmu->readOut();  // value, if any, to be written from load
@@ -1236,9 +2499,39 @@ void VirtualMachine::memoryAccess(PipelineData *d)
         if (_forwarding) writeBack(d);
         break;
         
+        case kAtomic:
+        d->memory_latency = mmu->atomic(d->flags.a, d->address, d->output0,
+            d->output1);
+        incCycleCount(d->memory_latency);
+        
+        // CAS says whether it stored in Z
+        if (d->flags.a.op == kCAS)
+        {
+            if (mmu->readOut() == d->output0)
+                _psr |= kPSRZBit;
+            else
+                _psr &= ~kPSRZBit;
+            pipe->produce(kPSRCode, _psr);
+        }
+        d->output0 = mmu->readOut();
+        
+        if (_forwarding) writeBack(d);
+        break;
+        
+        case kCacheControl:
+        d->memory_latency = mmu->cacheControl(d->flags.a, d->address,
+            d->output1);
+        incCycleCount(d->memory_latency);
+        
+        if (_forwarding) writeBack(d);
+        break;
+        
         default:
         break;
     }
+    
+    // Everything this instruction computed can be forwarded from here on
+    if (_bypass_mem) forwardResults(d);
 }
 
 // Single stage pipe
@@ -1249,3 +2542,8 @@ void VirtualMachine::doInstruction(PipelineData *d)
     executeInstruction(d);
     memoryAccess(d);
 }
+
+void VirtualMachine::delayInstruction(PipelineData *d)
+{
+    // Nothing happens in this part of the stage, it only takes time
+}